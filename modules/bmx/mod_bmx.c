@@ -30,9 +30,16 @@
 #include "http_request.h"
 
 #include "apr_strings.h"
+#include "apr_lib.h"
 #include "apr_optional.h"
+#include "apr_hash.h"
+#include "apr_buckets.h"
+#include "util_filter.h"
 #include "mod_bmx.h"
 
+#include <stdlib.h>
+#include <float.h>
+
 #if AP_MODULE_MAGIC_AT_LEAST(20100606,0)
 APLOG_USE_MODULE(bmx);
 #endif
@@ -56,6 +63,12 @@ struct bmx_objectname BMX_DECLARE_DATA bmx_query_all;
  */
 #define BMX_HANDLER "bmx-handler"
 
+/**
+ * The size of the buffer into which beans are printed before it is passed
+ * down the output filters, as one bucket.
+ */
+#define BMX_OUTPUT_SIZE 8192
+
 /* --------------------------------------------------------------------
  * Configuration handling routines
  * -------------------------------------------------------------------- */
@@ -65,44 +78,171 @@ struct bmx_objectname BMX_DECLARE_DATA bmx_query_all;
  * -------------------------------------------------------------------- */
 
 /**
- * Print the BMX Bean Property to a string. If the property data type is
- * a built-in type then we convert directly, otherwise we use the
- * user-defined callback to perform the string convesion.
+ * The two digits of each number from 0 to 99, so integers are printed two
+ * digits at a time.
+ */
+static const char bmx_digits[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/**
+ * Print an unsigned integer backwards from the end of a buffer.
+ * @returns Where the number starts.
+ */
+static char *format_uint64(char *end, apr_uint64_t v)
+{
+    const char *d;
+
+    while (v >= 100) {
+        d = bmx_digits + (v % 100) * 2;
+        v /= 100;
+        *--end = d[1];
+        *--end = d[0];
+    }
+    if (v >= 10) {
+        d = bmx_digits + v * 2;
+        *--end = d[1];
+        *--end = d[0];
+    } else {
+        *--end = (char)('0' + v);
+    }
+    return end;
+}
+
+/**
+ * Print a signed integer backwards from the end of a buffer.
+ * @returns Where the number starts.
+ */
+static char *format_int64(char *end, apr_int64_t v)
+{
+    char *p;
+
+    if (v >= 0) {
+        return format_uint64(end, (apr_uint64_t)v);
+    }
+    p = format_uint64(end, 0 - (apr_uint64_t)v);
+    *--p = '-';
+    return p;
+}
+
+/**
+ * Print a floating point number in the fewest of FLT_DIG or 9 significant
+ * digits for a float, DBL_DIG or 17 for a double, that read back as the
+ * same value. Whole numbers are printed as integers, and the infinities
+ * and NaN as in OpenMetrics.
+ * @returns The length of the number at the start of buf.
  */
-static char *property_print(apr_pool_t *p, struct bmx_property *prop)
+static apr_size_t format_double(char *buf, double d, int is_float)
 {
+    char *p;
+    apr_size_t len;
+    double back;
+
+    if (d != d) {
+        memcpy(buf, "NaN", 3);
+        return 3;
+    }
+    if (d - d != 0) {
+        memcpy(buf, d > 0 ? "+Inf" : "-Inf", 4);
+        return 4;
+    }
+
+    /* 2^53, beyond which not every integer is a double */
+    if (d > -9007199254740992.0 && d < 9007199254740992.0
+        && d == (double)(apr_int64_t)d) {
+        p = format_int64(buf + BMX_VALUE_LEN, (apr_int64_t)d);
+        len = buf + BMX_VALUE_LEN - p;
+        memmove(buf, p, len);
+        return len;
+    }
+
+    /* most values read back from the shorter form, the others need all
+     * the digits of their type */
+    len = apr_snprintf(buf, BMX_VALUE_LEN, "%.*g",
+                       is_float ? FLT_DIG : DBL_DIG, d);
+    back = strtod(buf, NULL);
+    if (is_float ? (float)back != (float)d : back != d) {
+        len = apr_snprintf(buf, BMX_VALUE_LEN, "%.*g", is_float ? 9 : 17, d);
+    }
+    return len;
+}
+
+/**
+ * Print the value of a BMX Bean Property. Numbers are printed into buf,
+ * of BMX_VALUE_LEN bytes, without allocating anything; strings are
+ * returned as they are, and user-defined types are converted by their
+ * callback.
+ * @param p The pool for the callback of a user-defined type.
+ * @param prop The property to print.
+ * @param buf The buffer where numbers are printed.
+ * @param len Where the length of the value is returned.
+ * @returns The value, which is not NUL-terminated if printed into buf.
+ */
+BMX_DECLARE(const char *) bmx_property_value(apr_pool_t *p,
+                                             const struct bmx_property *prop,
+                                             char *buf, apr_size_t *len)
+{
+    char *end = buf + BMX_VALUE_LEN;
+    const char *str;
+
     switch (prop->value_type) {
     case BMX_BOOLEAN:
-        if (prop->value.boolean)
-            return "true";
-        else
-            return "false";
+        str = prop->value.boolean ? "true" : "false";
+        break;
     case BMX_BYTE:
-        return apr_psprintf(p, "%du", prop->value.byte);
+        str = format_uint64(end, prop->value.byte);
+        *len = end - str;
+        return str;
     case BMX_INT16:
-        return apr_psprintf(p, "%d", prop->value.int16);
+        str = format_int64(end, prop->value.int16);
+        *len = end - str;
+        return str;
     case BMX_UINT16:
-        return apr_psprintf(p, "%du", prop->value.uint16);
+        str = format_uint64(end, prop->value.uint16);
+        *len = end - str;
+        return str;
     case BMX_INT32:
-        return apr_psprintf(p, "%d", prop->value.int32);
+        str = format_int64(end, prop->value.int32);
+        *len = end - str;
+        return str;
     case BMX_UINT32:
-        return apr_psprintf(p, "%du", prop->value.uint32);
+        str = format_uint64(end, prop->value.uint32);
+        *len = end - str;
+        return str;
     case BMX_INT64:
-        return apr_psprintf(p, "%" APR_INT64_T_FMT, prop->value.int64);
+        str = format_int64(end, prop->value.int64);
+        *len = end - str;
+        return str;
     case BMX_UINT64:
-        return apr_psprintf(p, "%" APR_UINT64_T_FMT, prop->value.uint64);
+        str = format_uint64(end, prop->value.uint64);
+        *len = end - str;
+        return str;
     case BMX_FLOAT:
-        return apr_psprintf(p, "%f", prop->value.f);
+        *len = format_double(buf, prop->value.f, 1);
+        return buf;
     case BMX_DOUBLE:
-        return apr_psprintf(p, "%lf", prop->value.d);
+        *len = format_double(buf, prop->value.d, 0);
+        return buf;
     case BMX_STRING:
-        return prop->value.s;
+        str = prop->value.s;
+        break;
     case BMX_OTHER:
-        return prop->print_fn(p, prop->value.o);
+        str = prop->print_fn(p, prop->value.o);
+        break;
     case BMX_NULL:
     default:
-        return "";
+        str = NULL;
+        break;
     }
+
+    if (!str) {
+        str = "";
+    }
+    *len = strlen(str);
+    return str;
 }
 
 /**
@@ -217,6 +357,19 @@ BMX_DECLARE(struct bmx_property *) bmx_property_uint64_create(
     return ret;
 }
 
+/**
+ * Create an unsigned 64-bit long integer Bean Property counting something
+ * which only ever grows.
+ */
+BMX_DECLARE(struct bmx_property *) bmx_property_counter_create(
+                                       const char *key, apr_uint64_t ui,
+                                       apr_pool_t *p)
+{
+    struct bmx_property *ret = bmx_property_uint64_create(key, ui, p);
+    ret->counter = 1;
+    return ret;
+}
+
 /**
  * Create a floating point Bean Property.
  */
@@ -402,30 +555,55 @@ BMX_DECLARE(int) bmx_check_constraints(const struct bmx_objectname *query,
  * Utility routines
  * -------------------------------------------------------------------- */
 
+/**
+ * Find the value of the given query argument, or NULL if not given. The
+ * value runs up to the next '&'.
+ */
+static const char *bmx_query_arg(request_rec *r, const char *name)
+{
+    apr_size_t len = strlen(name);
+    const char *arg = r->args;
+
+    while (arg) {
+        if (!strncmp(arg, name, len) && arg[len] == '=') {
+            return arg + len + 1;
+        }
+        arg = strchr(arg, '&');
+        if (arg) {
+            arg++;
+        }
+    }
+    return NULL;
+}
+
 #define MAX_DOMAIN_LEN 128
 #define MAX_CONSTRAINTS_LEN 1024
-#define QUERY_FORMAT "query=%128[^:]:%1024s"
-#define ALL_QUERY "query=*:*"
+/* the constraints end at the next argument, as in query=d:k=v&from=... */
+#define QUERY_FORMAT "%127[^:]:%1023[^&]"
+#define ALL_QUERY "*:*"
 static int parse_query(request_rec *r, struct bmx_objectname **query)
 {
     char domain[MAX_DOMAIN_LEN];
     char constraints[MAX_CONSTRAINTS_LEN];
     static const char *format = QUERY_FORMAT;
+    const char *args = bmx_query_arg(r, "query");
 
-    /* no query args? return everything */
-    if (!r->args || r->args[0] == '\0') {
+    /* no query? return everything */
+    if (!args || args[0] == '\0' || args[0] == '&') {
         *query = BMX_QUERY_ALL;
         goto out;
     }
 
     /* shortcut for full-query matches */
-    if (0 == strncmp(r->args, ALL_QUERY, sizeof(ALL_QUERY))) {
+    if (0 == strncmp(args, ALL_QUERY, sizeof(ALL_QUERY) - 1)
+        && (args[sizeof(ALL_QUERY) - 1] == '\0'
+            || args[sizeof(ALL_QUERY) - 1] == '&')) {
         *query = BMX_QUERY_ALL;
         goto out;
     }
 
     /* parse out the domain and constraints */
-    if ((2 == sscanf(r->args, format, domain, constraints))) {
+    if ((2 == sscanf(args, format, domain, constraints))) {
         struct bmx_objectname *ret = apr_pcalloc(r->pool, sizeof(*ret));
         if (domain[0] == '\0')
             ret->domain = "*";
@@ -603,6 +781,216 @@ BMX_DECLARE(apr_size_t) bmx_objectname_str(const struct bmx_objectname *on,
     return p - buf;
 }
 
+/**
+ * The response being printed by the handler. Beans are printed into a fixed
+ * buffer, which is passed down the output filters as a transient bucket
+ * each time it fills up, so the memory used by a response does not grow
+ * with the number of beans in it. The filters set aside whatever they keep
+ * of a transient bucket, so the buffer can be reused as soon as they
+ * return.
+ */
+struct bmx_output {
+    /** The request being answered */
+    request_rec *r;
+    /** The brigade passed down the output filters, empty between passes */
+    apr_bucket_brigade *bb;
+    /** The first error passing the output, after which nothing is sent */
+    apr_status_t rv;
+    /** The number of bytes in the buffer */
+    apr_size_t len;
+    /** The number of beans printed so far */
+    apr_size_t beans;
+    /** The state of the printer, if it keeps any */
+    void *data;
+    /** The buffer */
+    char buf[BMX_OUTPUT_SIZE];
+};
+
+/**
+ * Start the output of the given request, which the bean printers find in
+ * its request config.
+ */
+static struct bmx_output *bmx_output_create(request_rec *r)
+{
+    struct bmx_output *out = apr_palloc(r->pool, sizeof(*out));
+
+    out->r = r;
+    out->bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+    out->rv = APR_SUCCESS;
+    out->len = 0;
+    out->beans = 0;
+    out->data = NULL;
+    ap_set_module_config(r->request_config, &bmx_module, out);
+    return out;
+}
+
+/**
+ * Pass what is in the buffer down the output filters.
+ */
+static apr_status_t bmx_output_flush(struct bmx_output *out)
+{
+    apr_bucket *b;
+
+    if (out->len == 0 || out->rv != APR_SUCCESS) {
+        out->len = 0;
+        return out->rv;
+    }
+
+    b = apr_bucket_transient_create(out->buf, out->len,
+                                    out->bb->bucket_alloc);
+    APR_BRIGADE_INSERT_TAIL(out->bb, b);
+    out->rv = ap_pass_brigade(out->r->output_filters, out->bb);
+    apr_brigade_cleanup(out->bb);
+    out->len = 0;
+    return out->rv;
+}
+
+/**
+ * Pass a brigade of output down the output filters after what is in the
+ * buffer, leaving the brigade empty.
+ */
+static apr_status_t bmx_output_pass(struct bmx_output *out,
+                                    apr_bucket_brigade *bb)
+{
+    if (bmx_output_flush(out) == APR_SUCCESS) {
+        out->rv = ap_pass_brigade(out->r->output_filters, bb);
+    }
+    apr_brigade_cleanup(bb);
+    return out->rv;
+}
+
+/**
+ * Add len bytes to the output, passing the buffer down whenever it fills.
+ */
+static void bmx_output_write(struct bmx_output *out, const char *str,
+                             apr_size_t len)
+{
+    apr_size_t n;
+
+    while (len > 0 && out->rv == APR_SUCCESS) {
+        if (out->len == BMX_OUTPUT_SIZE) {
+            (void)bmx_output_flush(out);
+            continue;
+        }
+        n = BMX_OUTPUT_SIZE - out->len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(out->buf + out->len, str, n);
+        out->len += n;
+        str += n;
+        len -= n;
+    }
+}
+
+/**
+ * Add a string to the output.
+ */
+static void bmx_output_puts(struct bmx_output *out, const char *str)
+{
+    bmx_output_write(out, str, strlen(str));
+}
+
+/**
+ * Write to the response of a BMX query, for use by bmx_printer
+ * implementations.
+ */
+BMX_DECLARE(void) bmx_response_write(request_rec *r, const char *str,
+                                     apr_size_t len)
+{
+    struct bmx_output *out = ap_get_module_config(r->request_config,
+                                                  &bmx_module);
+    bmx_output_write(out, str, len);
+}
+
+/**
+ * Add the characters of a JSON string to the output, escaping those which
+ * must be, without the quotes around them.
+ */
+static void bmx_output_json_write(struct bmx_output *out, const char *str,
+                                  apr_size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+    const char *run = str, *end = str + len;
+    char esc[6] = { '\\', 'u', '0', '0' };
+
+    for (; str < end; str++) {
+        unsigned char c = (unsigned char)*str;
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        bmx_output_write(out, run, str - run);
+        run = str + 1;
+        if (c == '"' || c == '\\') {
+            esc[1] = c;
+            bmx_output_write(out, esc, 2);
+            esc[1] = 'u';
+        } else {
+            esc[4] = hex[c >> 4];
+            esc[5] = hex[c & 0xf];
+            bmx_output_write(out, esc, 6);
+        }
+    }
+    bmx_output_write(out, run, str - run);
+}
+
+/**
+ * A private internal data structure used while printing the properties of
+ * an objectname to the output.
+ */
+struct bmx_output_objectname_data {
+    struct bmx_output *out;
+    void (*write)(struct bmx_output *out, const char *str, apr_size_t len);
+    int first;
+};
+
+static int bmx_output_objectname_iterator(void *rec, const char *key,
+                                          const char *value)
+{
+    struct bmx_output_objectname_data *data
+        = (struct bmx_output_objectname_data *)rec;
+
+    /* ignore anything with missing keys or values */
+    if (key && value) {
+        if (data->first) {
+            data->first = 0;
+        } else {
+            bmx_output_write(data->out, ",", 1);
+        }
+        data->write(data->out, key, strlen(key));
+        bmx_output_write(data->out, "=", 1);
+        data->write(data->out, value, strlen(value));
+    }
+    return 1;
+}
+
+/**
+ * Print an objectname to the output, as bmx_objectname_str() would, its
+ * domain and properties written by the given function.
+ */
+static void bmx_output_objectname(struct bmx_output *out,
+                                  const struct bmx_objectname *on,
+                                  void (*write)(struct bmx_output *out,
+                                                const char *str,
+                                                apr_size_t len))
+{
+    struct bmx_output_objectname_data data = { out, write, 1 };
+
+    if (on->domain) {
+        write(out, on->domain, strlen(on->domain));
+    } else {
+        bmx_output_write(out, "*", 1);
+    }
+    bmx_output_write(out, ":", 1);
+    if (on->props) {
+        (void)apr_table_do(bmx_output_objectname_iterator, &data,
+                           on->props, NULL);
+    }
+    if (data.first) { /* none were printed */
+        bmx_output_write(out, "*", 1);
+    }
+}
+
 /**
  * Called by other modules to print their "jmx beans" to the response in
  * whatever format was requested by the client.
@@ -610,33 +998,616 @@ BMX_DECLARE(apr_size_t) bmx_objectname_str(const struct bmx_objectname *on,
 static apr_status_t bmx_bean_print_text_plain(request_rec *r,
                                               const struct bmx_bean *bean)
 {
-    apr_size_t objectname_strlen = bmx_objectname_strlen(bean->objectname) + 1;
-    char *objectname_str = apr_palloc(r->pool, objectname_strlen);
-    (void)bmx_objectname_str(bean->objectname, objectname_str,
-                             objectname_strlen);
-    (void)ap_rputs("Name: ", r);
-    (void)ap_rputs(objectname_str, r);
-    (void)ap_rputs("\n", r);
+    struct bmx_output *out = ap_get_module_config(r->request_config,
+                                                  &bmx_module);
+
+    bmx_output_write(out, "Name: ", sizeof("Name: ") - 1);
+    bmx_output_objectname(out, bean->objectname, bmx_output_write);
+    bmx_output_write(out, "\n", 1);
 
     /* for each element in bean->bean_properties, print it */
     if (!APR_RING_EMPTY(&(bean->bean_props), bmx_property, link)) {
         struct bmx_property *p = NULL;
+        char buf[BMX_VALUE_LEN];
         const char *value;
+        apr_size_t len;
         for (p = APR_RING_FIRST(&(bean->bean_props));
              p != APR_RING_SENTINEL(&(bean->bean_props), bmx_property, link);
              p = APR_RING_NEXT(p, link)) {
-            (void)ap_rputs(p->key, r);
-            (void)ap_rputs(": ", r);
-            value = property_print(r->pool, p);
-            if (value)
-                (void)ap_rputs(value, r);
-            (void)ap_rputs("\n", r);
+            bmx_output_puts(out, p->key);
+            bmx_output_write(out, ": ", 2);
+            value = bmx_property_value(r->pool, p, buf, &len);
+            bmx_output_write(out, value, len);
+            bmx_output_write(out, "\n", 1);
         }
     }
-    (void)ap_rputs("\n", r);
+    bmx_output_write(out, "\n", 1);
+    out->beans++;
+    return out->rv;
+}
+
+static const struct bmx_printer bmx_printer_text_plain = {
+    "text/plain",
+    NULL,
+    bmx_bean_print_text_plain,
+    NULL
+};
+
+/**
+ * Add the value of a bean property to the output as a JSON value. Numbers
+ * and booleans are printed as such, other than the infinities and NaN
+ * which JSON has no numbers for.
+ */
+static void bmx_output_json_value(struct bmx_output *out, apr_pool_t *p,
+                                  const struct bmx_property *prop)
+{
+    char buf[BMX_VALUE_LEN];
+    const char *value;
+    apr_size_t len;
+    double d;
+
+    switch (prop->value_type) {
+    case BMX_NULL:
+        bmx_output_write(out, "null", 4);
+        return;
+    case BMX_FLOAT:
+    case BMX_DOUBLE:
+        d = prop->value_type == BMX_FLOAT ? prop->value.f : prop->value.d;
+        if (d != d || d - d != 0) {
+            bmx_output_write(out, "null", 4);
+            return;
+        }
+        /* fall through */
+    case BMX_BOOLEAN:
+    case BMX_BYTE:
+    case BMX_INT16:
+    case BMX_UINT16:
+    case BMX_INT32:
+    case BMX_UINT32:
+    case BMX_INT64:
+    case BMX_UINT64:
+        value = bmx_property_value(p, prop, buf, &len);
+        bmx_output_write(out, value, len);
+        return;
+    default:
+        value = bmx_property_value(p, prop, buf, &len);
+        bmx_output_write(out, "\"", 1);
+        bmx_output_json_write(out, value, len);
+        bmx_output_write(out, "\"", 1);
+        return;
+    }
+}
+
+static apr_status_t bmx_bean_begin_json(request_rec *r)
+{
+    bmx_response_write(r, "{\"beans\":[", sizeof("{\"beans\":[") - 1);
     return APR_SUCCESS;
 }
 
+/**
+ * Print a bean as a JSON object, with its objectname as the "name" member
+ * and a member for each of its properties.
+ */
+static apr_status_t bmx_bean_print_json(request_rec *r,
+                                        const struct bmx_bean *bean)
+{
+    struct bmx_output *out = ap_get_module_config(r->request_config,
+                                                  &bmx_module);
+    struct bmx_property *p;
+
+    if (out->beans++) {
+        bmx_output_write(out, ",\n{\"name\":\"", 11);
+    } else {
+        bmx_output_write(out, "\n{\"name\":\"", 10);
+    }
+    bmx_output_objectname(out, bean->objectname, bmx_output_json_write);
+    bmx_output_write(out, "\"", 1);
+
+    for (p = APR_RING_FIRST(&(bean->bean_props));
+         p != APR_RING_SENTINEL(&(bean->bean_props), bmx_property, link);
+         p = APR_RING_NEXT(p, link)) {
+        bmx_output_write(out, ",\"", 2);
+        bmx_output_json_write(out, p->key, strlen(p->key));
+        bmx_output_write(out, "\":", 2);
+        bmx_output_json_value(out, r->pool, p);
+    }
+    bmx_output_write(out, "}", 1);
+    return out->rv;
+}
+
+static apr_status_t bmx_bean_end_json(request_rec *r)
+{
+    bmx_response_write(r, "\n]}\n", 4);
+    return APR_SUCCESS;
+}
+
+static const struct bmx_printer bmx_printer_json = {
+    "application/json",
+    bmx_bean_begin_json,
+    bmx_bean_print_json,
+    bmx_bean_end_json
+};
+
+/**
+ * A growing buffer, for the names and labels of OpenMetrics samples.
+ */
+struct bmx_om_buf {
+    char *data;
+    apr_size_t len;
+    apr_size_t size;
+};
+
+/**
+ * The types of the metric families of the OpenMetrics output.
+ */
+enum bmx_om_type {
+    /** Numbers other than counters */
+    BMX_OM_UNKNOWN,
+    /** Numbers from bmx_property_counter_create() */
+    BMX_OM_COUNTER,
+    /** Strings */
+    BMX_OM_INFO
+};
+
+/** The names of the types of metric families, as in the TYPE lines */
+static const char *const bmx_om_type_names[] = {
+    "unknown", "counter", "info"
+};
+
+/** The suffixes of the sample names of each type of metric family */
+static const char *const bmx_om_type_suffixes[] = {
+    "", "_total", "_info"
+};
+
+/**
+ * A metric family of the OpenMetrics output, from one property key of the
+ * beans of one domain. Its samples are kept until the end of the response,
+ * since those of a family may not be interleaved with others, so the
+ * memory taken by a response grows with the number of its beans.
+ */
+struct bmx_om_family {
+    /** The name of the family */
+    const char *name;
+    /** The domain of the beans */
+    const char *domain;
+    /** The property key */
+    const char *key;
+    /** The type of the family */
+    enum bmx_om_type type;
+    /** The samples of the family */
+    apr_bucket_brigade *bb;
+};
+
+/**
+ * The state of the OpenMetrics printer during a response.
+ */
+struct bmx_om {
+    /** The families by name */
+    apr_hash_t *families;
+    /** The families in the order they were first seen */
+    apr_array_header_t *order;
+    /** The labels of the bean being printed */
+    struct bmx_om_buf labels;
+    /** The name of the family of the property being printed */
+    struct bmx_om_buf name;
+};
+
+static void bmx_om_add(apr_pool_t *p, struct bmx_om_buf *buf,
+                       const char *str, apr_size_t len)
+{
+    if (buf->len + len > buf->size) {
+        char *data;
+        buf->size = (buf->len + len) * 2;
+        data = apr_palloc(p, buf->size);
+        memcpy(data, buf->data, buf->len);
+        buf->data = data;
+    }
+    memcpy(buf->data + buf->len, str, len);
+    buf->len += len;
+}
+
+/**
+ * Add a metric or label name, with the characters OpenMetrics does not
+ * allow in names replaced by '_'.
+ */
+static void bmx_om_add_name(apr_pool_t *p, struct bmx_om_buf *buf,
+                            const char *str)
+{
+    apr_size_t start = buf->len;
+    char *c;
+
+    bmx_om_add(p, buf, str, strlen(str));
+    for (c = buf->data + start; c < buf->data + buf->len; c++) {
+        if (!apr_isalnum(*c) && *c != '_') {
+            *c = '_';
+        }
+    }
+    if (buf->len > start && apr_isdigit(buf->data[start])) {
+        buf->data[start] = '_';
+    }
+}
+
+/**
+ * Add a label value, escaped as OpenMetrics requires.
+ */
+static void bmx_om_add_value(apr_pool_t *p, struct bmx_om_buf *buf,
+                             const char *str, apr_size_t len)
+{
+    const char *run = str, *end = str + len;
+
+    for (; str < end; str++) {
+        if (*str != '\\' && *str != '"' && *str != '\n') {
+            continue;
+        }
+        bmx_om_add(p, buf, run, str - run);
+        if (*str == '\n') {
+            bmx_om_add(p, buf, "\\n", 2);
+        } else {
+            bmx_om_add(p, buf, "\\", 1);
+            bmx_om_add(p, buf, str, 1);
+        }
+        run = str + 1;
+    }
+    bmx_om_add(p, buf, run, str - run);
+}
+
+static int bmx_om_labels_iterator(void *rec, const char *key,
+                                  const char *value)
+{
+    request_rec *r = rec;
+    struct bmx_output *out = ap_get_module_config(r->request_config,
+                                                  &bmx_module);
+    struct bmx_om *om = out->data;
+
+    /* ignore anything with missing keys or values */
+    if (key && value) {
+        if (om->labels.len) {
+            bmx_om_add(r->pool, &om->labels, ",", 1);
+        }
+        bmx_om_add_name(r->pool, &om->labels, key);
+        bmx_om_add(r->pool, &om->labels, "=\"", 2);
+        bmx_om_add_value(r->pool, &om->labels, value, strlen(value));
+        bmx_om_add(r->pool, &om->labels, "\"", 1);
+    }
+    return 1;
+}
+
+static apr_status_t bmx_bean_begin_openmetrics(request_rec *r)
+{
+    struct bmx_output *out = ap_get_module_config(r->request_config,
+                                                  &bmx_module);
+    struct bmx_om *om = apr_pcalloc(r->pool, sizeof(*om));
+
+    om->families = apr_hash_make(r->pool);
+    om->order = apr_array_make(r->pool, 64, sizeof(struct bmx_om_family *));
+    out->data = om;
+    return APR_SUCCESS;
+}
+
+/**
+ * Find the family of a property of a bean, creating it when first seen. A
+ * property whose type differs from that of the family first seen under
+ * its name goes into another family, named after the type as well.
+ */
+static struct bmx_om_family *bmx_om_family_get(request_rec *r,
+                                               struct bmx_om *om,
+                                               const char *domain,
+                                               const char *key,
+                                               enum bmx_om_type type)
+{
+    struct bmx_om_family *family;
+
+    om->name.len = 0;
+    bmx_om_add_name(r->pool, &om->name, domain);
+    bmx_om_add(r->pool, &om->name, "_", 1);
+    bmx_om_add_name(r->pool, &om->name, key);
+
+    family = apr_hash_get(om->families, om->name.data, om->name.len);
+    if (family && family->type != type) {
+        bmx_om_add(r->pool, &om->name, "_", 1);
+        bmx_om_add_name(r->pool, &om->name, bmx_om_type_names[type]);
+        family = apr_hash_get(om->families, om->name.data, om->name.len);
+        if (!family) {
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r, "The %s property "
+                          "%s of the %s beans is also of another type, "
+                          "printed as %.*s", bmx_om_type_names[type], key,
+                          domain, (int)om->name.len, om->name.data);
+        }
+    }
+    if (!family) {
+        family = apr_pcalloc(r->pool, sizeof(*family));
+        family->name = apr_pstrmemdup(r->pool, om->name.data, om->name.len);
+        family->domain = apr_pstrdup(r->pool, domain);
+        family->key = apr_pstrdup(r->pool, key);
+        family->type = type;
+        family->bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+        apr_hash_set(om->families, family->name, om->name.len, family);
+        *(struct bmx_om_family **)apr_array_push(om->order) = family;
+    }
+    return family;
+}
+
+/**
+ * Print a bean as OpenMetrics samples, one for each of its properties in
+ * the family named after its domain and the property key, labelled by the
+ * properties of its objectname. Numbers are the values of their samples,
+ * those of counters named with _total; strings are the value label of an
+ * info sample.
+ */
+static apr_status_t bmx_bean_print_openmetrics(request_rec *r,
+                                               const struct bmx_bean *bean)
+{
+    struct bmx_output *out = ap_get_module_config(r->request_config,
+                                                  &bmx_module);
+    struct bmx_om *om = out->data;
+    const char *domain = bean->objectname->domain;
+    struct bmx_om_family *family;
+    struct bmx_property *p;
+    char buf[BMX_VALUE_LEN];
+    const char *value;
+    apr_size_t len;
+    double d;
+    enum bmx_om_type type;
+    int info;
+
+    om->labels.len = 0;
+    if (bean->objectname->props) {
+        (void)apr_table_do(bmx_om_labels_iterator, r,
+                           bean->objectname->props, NULL);
+    }
+
+    for (p = APR_RING_FIRST(&(bean->bean_props));
+         p != APR_RING_SENTINEL(&(bean->bean_props), bmx_property, link);
+         p = APR_RING_NEXT(p, link)) {
+        if (p->value_type == BMX_NULL) {
+            continue;
+        }
+        info = p->value_type == BMX_STRING || p->value_type == BMX_OTHER;
+        type = info ? BMX_OM_INFO
+             : p->counter ? BMX_OM_COUNTER : BMX_OM_UNKNOWN;
+        family = bmx_om_family_get(r, om, domain ? domain : "bmx", p->key,
+                                   type);
+
+        value = buf;
+        if (p->value_type == BMX_BOOLEAN) {
+            value = p->value.boolean ? "1" : "0";
+            len = 1;
+        } else if (p->value_type == BMX_FLOAT
+                   || p->value_type == BMX_DOUBLE) {
+            d = p->value_type == BMX_FLOAT ? p->value.f : p->value.d;
+            if (d != d) {
+                value = "NaN";
+                len = 3;
+            } else if (d - d != 0) {
+                value = d > 0 ? "+Inf" : "-Inf";
+                len = 4;
+            } else {
+                value = bmx_property_value(r->pool, p, buf, &len);
+            }
+        } else if (!info) {
+            value = bmx_property_value(r->pool, p, buf, &len);
+        }
+
+        /* the name of the family is in om->name, then come the labels
+         * and the value of the sample */
+        bmx_om_add(r->pool, &om->name, bmx_om_type_suffixes[type],
+                   strlen(bmx_om_type_suffixes[type]));
+        if (om->labels.len || info) {
+            bmx_om_add(r->pool, &om->name, "{", 1);
+            bmx_om_add(r->pool, &om->name, om->labels.data, om->labels.len);
+        }
+        if (info) {
+            value = bmx_property_value(r->pool, p, buf, &len);
+            if (om->labels.len) {
+                bmx_om_add(r->pool, &om->name, ",", 1);
+            }
+            bmx_om_add(r->pool, &om->name, "value=\"", 7);
+            bmx_om_add_value(r->pool, &om->name, value, len);
+            bmx_om_add(r->pool, &om->name, "\"", 1);
+            value = "1";
+            len = 1;
+        }
+        if (om->labels.len || info) {
+            bmx_om_add(r->pool, &om->name, "}", 1);
+        }
+        bmx_om_add(r->pool, &om->name, " ", 1);
+        bmx_om_add(r->pool, &om->name, value, len);
+        bmx_om_add(r->pool, &om->name, "\n", 1);
+
+        (void)apr_brigade_write(family->bb, NULL, NULL, om->name.data,
+                                om->name.len);
+    }
+
+    out->beans++;
+    return out->rv;
+}
+
+/**
+ * Print the metric families, each described once before its samples, and
+ * the end of the exposition.
+ */
+static apr_status_t bmx_bean_end_openmetrics(request_rec *r)
+{
+    struct bmx_output *out = ap_get_module_config(r->request_config,
+                                                  &bmx_module);
+    struct bmx_om *om = out->data;
+    struct bmx_om_family *family;
+    int i;
+
+    for (i = 0; i < om->order->nelts; i++) {
+        family = APR_ARRAY_IDX(om->order, i, struct bmx_om_family *);
+
+        bmx_output_write(out, "# TYPE ", 7);
+        bmx_output_puts(out, family->name);
+        bmx_output_write(out, " ", 1);
+        bmx_output_puts(out, bmx_om_type_names[family->type]);
+        bmx_output_write(out, "\n", 1);
+        bmx_output_write(out, "# HELP ", 7);
+        bmx_output_puts(out, family->name);
+        bmx_output_write(out, " ", 1);
+        bmx_output_puts(out, family->key);
+        bmx_output_write(out, " of the ", 8);
+        bmx_output_puts(out, family->domain);
+        bmx_output_write(out, " beans\n", 7);
+
+        (void)bmx_output_pass(out, family->bb);
+    }
+
+    bmx_output_write(out, "# EOF\n", 6);
+    return out->rv;
+}
+
+static const struct bmx_printer bmx_printer_openmetrics = {
+    "application/openmetrics-text; version=1.0.0; charset=utf-8",
+    bmx_bean_begin_openmetrics,
+    bmx_bean_print_openmetrics,
+    bmx_bean_end_openmetrics
+};
+
+/**
+ * A registered output format.
+ */
+struct bmx_printer_entry {
+    const char *name;
+    const struct bmx_printer *printer;
+};
+
+/**
+ * The registered output formats, in the order they were registered, which
+ * decides between those the client accepts equally.
+ */
+static apr_array_header_t *bmx_printers;
+
+static apr_status_t bmx_printers_cleanup(void *data)
+{
+    bmx_printers = NULL;
+    return APR_SUCCESS;
+}
+
+BMX_DECLARE(void) bmx_printer_register(apr_pool_t *p, const char *name,
+                                       const struct bmx_printer *printer)
+{
+    struct bmx_printer_entry *entry;
+    int i;
+
+    if (!bmx_printers) {
+        bmx_printers = apr_array_make(p, 4, sizeof(*entry));
+        apr_pool_cleanup_register(p, NULL, bmx_printers_cleanup,
+                                  apr_pool_cleanup_null);
+    }
+
+    for (i = 0; i < bmx_printers->nelts; i++) {
+        entry = &APR_ARRAY_IDX(bmx_printers, i, struct bmx_printer_entry);
+        if (!strcasecmp(entry->name, name)) {
+            entry->printer = printer;
+            return;
+        }
+    }
+
+    entry = apr_array_push(bmx_printers);
+    entry->name = apr_pstrdup(p, name);
+    entry->printer = printer;
+}
+
+/**
+ * The quality in thousandths with which the given Accept header takes the
+ * given content type, from the most specific media range matching it.
+ */
+static int bmx_accept_quality(apr_pool_t *p, const char *accept,
+                              const char *type)
+{
+    char *ranges = apr_pstrdup(p, accept);
+    char *range, *param, *last, *plast;
+    const char *slash = strchr(type, '/');
+    apr_size_t major = slash ? (apr_size_t)(slash - type) + 1 : strlen(type);
+    apr_size_t len = strcspn(type, "; ");
+    int quality = 0, best = -1, match, q;
+
+    for (range = apr_strtok(ranges, ",", &last); range;
+         range = apr_strtok(NULL, ",", &last)) {
+        range = apr_strtok(range, ";", &plast);
+        if (!range) {
+            continue;
+        }
+        while (apr_isspace(*range)) {
+            range++;
+        }
+        apr_collapse_spaces(range, range);
+
+        if (!strncasecmp(range, type, len) && range[len] == '\0') {
+            match = 2;
+        } else if (!strncasecmp(range, type, major)
+                   && !strcmp(range + major, "*")) {
+            match = 1;
+        } else if (!strcmp(range, "*/*")) {
+            match = 0;
+        } else {
+            continue;
+        }
+
+        q = 1000;
+        while ((param = apr_strtok(NULL, ";", &plast))) {
+            while (apr_isspace(*param)) {
+                param++;
+            }
+            if ((param[0] == 'q' || param[0] == 'Q') && param[1] == '=') {
+                q = (int)(atof(param + 2) * 1000 + 0.5);
+            }
+        }
+
+        if (match > best || (match == best && q > quality)) {
+            best = match;
+            quality = q;
+        }
+    }
+    return quality;
+}
+
+/**
+ * Choose the output format of a response, from the format argument if
+ * given, or else from the Accept header of the request, or else plain
+ * text, which is also what clients accepting none of them get. Returns
+ * NULL only if the format argument names no known format.
+ */
+static const struct bmx_printer *bmx_printer_select(request_rec *r)
+{
+    const struct bmx_printer *printer = &bmx_printer_text_plain;
+    struct bmx_printer_entry *entry;
+    const char *format = bmx_query_arg(r, "format");
+    const char *accept;
+    int i, q, best = 0;
+
+    if (format) {
+        apr_size_t len = strcspn(format, "&");
+        for (i = 0; bmx_printers && i < bmx_printers->nelts; i++) {
+            entry = &APR_ARRAY_IDX(bmx_printers, i,
+                                   struct bmx_printer_entry);
+            if (!strncasecmp(entry->name, format, len)
+                && entry->name[len] == '\0') {
+                return entry->printer;
+            }
+        }
+        return NULL;
+    }
+
+    /* the response depends on the header even when it is missing */
+    apr_table_mergen(r->headers_out, "Vary", "Accept");
+    accept = apr_table_get(r->headers_in, "Accept");
+    if (!accept) {
+        return printer;
+    }
+
+    for (i = 0; bmx_printers && i < bmx_printers->nelts; i++) {
+        entry = &APR_ARRAY_IDX(bmx_printers, i, struct bmx_printer_entry);
+        q = bmx_accept_quality(r->pool, accept, entry->printer->content_type);
+        if (q > best) {
+            best = q;
+            printer = entry->printer;
+        }
+    }
+    return printer;
+}
+
 /* Implement 'bmx_run_query_hook'. This hook is used by mod_bmx plugins
  * to respond to queries. Implementations must call bean_print_fn() callback
  * for each bean they wish to return to the client. */
@@ -651,6 +1622,8 @@ static int bmx_handler(request_rec *r)
 {
     apr_status_t rv;
     struct bmx_objectname *query = NULL;
+    const struct bmx_printer *printer;
+    struct bmx_output *out;
 
     /* Determine if we are the handler for this request. */
     if (r->handler && strcmp(r->handler, BMX_HANDLER)) {
@@ -662,10 +1635,13 @@ static int bmx_handler(request_rec *r)
         return DECLINED;
     }
 
-    /* FIXME: check that the Accept: header has a mime-type we can accept */
-    /* FIXME: if no valid types in Accept: header, return code 415 */
-    /* FIXME: return the correct mime-type */
-    ap_set_content_type(r, "text/plain");
+    printer = bmx_printer_select(r);
+    if (!printer) {
+        ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Unknown BMX output "
+                      "format requested");
+        return HTTP_BAD_REQUEST;
+    }
+    ap_set_content_type(r, printer->content_type);
 
     if (r->header_only) {
         return OK;
@@ -677,14 +1653,35 @@ static int bmx_handler(request_rec *r)
         return HTTP_BAD_REQUEST;
     }
 
-    /* FIXME: allow other bmx_bean_print functions other than text/plain */
-    rv = bmx_run_query_hook(r, query, bmx_bean_print_text_plain);
+    out = bmx_output_create(r);
+    if (printer->begin) {
+        rv = printer->begin(r);
+        if (rv != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_CRIT, rv, r, "Error beginning "
+                          "the BMX Query response");
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+    rv = bmx_run_query_hook(r, query, printer->print_bean);
     if (rv != OK) {
         ap_log_rerror(APLOG_MARK, APLOG_CRIT, rv, r, "Error running "
                       "bmx_run_query_hook, BMX Query failed");
         return HTTP_INTERNAL_SERVER_ERROR;
     }
+    if (printer->end) {
+        rv = printer->end(r);
+        if (rv != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_CRIT, rv, r, "Error ending "
+                          "the BMX Query response");
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
 
+    /* the client going away is not our error */
+    if (bmx_output_flush(out) != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, out->rv, r, "Failed to send "
+                      "the BMX Query response");
+    }
     return OK;
 }
 
@@ -703,6 +1700,11 @@ static void bmx_register_hooks(apr_pool_t *p)
 {
     ap_hook_post_config(bmx_post_config, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_handler(bmx_handler, NULL, NULL, APR_HOOK_MIDDLE);
+
+    /* plain text comes first, as the default */
+    bmx_printer_register(p, "text", &bmx_printer_text_plain);
+    bmx_printer_register(p, "json", &bmx_printer_json);
+    bmx_printer_register(p, "openmetrics", &bmx_printer_openmetrics);
 }
 
 module AP_MODULE_DECLARE_DATA bmx_module =
@@ -130,6 +130,11 @@ struct bmx_property {
      * with a Bean.
      */
     APR_RING_ENTRY(bmx_property) link;
+    /**
+     * Whether the value only ever grows, but for restarts, as set by
+     * bmx_property_counter_create().
+     */
+    int counter;
 };
 
 /**
@@ -185,6 +190,14 @@ BMX_DECLARE(struct bmx_property *) bmx_property_int64_create(
 BMX_DECLARE(struct bmx_property *) bmx_property_uint64_create(
                                        const char *key, apr_uint64_t ui,
                                        apr_pool_t *p);
+/**
+ * Create an unsigned 64-bit long integer Bean Property counting something
+ * which only ever grows, but for restarts, such as requests or bytes.
+ * Printers which tell counters apart from other numbers do so for it.
+ */
+BMX_DECLARE(struct bmx_property *) bmx_property_counter_create(
+                                       const char *key, apr_uint64_t ui,
+                                       apr_pool_t *p);
 /** 
  * Create a floating point Bean Property.
  */ 
@@ -329,6 +342,66 @@ APR_DECLARE_EXTERNAL_HOOK(bmx, BMX, int, query_hook,
                            const struct bmx_objectname *query,
                            bmx_bean_print print_bean_fn))
 
+/**
+ * The size of the buffer given to bmx_property_value(), large enough for
+ * any number it prints.
+ */
+#define BMX_VALUE_LEN 32
+
+/**
+ * Print the value of a BMX Bean Property, without allocating anything for
+ * the built-in number types, for use by bmx_printer implementations.
+ * @param p The pool for the callback of a user-defined type.
+ * @param prop The property to print.
+ * @param buf A buffer of BMX_VALUE_LEN bytes where numbers are printed.
+ * @param len Where the length of the value is returned.
+ * @returns The value, which is not NUL-terminated if printed into buf.
+ */
+BMX_DECLARE(const char *) bmx_property_value(apr_pool_t *p,
+                                             const struct bmx_property *prop,
+                                             char *buf, apr_size_t *len);
+
+/**
+ * An output format of BMX query responses. The format is chosen by the
+ * format=name query argument, or else from the Accept header of the
+ * request by its content type.
+ */
+struct bmx_printer {
+    /** The content type of the responses in this format */
+    const char *content_type;
+    /** Called before the first bean of a response, or NULL */
+    apr_status_t (*begin)(request_rec *r);
+    /**
+     * Called for each bean of a response. The bean may be freed once this
+     * returns, so anything kept of it until the end must be copied.
+     */
+    bmx_bean_print print_bean;
+    /** Called after the last bean of a response, or NULL */
+    apr_status_t (*end)(request_rec *r);
+};
+
+/**
+ * Register an output format of BMX query responses, replacing any other
+ * of the same name. This is meant to be called from the register_hooks
+ * function of a module, and lasts as long as the given pool.
+ * @param p The configuration pool.
+ * @param name The name of the format, as in the format=name argument.
+ * @param printer The printer of the format, which must outlive the pool.
+ */
+BMX_DECLARE(void) bmx_printer_register(apr_pool_t *p, const char *name,
+                                       const struct bmx_printer *printer);
+
+/**
+ * Write to the response of a BMX query, for use by bmx_printer
+ * implementations. The response is buffered and passed down the output
+ * filters as the buffer fills.
+ * @param r The request being answered.
+ * @param str The bytes to write.
+ * @param len The number of bytes to write.
+ */
+BMX_DECLARE(void) bmx_response_write(request_rec *r, const char *str,
+                                     apr_size_t len);
+
 #endif /* !defined (VERSION_ONLY) */
 
 #endif /* MOD_BMX_H */
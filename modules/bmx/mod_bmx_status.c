@@ -276,9 +276,10 @@ static int bmx_status_query_hook(request_rec *r,
 
     if (ap_extended_status) {
         bmx_bean_prop_add(bmx_status_bean,
-            bmx_property_uint64_create("TotalAccesses", count, r->pool));
+            bmx_property_counter_create("TotalAccesses", count, r->pool));
         bmx_bean_prop_add(bmx_status_bean,
-            bmx_property_uint64_create("TotalTrafficKilobytes", kbcount, r->pool));
+            bmx_property_counter_create("TotalTrafficKilobytes", kbcount,
+                                        r->pool));
 
 #ifdef HAVE_TIMES
         bmx_bean_prop_add(bmx_status_bean,
@@ -35,9 +35,10 @@
  *      - forever
  *      - since last server start/restart
  *      - since last server graceful restart
- * 3) The metrics are all stored in a DBM file, so they can survive
- *    crashes and restarts. (We may move the ephemeral metrics, such as
- *    "since last graceful" into SHM for efficiency.)
+ * 3) The metrics of the running generation are recorded in shared memory,
+ *    and are folded into a map or DBM file periodically and whenever the
+ *    server is restarted or stopped, so the 'forever' and 'since-start'
+ *    tallies survive restarts.
  *
  * Basic Use Cases:
  * 1) Find mod_bmx_vhost metrics for a particular vhost:
@@ -46,20 +47,36 @@
  *    - http://localhost/bmx?mod_bmx_vhost:Type=since-restart
  * 3) Find all mod_bmx_vhost metrics:
  *    - http://localhost/bmx?mod_bmx_vhost:*
- * 4) Reset all statistics: Delete the DBM file and restart Apache.
+ * 4) Reset all statistics: Delete the map (or DBM) file and restart Apache.
  *
  * $Id: mod_bmx_vhost.c,v 1.1 2007/11/05 22:15:44 aaron Exp $
  */
 
 /**
  * Implementation Details:
- * 1) We rely on apr_dbm_t for DBM files.
- * 2) We use a global mutex to protect the DBM (in addition to the DBM's own
- *    mutex protections).
- * 3) We must record metrics on each hit. This happens during the logging
+ * 1) The records are persisted in a memory mapped file of fixed size
+ *    records by default, or in a DBM file through apr_dbm_t, or in any
+ *    socache provider, see BMXVHostStorage.
+ * 2) We use a global mutex to protect the map or DBM file (in addition to
+ *    the DBM's own mutex protections). The DBM may be split into several
+ *    files by BMXVHostDBMShards, each with a mutex of its own.
+ * 3) Each scoreboard worker owns one slot of counters per VHost in shared
+ *    memory. Only the owning worker writes to its slot, so recording a hit
+ *    takes no lock at all; queries add the slots of a VHost together. The
+ *    rare request without a scoreboard handle falls back to one extra slot
+ *    that is protected by the global mutex of the first shard. The global
+ *    totals are not recorded separately, they are summed over all VHosts
+ *    when read.
+ *    Queries never take a lock either; each slot carries a sequence
+ *    counter which its writer makes odd while updating it, and readers
+ *    retry until they copied the slot with the counter even and unchanged.
+ * 4) We must record metrics on each hit. This happens during the logging
  *    phase of the server, which can happen before the complete response has
- *    been sent to the client. This means that congested I/O subsystem on
- *    the mod_bmx_vhost server can slow server responses.
+ *    been sent to the client. With BMXVHostAsyncQueue, the logging phase only
+ *    copies a small sample of the request into a lock-free queue, and a
+ *    thread of each child records the samples in batches, so a congested
+ *    I/O subsystem on the mod_bmx_vhost server no longer slows server
+ *    responses.
  */
 
 #include "httpd.h"
@@ -68,9 +85,30 @@
 #include "http_main.h"
 #include "http_protocol.h"
 #include "http_request.h"
+#include "http_connection.h"
+#include "util_filter.h"
 #include "ap_listen.h"
 #include "ap_mpm.h"
 #include "scoreboard.h"
+#include "mpm_common.h"
+
+/* socache providers come with httpd 2.3.3+, or define BMX_HAVE_SOCACHE
+ * when building against 2.2 with the socache modules backported */
+#if !defined(BMX_HAVE_SOCACHE) && MODULE_MAGIC_NUMBER_MAJOR >= 20090401
+#define BMX_HAVE_SOCACHE 1
+#endif
+#ifdef BMX_HAVE_SOCACHE
+#include "ap_socache.h"
+#endif
+
+/* ap_mutex comes with httpd 2.4, or define BMX_HAVE_AP_MUTEX when building
+ * against 2.2 with the mutex backport */
+#if !defined(BMX_HAVE_AP_MUTEX) && MODULE_MAGIC_NUMBER_MAJOR >= 20120211
+#define BMX_HAVE_AP_MUTEX 1
+#endif
+#ifdef BMX_HAVE_AP_MUTEX
+#include "util_mutex.h"
+#endif
 
 #ifdef AP_NEED_SET_MUTEX_PERMS
 #include "unixd.h"
@@ -87,11 +125,24 @@
 #if APR_HAVE_SYS_TYPES_H
 #include <sys/types.h>
 #endif
+#if !defined(OS2) && !defined(WIN32) && !defined(BEOS) && !defined(NETWARE)
+#include <sys/mman.h>
+#endif
+#include <math.h>
 
 #include "apr_optional.h"
 #include "apr_strings.h"
 #include "apr_dbm.h"
 #include "apr_global_mutex.h"
+#include "apr_shm.h"
+#include "apr_mmap.h"
+#include "apr_hash.h"
+#include "apr_atomic.h"
+#include "apr_version.h"
+#if APR_HAS_THREADS
+#include "apr_thread_proc.h"
+#include "apr_thread_cond.h"
+#endif
 #include "mod_bmx.h"
 
 #include "mod_status.h"
@@ -110,10 +161,16 @@ APLOG_USE_MODULE(bmx_vhost);
 /** The default BMX Domain exported by this BMX Plugin. */
 #define BMX_VHOST_DOMAIN "mod_bmx_vhost"
 
+/** The default map filename where persistent data is stored */
+#define MAP_FNAME "logs/bmx_vhost.map"
 /** The default DB filename where persistent data is stored */
 #define DBM_FNAME "logs/bmx_vhost1.db"
 /** The default DB lock filename used to protect access to the DB file */
 #define DBMLOCK_FNAME "logs/bmx_vhost1.db.lock"
+/** The default number of seconds between writing counters to the DB file */
+#define FLUSH_INTERVAL 60
+/** The default number of requests between writing counters to the DB file */
+#define FLUSH_REQUESTS 10000
 
 #ifndef DEFAULT_TIME_FORMAT
 /** The default time format used by this module */
@@ -127,26 +184,206 @@ APLOG_USE_MODULE(bmx_vhost);
 #define ANY_PORT "_ANY_"
 
 #define BMX_VHOST_INFO_TYPE "info"
+/** The Type of the bean reporting the queues of BMXVHostAsyncQueue */
+#define BMX_VHOST_QUEUE_TYPE "async-queue"
+/** The Type of the beans reporting the points of BMXVHostSeries */
+#define BMX_VHOST_SERIES_TYPE "series"
+/** The Type of the beans reporting the moving average rates */
+#define BMX_VHOST_RATES_TYPE "rates"
+/** The Type of the beans reporting the paths of BMXVHostTopPaths */
+#define BMX_VHOST_TOP_TYPE "top-paths"
+/** The Type of the beans reporting the Hosts of BMXVHostDynamicHosts */
+#define BMX_VHOST_HOST_TYPE "host"
+/** The Host of the bean counting the requests of Hosts not tracked */
+#define OTHER_HOSTS_NAME "_OTHER_"
 
 /**
- * The name of the DBM file where we store all persistent mod_bmx_vhost data.
+ * The name of the map file where we store all persistent mod_bmx_vhost data.
+ * There is only one global map filename for all Apache children.
+ */
+static char *map_fname;
+/**
+ * The name of the DBM file where we store all persistent mod_bmx_vhost data
+ * when so configured, and from which a new map file is first filled.
  * There is only one global DBM filename for all Apache children.
  */
 static char *dbm_fname;
 /**
- * The name of the lock file used to protect access to the DBM file.
- * There is only one global DBM lock filename for all Apache children.
+ * The name of the lock file used to protect access to the map or DBM file.
+ * There is only one global DBM lock filename for all Apache children. With
+ * ap_mutex, this is NULL unless BMXVHostLockFilename is given, and the
+ * Mutex directive decides instead.
  */
 static char *dbmlock_fname;
 /**
- * The lock used to protect access to the DBM file. This lock is associated
- * with the lock filename above.
+ * The locks used to protect access to the store, one per shard of the
+ * store. The first one also protects the trailing shared slot.
+ */
+static apr_global_mutex_t **vhost_locks;
+/** The lock files of the locks, needed to reopen them in the children. */
+static const char **vhost_lock_fnames;
+/** The number of shards of the store, and of locks. */
+static int vhost_nlocks;
+/**
+ * Set in a child which failed to reopen the locks, and so must not take
+ * them, see bmx_vhost_child_init().
+ */
+static int vhost_locks_lost;
+/** The number of DBM files holding the records, see BMXVHostDBMShards */
+static int dbm_shards;
+/** The statistics of the lock of each shard, in shared memory. */
+static struct vhost_lock_stats *vhost_lock_stats;
+/**
+ * The number of seconds after which the counters are written back to the
+ * store, or zero to only save them when the server restarts or stops.
+ */
+static int flush_interval;
+/**
+ * The number of requests served before the counters are written back to
+ * the store, or zero to only write them behind on the timer.
+ */
+static apr_uint32_t flush_requests;
+
+/**
+ * The shared memory segment holding the live counters of this generation.
+ */
+static apr_shm_t *vhost_shm;
+/**
+ * The pool holding the shared memory segment, which outlives the
+ * configuration pool for as long as children of its generation are still
+ * running, see struct vhost_retired.
+ */
+static apr_pool_t *vhost_shm_pool;
+/** The generation the shared memory segment was created for. */
+static int vhost_generation;
+/**
+ * The records loaded from the store at startup, one per VHost, to which the
+ * live counters are added when reporting or folding them back into it.
+ * These live at the start of the shared memory segment.
+ */
+static struct vhost_data *vhost_bases;
+/**
+ * The per-worker counter slots, following the base records in the shared
+ * memory segment. See vhost_slot_head() for the layout.
+ */
+static char *vhost_slots;
+/**
+ * The live counters of each VHost which are not in any worker slot, one
+ * record per VHost following the base records. These are the counters of
+ * the entries of the slots taken over by another VHost, and those too
+ * large to be kept in every slot, after VHOST_LIVE_SIZE. Workers update
+ * them with atomic operations.
+ */
+static struct vhost_timespan *vhost_shared;
+/**
+ * The counters of the folds into the shared record of each VHost, the last
+ * one counting those of every VHost, see vhost_shared_fold().
+ */
+static struct vhost_folds *vhost_folds;
+/** The moving average rates of each VHost, in shared memory. */
+static struct vhost_rates *vhost_rates;
+/** When the rates are next due to be updated, in shared memory. */
+static struct vhost_ticker *vhost_ticker;
+/**
+ * The live counters of each VHost summed up by the process updating the
+ * rates, the leading VHOST_LIVE_SIZE bytes of one timespan record each.
  */
-static apr_global_mutex_t *dbmlock;
+static char *vhost_totals;
 /**
- * The DBM file used to store persistent data.
+ * The fold counters of each VHost as they were before its totals were
+ * summed up, finished then started, see vhost_live_totals().
  */
-static apr_dbm_t *dbm;
+static apr_uint32_t *vhost_totals_folds;
+/**
+ * Where the entries of each VHost are in the worker slots, for the process
+ * updating the rates or writing the counters behind.
+ */
+static struct vhost_live_index *vhost_index;
+/** The timespans and windows kept, see VHOST_KEEP() and VHOST_KEEP_WINDOW() */
+static int vhost_timespans;
+/** Set once BMXVHostTimespans was given, which replaces the default */
+static int timespans_set;
+/** The calendar windows of all VHosts, in shared memory if any is kept. */
+static struct vhost_windows *vhost_windows;
+/** The marks of the windows of every VHost, see vhost_window_mark(). */
+static char *vhost_window_marks;
+/** The unique clients of the windows, see vhost_window_clients(). */
+static apr_byte_t *vhost_window_sketches;
+/** The number of seconds between the points of the series of each VHost. */
+static int series_step;
+/** The number of points kept in the series of each VHost, or 0 for none. */
+static int series_points;
+/** The header of the series of all VHosts, in shared memory if kept. */
+static struct vhost_series *vhost_series;
+/** When each point of the series was taken, following its header. */
+static apr_time_t *vhost_series_times;
+/** The points of the series of every VHost, see vhost_series_point(). */
+static char *vhost_series_data;
+/** The number of path prefixes tracked for each VHost, or 0 for none. */
+static int top_entries;
+/** The number of paths reported in each order, see BMXVHostTopReport. */
+static int top_report;
+/** The number of path segments of the prefixes tracked, or 0 for all. */
+static int top_depth;
+/** The number of buckets of the top paths of each VHost, a power of two. */
+static apr_uint32_t top_buckets;
+/** The top paths of every VHost but the global one, in shared memory. */
+static struct vhost_top_bucket *vhost_top;
+/** The number of Host headers tracked apart from the VHosts, or 0. */
+static int host_entries;
+/** The number of entries of the table of Hosts less one, to wrap them. */
+static apr_uint32_t host_mask;
+/**
+ * The table of Hosts in shared memory if tracked, followed by the entry of
+ * the other Hosts, see vhost_host_update().
+ */
+static struct vhost_host_entry *vhost_hosts;
+/**
+ * The number of VHost records, including the global one which comes last.
+ * The worker slots and shared records hold the counters of all but the
+ * global record, which are summed up when the global record is read.
+ */
+static int vhost_nrecords;
+/** The number of worker slots, including the trailing shared slot. */
+static int vhost_nslots;
+/** The size of one slot, rounded up so slots never share a cache line. */
+static apr_size_t vhost_slot_size;
+/**
+ * The most shared memory the module may take, in megabytes, see
+ * BMXVHostMemoryLimit.
+ */
+static int memory_limit;
+/**
+ * The number of slots of each child, its configured number of threads,
+ * used to map a worker to its slot.
+ */
+static int vhost_thread_limit;
+/** The scoreboard server limit, the number of queue statistics records. */
+static int vhost_server_limit;
+/**
+ * The number of requests each child can queue for recording by its queue
+ * thread, or 0 to record them from the logging phase.
+ */
+static int queue_size;
+/** The statistics of the queue of each child, in shared memory. */
+static struct vhost_queue_stats *vhost_queue_stats;
+/** The objectname of the queue bean, only if requests are queued. */
+static struct bmx_objectname *queue_objectname;
+/** The filter counting the bytes read from the network. */
+static ap_filter_rec_t *vhost_in_filter_handle;
+/** The filter counting the bytes written to the network. */
+static ap_filter_rec_t *vhost_out_filter_handle;
+
+/** Set in a child once it started, see bmx_vhost_child_init(). */
+static int child_started;
+/** The generation this child belongs to. */
+static int child_generation;
+/**
+ * The InRequests of each since-restart record as last written behind, so
+ * records which saw no traffic since then need not be written again, in
+ * shared memory.
+ */
+static apr_uint64_t *vhost_flushed;
 
 /**
  * Main server (like in modules/filters/mod_ext_filter.c).
@@ -154,38 +391,34 @@ static apr_dbm_t *dbm;
 static server_rec *main_server = NULL;
 
 /**
- * The server-level module config for mod_bmx_vhost contains one reusable
- * objectname for each type of metric lifetime.
+ * The server-level module config for mod_bmx_vhost holds the Host and Port
+ * from which the objectnames of this VHost's beans are made when they are
+ * printed, and the settings of BMXVHostEnable and BMXVHostSampleRate
+ * merged from the main server.
  */
 struct bmx_vhost_scfg {
-    /**
-     * An BMX Objectname for this VHost that persists forever (or until the DBM
-     * file is removed).
-     */
-    struct bmx_objectname *forever;
-    /**
-     * An BMX Objectname for this VHost that contains data collected since
-     * the last time Apache was started.
-     */
-    struct bmx_objectname *since_start;
-    /**
-     * An BMX Objectname for this VHost that contains data collected since
-     * the last time Apache was re-started.
-     */
-    struct bmx_objectname *since_restart;
+    /** Whether requests are recorded (BMXVHostEnable), or -1 if unset */
+    int enable;
+    /** Only record one request in this many (BMXVHostSampleRate), or 0 */
+    int sample_rate;
 
     /**
-     * A special Vhost Info bean that contains configuration data for this
-     * VHost. This data is not persisted, since it is created from the
-     * current runtime Apache configuration.
+     * The Host of this VHost's beans, the hostname of its server_rec (not
+     * copied), or GLOBAL_SERVER_NAME.
      */
-    struct bmx_bean vhost_info;
+    const char *host;
+    /** The Port of this VHost's beans, or 0 for ANY_PORT */
+    int port;
+
+    /** The server_rec of this VHost, or NULL for the global one */
+    server_rec *server;
+    /** The shard of the store holding this VHost's record */
+    int shard;
 
     /**
-     * The DBM key that identifies the record where this VHost's data is
-     * stored in the DBM file.
+     * The index of this VHost's record within the shared memory counters.
      */
-    apr_datum_t key;
+    int index;
 };
 
 /**
@@ -194,10 +427,66 @@ struct bmx_vhost_scfg {
  */
 static struct bmx_vhost_scfg *global_scfg;
 
+/**
+ * The Server Configs of all VHosts (and the global one) by Host name, each
+ * an array of struct bmx_vhost_scfg pointers in server order, so that a
+ * query for a particular Host need not look at every VHost.
+ */
+static apr_hash_t *vhost_host_index;
+
+/**
+ * The durations of responses are counted in log-linear buckets: each power
+ * of two microseconds is split into 1 << VHOST_DURATION_SUB_BITS buckets of
+ * equal width, so a duration is known within 25% of its value, from one
+ * microsecond up to VHOST_DURATION_BITS bits worth of them (over an hour).
+ */
+#define VHOST_DURATION_SUB_BITS 2
+#define VHOST_DURATION_BITS 32
+#define VHOST_DURATION_BUCKETS \
+    ((VHOST_DURATION_BITS - VHOST_DURATION_SUB_BITS + 1) \
+     << VHOST_DURATION_SUB_BITS)
+
+/** The lowest status code counted on its own, see vhost_status_index() */
+#define VHOST_STATUS_MIN 100
+/** The number of status codes which may be counted on their own, 100 to 599 */
+#define VHOST_STATUSES 500
+/**
+ * The number of status codes counted on their own in a timespan record,
+ * the first ones seen, see vhost_status_add().
+ */
+#define VHOST_STATUS_CODES 30
+/**
+ * The number of method numbers counted on their own, see
+ * vhost_method_index(). This is METHODS, which is not used directly so
+ * that the records do not change size with the httpd they are built for.
+ */
+#define VHOST_METHODS 64
+
+/**
+ * The bits of the hash of a client address which pick its register of the
+ * unique clients estimate, see vhost_hll_add(). 1024 registers estimate
+ * the number of clients within about 3.3%.
+ */
+#define VHOST_HLL_BITS 10
+/** The number of unique clients registers, of one byte each */
+#define VHOST_HLL_REGISTERS (1 << VHOST_HLL_BITS)
+
+/** The responses of one status code in a timespan record */
+struct vhost_status_count {
+    /** The status code, or 0 while the entry is unused */
+    apr_uint32_t status;
+    /** Unused, keeps the count aligned */
+    apr_uint32_t reserved;
+    apr_uint64_t count;
+};
+
 /**
  * The metrics that are recorded for each VHost and for each Timespan.
  * 
- * Rev the default DBM_FNAME to avoid crashes if this record format changes
+ * New fields must only be appended, so that the map file can be upgraded
+ * in place. DBM records carry the size of their timespans, and those of
+ * an older layout are zero-extended, see vhost_dbm_fetch(). Those of a
+ * larger layout are not an older one, see vhost_timespan_common().
  */
 struct vhost_timespan {
     /** The number of bytes received from GET requests */
@@ -248,9 +537,9 @@ struct vhost_timespan {
     /** The number of responses returned with 500 status codes */
     apr_uint64_t OutResponses500;
 
-    /** The total number of bytes received in all requests */
+    /** The total number of bytes read from the network for all requests */
     apr_off_t InLowBytes;
-    /** The total number of bytes returned in all responses */
+    /** The total number of bytes written to the network for all responses */
     apr_off_t OutLowBytes;
 
     /** The total number of requests received */
@@ -260,13 +549,281 @@ struct vhost_timespan {
 
     /** The time when the server started */
     apr_time_t StartTime;
+
+    /** The number of responses by duration, see vhost_duration_bucket() */
+    apr_uint64_t Duration[VHOST_DURATION_BUCKETS];
+
+    /** The number of responses by status, see vhost_status_add() */
+    struct vhost_status_count Statuses[VHOST_STATUS_CODES];
+    /** The number of responses of the status codes not in Statuses */
+    apr_uint64_t StatusesOther;
+    /** The number of requests by method, see vhost_method_index() */
+    apr_uint64_t Methods[VHOST_METHODS + 1];
+
+    /** The HyperLogLog registers of the client addresses */
+    apr_byte_t Clients[VHOST_HLL_REGISTERS];
 };
 
 /**
- * This record is stored in the DBM for each VHost, and contains the set
- * of metrics for each of the supported timespans.
- * 
- * Rev the default DBM_FNAME to avoid crashes if this record format changes
+ * The size of the leading fields of a timespan record, up to StartTime,
+ * which are kept in every worker slot. The fields after StartTime are
+ * counted in the worker slots as sparse details, and summed up once per
+ * VHost, see vhost_shared.
+ */
+#define VHOST_LIVE_SIZE APR_OFFSETOF(struct vhost_timespan, StartTime)
+
+/**
+ * The size of the fields every layout of a timespan record had, the live
+ * counters and StartTime.
+ */
+#define VHOST_BASE_SIZE (VHOST_LIVE_SIZE + sizeof(apr_time_t))
+
+/** The number of seconds between updates of the moving average rates */
+#define VHOST_RATE_TICK 5
+/** The most ticks caught up at once, after which the rates are settled */
+#define VHOST_RATE_MAX_TICKS (15 * 60 / VHOST_RATE_TICK)
+/** How late the rates may be before a query updates them itself */
+#define VHOST_RATE_LATE apr_time_from_sec(30)
+/** The seconds after which a tick is taken from the process doing it, which
+ * must have died meanwhile */
+#define VHOST_RATE_STALE 30
+/** The moving average windows, of 1, 5 and 15 minutes */
+#define VHOST_RATE_WINDOWS 3
+/** The counters averaged: requests, bytes in and bytes out */
+#define VHOST_RATE_METRICS 3
+
+/** The number of entries of a bucket of the top paths */
+#define VHOST_TOP_WAYS 4
+/** The longest path prefix tracked, including its terminating NUL */
+#define VHOST_TOP_PATH_LEN 64
+/** The most path prefixes tracked for each VHost */
+#define VHOST_TOP_MAX 65536
+/** The default number of paths reported in each order */
+#define TOP_REPORT 10
+/** The seconds after which a bucket being taken over is taken from its
+ * worker, which must have died meanwhile */
+#define VHOST_TOP_STALE 2
+/** The default number of path segments of the prefixes tracked */
+#define TOP_DEPTH 2
+
+/** The counts by which the top paths are reported */
+enum vhost_top_order {
+    TOP_REQUESTS,
+    TOP_BYTES,
+    TOP_DURATION,
+    __N_TOP_ORDERS
+};
+
+/**
+ * One path prefix of the top paths of a VHost, with its counts since it
+ * took over its entry, including those it inherited. The hash is zero
+ * while the entry is free or being taken over.
+ */
+struct vhost_top_entry {
+    /** The hash of the path, see vhost_top_path() */
+    volatile apr_uint64_t hash;
+    /** The requests for the path */
+    apr_uint64_t requests;
+    /** The bytes written to the network for the path */
+    apr_uint64_t bytes;
+    /** The time taken by its requests, in microseconds */
+    apr_uint64_t duration;
+    /** The requests, bytes and time inherited from the path taken over */
+    apr_uint64_t error[__N_TOP_ORDERS];
+    /** The path prefix */
+    char path[VHOST_TOP_PATH_LEN];
+};
+
+/**
+ * A bucket of the top paths of a VHost. A path may only take an entry of the
+ * bucket picked by its hash, so it is found in constant time, and takes over
+ * the entry with the fewest requests if it is not there, as in the
+ * space-saving algorithm. Memory stays bounded however many paths are seen.
+ */
+struct vhost_top_bucket {
+    /** Set while one of its entries is being taken over, see
+     * vhost_busy_claim() */
+    volatile apr_uint32_t busy;
+    struct vhost_top_entry entry[VHOST_TOP_WAYS];
+};
+
+/** The longest Host tracked, including its terminating NUL */
+#define VHOST_HOST_LEN 64
+/** The most Hosts tracked apart from the VHosts */
+#define VHOST_HOSTS_MAX 1048576
+/** The number of entries where a Host may be found, from its hash on */
+#define VHOST_HOST_PROBE 8
+/** The bit of the tag of an entry of the table of Hosts being taken over */
+#define VHOST_HOST_PENDING 0x80000000
+/** The seconds after which an entry being taken over is taken from its
+ * worker, which must have died meanwhile */
+#define VHOST_HOST_STALE 2
+
+/**
+ * One Host of the table of Hosts, with its counts since it took over its
+ * entry. Its tag is 0 while the entry has never been used, and else taken
+ * from the hash of the Host, with VHOST_HOST_PENDING set while that Host
+ * is taking over the entry. The tag only changes while the entry is busy.
+ */
+struct vhost_host_entry {
+    volatile apr_uint32_t tag;
+    /** Set while the entry is being taken over, see vhost_busy_claim() */
+    volatile apr_uint32_t busy;
+    /** Set whenever the Host is counted, cleared as the clock passes by */
+    volatile apr_uint32_t referenced;
+    /** The requests for the Host */
+    apr_uint64_t requests;
+    /** The bytes read from the network for the Host */
+    apr_uint64_t in_bytes;
+    /** The bytes written to the network for the Host */
+    apr_uint64_t out_bytes;
+    /** The time taken by its requests, in microseconds */
+    apr_uint64_t duration;
+    /** The responses with a 4xx status */
+    apr_uint64_t client_errors;
+    /** The responses with a 5xx status */
+    apr_uint64_t server_errors;
+    /** The number of Hosts evicted, only counted for the other Hosts */
+    apr_uint64_t evictions;
+    /** When the Host took over the entry */
+    apr_time_t start_time;
+    /** The Host, cut short to VHOST_HOST_LEN - 1 bytes */
+    char host[VHOST_HOST_LEN];
+};
+
+/** The most points kept in the series of each VHost */
+#define VHOST_SERIES_MAX 100000
+
+/**
+ * The header of the series of all VHosts, shared by all processes. It is
+ * followed by the time each point was taken, then by the points of every
+ * VHost, each holding the live counters of that VHost at that time.
+ */
+struct vhost_series {
+    /**
+     * The number of points taken so far. Point n is kept at n modulo
+     * series_points, and point 0 holds no counts at all.
+     */
+    volatile apr_uint32_t taken;
+    /** When the next point is due */
+    apr_time_t next_point;
+};
+
+/**
+ * The exponentially weighted moving average rates of a VHost, per second.
+ * Only the process holding the ticker updates them.
+ */
+struct vhost_rates {
+    /** The rate of each counter over each window */
+    double rate[VHOST_RATE_METRICS][VHOST_RATE_WINDOWS];
+    /** The value of each counter at the last tick */
+    apr_uint64_t last[VHOST_RATE_METRICS];
+};
+
+/**
+ * When the rates of all VHosts are updated, shared by all processes.
+ */
+struct vhost_ticker {
+    /** When the next tick is due */
+    apr_time_t next_tick;
+    /** When the last tick was done */
+    apr_time_t last_tick;
+    /** Set while a process is updating the rates, see vhost_busy_claim() */
+    volatile apr_uint32_t busy;
+    /** Odd while the rates are being updated, see vhost_rates_read() */
+    volatile apr_uint32_t seq;
+    /** When the counters are next due to be written behind */
+    apr_time_t next_flush;
+    /** The InRequests of the global record when they last were */
+    apr_uint64_t flushed_requests;
+};
+
+/**
+ * The few fields of a request needed to record it, copied out of the
+ * request_rec so they can be recorded after the request is gone.
+ */
+struct vhost_sample {
+    /** The index of the VHost record */
+    int index;
+    /** The number of requests this one stands for, see BMXVHostSampleRate */
+    apr_uint32_t weight;
+    /** The worker slot where the request is recorded */
+    int slot;
+    int method_number;
+    int header_only;
+    int status;
+    apr_off_t read_length;
+    apr_off_t bytes_sent;
+    /** The bytes read from the network for the request, headers included */
+    apr_off_t in_low_bytes;
+    /** The bytes written to the network for the response */
+    apr_off_t out_low_bytes;
+    /** The time from the start of the request until it was logged */
+    apr_time_t duration;
+    /** The hash of the client address, see vhost_hash() */
+    apr_uint64_t client_hash;
+    /** The hash of path, only if the top paths are tracked */
+    apr_uint64_t path_hash;
+    /** The path prefix of the request, only if the top paths are tracked */
+    char path[VHOST_TOP_PATH_LEN];
+    /** The hash of the Host, only if the Hosts are tracked */
+    apr_uint64_t host_hash;
+    /** The Host of the request, only if the Hosts are tracked */
+    char host[VHOST_HOST_LEN];
+};
+
+/**
+ * The bytes counted by our network filters on a connection since its last
+ * request was logged, and since it was opened, kept in the connection
+ * config.
+ */
+struct vhost_conn {
+    apr_off_t bytes_in;
+    apr_off_t bytes_out;
+    apr_off_t total_in;
+    apr_off_t total_out;
+};
+
+/** The notes of each request giving the bytes of its connection so far */
+#define VHOST_CONN_IN_NOTE "bmx-vhost-conn-in"
+#define VHOST_CONN_OUT_NOTE "bmx-vhost-conn-out"
+
+/**
+ * The statistics of the queue of one child, kept in shared memory so that
+ * any child can report them. Only the owning child writes them.
+ */
+struct vhost_queue_stats {
+    /** The number of samples waiting in the queue when last drained */
+    apr_uint32_t depth;
+    /** The number of samples dropped because the queue was full */
+    apr_uint32_t drops;
+    /** The number of samples recorded by the queue thread */
+    apr_uint64_t drained;
+};
+
+/** The most DBM files the records may be spread over */
+#define VHOST_SHARDS_MAX 64
+/** The type of our locks for the Mutex directive */
+#define VHOST_MUTEX_TYPE "bmx-vhost"
+/** The Type of the beans reporting the locks of the store */
+#define BMX_VHOST_LOCK_TYPE "store-lock"
+
+/**
+ * The statistics of the lock of one shard of the store, kept in shared
+ * memory. They are only updated while holding that lock.
+ */
+struct vhost_lock_stats {
+    /** The number of times the lock was taken */
+    apr_uint64_t acquired;
+    /** The time spent waiting for the lock, in microseconds */
+    apr_uint64_t wait_time;
+    /** The longest wait for the lock, in microseconds */
+    apr_uint64_t max_wait;
+};
+
+/**
+ * This record is stored in the map or DBM for each VHost, and contains the
+ * set of metrics for each of the supported timespans, in vhost_type order.
  */
 struct vhost_data {
     struct vhost_timespan forever;
@@ -274,6 +831,289 @@ struct vhost_data {
     struct vhost_timespan since_restart;
 };
 
+/**
+ * A backend where the VHost Data records are persisted across restarts.
+ * The parent opens the store and loads every record once at startup. The
+ * records are then stored in batches, by a call to begin(), one call to
+ * store() for each record and a call to commit(), while the caller holds
+ * the global mutex of that shard. Only the DBM backend has more than one.
+ */
+struct vhost_store {
+    /** The name of this backend, as given to BMXVHostStorage */
+    const char *name;
+    /** Open or create the store in the parent, before loading records */
+    apr_status_t (*open)(server_rec *s, apr_pool_t *pconf, apr_pool_t *ptemp);
+    /**
+     * Load the leading keep bytes of the record of the given VHost, setting
+     * found if there is one. The rest of vhost_data is left alone.
+     */
+    apr_status_t (*load)(server_rec *s, const struct bmx_vhost_scfg *scfg,
+                         struct vhost_data *vhost_data, apr_size_t keep,
+                         int *found);
+    /** Start a batch of records of the given shard to be stored */
+    apr_status_t (*begin)(server_rec *s, int shard);
+    /** Store the record of the given VHost */
+    apr_status_t (*store)(server_rec *s, const struct bmx_vhost_scfg *scfg,
+                          const struct vhost_data *vhost_data);
+    /** Finish a batch of records, once all of them were stored */
+    apr_status_t (*commit)(server_rec *s, int shard);
+};
+
+/** The backend where records are persisted. */
+static const struct vhost_store *vhost_store;
+static const struct vhost_store *vhost_store_find(const char *name);
+
+#ifdef BMX_HAVE_SOCACHE
+/** The socache provider selected by BMXVHostStorage, if any */
+static const ap_socache_provider_t *socache_provider;
+/** The arguments given to the socache provider, or "" */
+static const char *socache_args;
+/** The instance of the socache provider where records are stored */
+static ap_socache_instance_t *socache_instance;
+static const struct vhost_store vhost_store_socache;
+#endif
+
+/**
+ * The size of a cache line, used to keep the counter slots of different
+ * workers from sharing one.
+ */
+#define VHOST_CACHE_LINE 64
+
+/**
+ * The number of VHosts each worker slot has live counters for, those it
+ * recorded last, so a slot takes the same memory however many VHosts
+ * there are. A VHost recorded by a worker whose slot has none for it takes
+ * over the entry least recently recorded into, see vhost_slot_take().
+ */
+#define VHOST_SLOT_ENTRIES 8
+
+/**
+ * The number of distinct duration buckets, statuses and methods each entry
+ * of a worker slot counts, after which they are folded into the shared
+ * record of its VHost, see vhost_slot_update().
+ */
+#define VHOST_SLOT_DETAILS 32
+
+/**
+ * The durations, statuses and methods counted in an entry of a worker
+ * slot, following its live counters, by the keys of vhost_slot_update().
+ */
+struct vhost_slot_details {
+    /** The number of keys in use */
+    apr_uint32_t used;
+    apr_uint16_t keys[VHOST_SLOT_DETAILS];
+    apr_uint32_t counts[VHOST_SLOT_DETAILS];
+};
+
+/** The space for each entry of a worker slot, see vhost_slot_entry() */
+#define VHOST_ENTRY_SIZE \
+    APR_ALIGN(VHOST_LIVE_SIZE + sizeof(struct vhost_slot_details), \
+              sizeof(apr_uint64_t))
+
+/** The first key of the statuses, then of the methods, in slot entries */
+#define VHOST_KEY_STATUS (1 + VHOST_DURATION_BUCKETS)
+#define VHOST_KEY_METHOD (VHOST_KEY_STATUS + VHOST_STATUSES + 1)
+
+/**
+ * The head of a worker slot, followed by the live counters and details of
+ * each of its entries, see vhost_slot_entry(). Only the worker owning the
+ * slot writes to it, between vhost_slot_write_begin() and
+ * vhost_slot_write_end().
+ */
+struct vhost_slot_head {
+    /** Odd while the slot is being written, see vhost_slot_read() */
+    volatile apr_uint32_t seq;
+    /** The number of requests recorded into the slot, dating its entries */
+    apr_uint32_t clock;
+    /** The index of the VHost of each entry plus one, or 0 if unused */
+    apr_uint32_t vhost[VHOST_SLOT_ENTRIES];
+    /** The clock when each entry was last recorded into */
+    apr_uint32_t used[VHOST_SLOT_ENTRIES];
+};
+
+/** The space for the head of each slot, keeping its entries aligned */
+#define VHOST_SLOT_HEAD \
+    APR_ALIGN(sizeof(struct vhost_slot_head), sizeof(apr_uint64_t))
+
+/**
+ * The folds of the entries of the worker slots into the shared record of a
+ * VHost, see vhost_shared_fold(). A fold is in progress while these differ,
+ * and a reader which sees them change may have counted the entry being
+ * folded twice or not at all, so it reads again.
+ */
+struct vhost_folds {
+    volatile apr_uint32_t started;
+    volatile apr_uint32_t finished;
+};
+
+/**
+ * Where the entries of each VHost were found by one pass over the worker
+ * slots, see vhost_live_index_build(), so that reading every VHost reads
+ * each entry once rather than every slot once for each VHost.
+ */
+struct vhost_live_index {
+    /**
+     * The first entry of each VHost, as its slot times VHOST_SLOT_ENTRIES
+     * plus its position in the slot, or -1 if there is none
+     */
+    int *first;
+    /** The next entry of the same VHost after each entry, or -1 */
+    int *next;
+};
+
+/** The default of BMXVHostMemoryLimit, in megabytes */
+#define MEMORY_LIMIT 1024
+
+/**
+ * The number of times a reader copies a slot which is being written before
+ * it settles for what it got, so that a worker which died in the middle of
+ * an update can not stall queries forever.
+ */
+#define VHOST_SEQ_TRIES 100
+/**
+ * The number of those tries made at once, before the reader yields the
+ * processor between tries, see vhost_seq_retry().
+ */
+#define VHOST_SEQ_SPINS 3
+
+/**
+ * A full memory barrier, ordering the sequence counter of a slot with the
+ * records it protects.
+ */
+#if defined(__GNUC__)
+#define vhost_barrier() __sync_synchronize()
+#elif defined(WIN32)
+#define vhost_barrier() MemoryBarrier()
+#else
+static apr_uint32_t vhost_barrier_word;
+/* APR's atomic read-modify-write operations are full barriers */
+#define vhost_barrier() (void)apr_atomic_cas32(&vhost_barrier_word, 0, 0)
+#endif
+
+/**
+ * Whether a reader which found a writer busy should copy again, at most
+ * VHOST_SEQ_TRIES times. After the first few tries it yields the
+ * processor before trying again, since a writer preempted in the middle
+ * of an update can not finish it until it runs.
+ */
+static int vhost_seq_retry(int *tries)
+{
+    if (--*tries <= 0) {
+        return 0;
+    }
+#if APR_HAS_THREADS
+    if (*tries < VHOST_SEQ_TRIES - VHOST_SEQ_SPINS) {
+        apr_thread_yield();
+    }
+#endif
+    return 1;
+}
+
+/**
+ * Atomically add to a 64 bit counter shared by all workers. Without
+ * compiler or APR support, the counter is added to under the lock of the
+ * first shard of the store, see vhost_locked_add64().
+ */
+#if defined(__GNUC__)
+#define vhost_atomic_add64(mem, val) (void)__sync_fetch_and_add((mem), (val))
+#elif defined(WIN32)
+#define vhost_atomic_add64(mem, val) \
+    (void)InterlockedExchangeAdd64((volatile LONG64 *)(mem), (LONG64)(val))
+#elif APR_VERSION_AT_LEAST(1,7,0)
+#define vhost_atomic_add64(mem, val) (void)apr_atomic_add64((mem), (val))
+#else
+#define vhost_atomic_add64(mem, val) vhost_locked_add64((mem), (val))
+
+/**
+ * Add to a 64 bit counter shared by all workers under the lock of the
+ * first shard, which serialises threads as well as processes. A child
+ * without the locks adds without them, and may lose updates.
+ */
+static void vhost_locked_add64(apr_uint64_t *mem, apr_uint64_t val)
+{
+    int locked = vhost_locks && !vhost_locks_lost
+                 && apr_global_mutex_lock(vhost_locks[0]) == APR_SUCCESS;
+
+    *mem += val;
+    if (locked) {
+        (void)apr_global_mutex_unlock(vhost_locks[0]);
+    }
+}
+#endif
+
+/**
+ * The position of the highest bit set in a non-zero 32 bit value.
+ */
+#if defined(__GNUC__)
+#define vhost_log2(v) (31 - __builtin_clz(v))
+#else
+static int vhost_log2(apr_uint32_t v)
+{
+    int n = 0;
+    while (v >>= 1) {
+        n++;
+    }
+    return n;
+}
+#endif
+
+/**
+ * Atomically set a byte shared by all workers to with if it holds cmp,
+ * returning what it held. Without compiler support, this is done with a
+ * compare-and-swap of the aligned word holding the byte.
+ */
+#if defined(__GNUC__)
+#define vhost_atomic_cas8(mem, with, cmp) \
+    __sync_val_compare_and_swap((mem), (cmp), (with))
+#else
+static apr_byte_t vhost_atomic_cas8(volatile apr_byte_t *mem,
+                                    apr_byte_t with, apr_byte_t cmp)
+{
+    apr_uintptr_t at = (apr_uintptr_t)mem;
+    volatile apr_uint32_t *word = (volatile apr_uint32_t *)(at & ~3);
+#if APR_IS_BIGENDIAN
+    apr_uint32_t shift = (3 - (apr_uint32_t)(at & 3)) * 8;
+#else
+    apr_uint32_t shift = (apr_uint32_t)(at & 3) * 8;
+#endif
+    apr_uint32_t old = *word, prev;
+
+    while ((apr_byte_t)(old >> shift) == cmp) {
+        prev = apr_atomic_cas32(word, (old & ~(0xffU << shift))
+                                      | ((apr_uint32_t)with << shift), old);
+        if (prev == old) {
+            break;
+        }
+        old = prev;
+    }
+    return (apr_byte_t)(old >> shift);
+}
+#endif
+
+/**
+ * Claim a busy flag shared by all workers, which holds the time it was
+ * claimed, in seconds and never zero. A flag held for stale seconds or more
+ * is taken over, its holder having died while holding it.
+ * @returns Non-zero if the flag was claimed, to be released by setting it
+ * back to zero.
+ */
+static int vhost_busy_claim(volatile apr_uint32_t *busy, apr_time_t now,
+                            int stale)
+{
+    apr_uint32_t stamp = (apr_uint32_t)apr_time_sec(now) | 1;
+    apr_uint32_t held;
+
+    held = apr_atomic_cas32(busy, stamp, 0);
+    if (held == 0) {
+        return 1;
+    }
+    /* a clock stepped back counts as stale as well */
+    if ((apr_uint32_t)(stamp - held) < (apr_uint32_t)stale) {
+        return 0;
+    }
+    return apr_atomic_cas32(busy, stamp, held) == held;
+}
+
 /** The default prefix for each DBM key used in mod_bmx_vhost */
 #define KEY_PREFIX "bmx_vhost"
 /** The 3 types of vhost metrics supported */
@@ -293,10 +1133,73 @@ char *vhost_type_names[__N_VHOST_TYPES] = {
     "since-restart",
 };
 
+/** The calendar windows which may be kept, in local time */
+enum vhost_window {
+    HOUR,
+    DAY,
+    __N_VHOST_WINDOWS
+};
+/** The Types of the current and previous window of each kind */
+static const char *const window_names[__N_VHOST_WINDOWS][2] = {
+    { "this-hour", "last-hour" },
+    { "today", "yesterday" }
+};
+/** The names of the windows in BMXVHostTimespans */
+static const char *const window_keywords[__N_VHOST_WINDOWS] = {
+    "hour",
+    "day"
+};
+
+/**
+ * The position of the marks of each kind of window among those kept, or -1
+ * when the kind is not kept, so only the kinds kept take up shared memory.
+ */
+static int window_pos[__N_VHOST_WINDOWS];
+
+/** The bit of vhost_timespans keeping the given timespan */
+#define VHOST_KEEP(type) (1 << (type))
+/** The bit of vhost_timespans keeping the given kind of window */
+#define VHOST_KEEP_WINDOW(w) (1 << (__N_VHOST_TYPES + (w)))
+/** The timespans kept unless BMXVHostTimespans says otherwise */
+#define VHOST_KEEP_DEFAULT (VHOST_KEEP(FOREVER) | VHOST_KEEP(SINCE_START) \
+                            | VHOST_KEEP(SINCE_RESTART))
+
+/**
+ * The calendar windows of all VHosts, shared by all processes. Each kind of
+ * window has two buffers of marks, the counters of every VHost when each
+ * of its last two windows started, see vhost_window_mark(). When a window
+ * ends, the marks of the next one overwrite those of the one before last,
+ * and the buffers swap roles, so nothing else is rewritten. The unique
+ * clients of each window are counted from scratch in a sketch of its
+ * buffer, see vhost_window_clients(), which is cleared as it starts.
+ */
+struct vhost_windows {
+    /**
+     * The sequence counter of each kind of window, odd while a window is
+     * being started, and otherwise twice the number of windows ended so
+     * far. The buffer of the current window is its second lowest bit.
+     */
+    volatile apr_uint32_t seq[__N_VHOST_WINDOWS];
+    /** When the window of each buffer started, or 0 if it never did */
+    apr_time_t start[__N_VHOST_WINDOWS][2];
+    /** When the current window of each kind ends */
+    apr_time_t next[__N_VHOST_WINDOWS];
+};
+
 /* --------------------------------------------------------------------
  * Configuration handling routines
  * -------------------------------------------------------------------- */
 
+/**
+ * Set the name of the map file where we store our persistent data.
+ */
+static const char *set_map_fname(cmd_parms *cmd, void *mconfig,
+                                 const char *arg)
+{
+    map_fname = ap_server_root_relative(cmd->pool, arg);
+    return NULL;
+}
+
 /**
  * Set the name of the DBM file where we store our persistent data.
  */
@@ -317,29 +1220,357 @@ static const char *set_dbmlock_fname(cmd_parms *cmd, void *mconfig,
     return NULL;
 }
 
-/* --------------------------------------------------------------------
- * Utility routines
- * -------------------------------------------------------------------- */
+/**
+ * Set the number of DBM files the records are spread over, each with its
+ * own lock.
+ */
+static const char *set_dbm_shards(cmd_parms *cmd, void *mconfig,
+                                  const char *arg)
+{
+    dbm_shards = atoi(arg);
+    if (dbm_shards < 1 || dbm_shards > VHOST_SHARDS_MAX) {
+        return "BMXVHostDBMShards must be a number of files from 1 to "
+               APR_STRINGIFY(VHOST_SHARDS_MAX);
+    }
+    return NULL;
+}
 
 /**
- * Create a new VHost Server Config BMX Objectname for the given
- * vhost_type and hostname and port.
+ * Select the backend where we store our persistent data, either one of our
+ * own or a socache provider given as name[:args]. A name followed by a
+ * colon always names a socache provider, so that 'dbm:' is the one of
+ * mod_socache_dbm rather than our own.
  */
-static int create_scfg_objectname(apr_pool_t *p,
-                                  struct bmx_objectname **objectname,
-                                  enum vhost_type vhost_type,
-                                  const char *hostname,
-                                  short port)
+static const char *set_storage(cmd_parms *cmd, void *mconfig,
+                               const char *arg)
 {
-    int rv = 0;
+    if (!strchr(arg, ':')) {
+        vhost_store = vhost_store_find(arg);
+        if (vhost_store) {
+            return NULL;
+        }
+    }
 
-    bmx_objectname_create(objectname, BMX_VHOST_DOMAIN, p);
-    apr_table_set((*objectname)->props, "Type", vhost_type_names[vhost_type]);
-    apr_table_set((*objectname)->props, "Host", hostname);
-    apr_table_set((*objectname)->props, "Port",
-                   port ? apr_psprintf(p, "%d", port) : ANY_PORT);
+#ifdef BMX_HAVE_SOCACHE
+    {
+        const char *name = arg, *args = strchr(arg, ':'), *err;
+        ap_socache_instance_t *instance;
 
-    return rv;
+        if (args) {
+            name = apr_pstrmemdup(cmd->temp_pool, arg, args - arg);
+            args++;
+        }
+
+        socache_provider = ap_lookup_provider(AP_SOCACHE_PROVIDER_GROUP, name,
+                                              AP_SOCACHE_PROVIDER_VERSION);
+        if (!socache_provider) {
+            return apr_pstrcat(cmd->pool, "BMXVHostStorage '", name, "' is "
+                               "not supported, use 'map', 'dbm' or the name "
+                               "of a loaded socache provider, followed "
+                               "by ':' for 'dbm' (is the mod_socache_",
+                               name, " module loaded?)", NULL);
+        }
+
+        /* the arguments are only checked here, see vhost_socache_open() */
+        err = socache_provider->create(&instance, args, cmd->temp_pool,
+                                       cmd->temp_pool);
+        if (err) {
+            return apr_pstrcat(cmd->pool, "BMXVHostStorage: ", err, NULL);
+        }
+
+        socache_args = args ? apr_pstrdup(cmd->pool, args) : "";
+        vhost_store = &vhost_store_socache;
+        return NULL;
+    }
+#else
+    return apr_pstrcat(cmd->pool, "BMXVHostStorage '", arg, "' is not "
+                       "supported, use 'map' or 'dbm'", NULL);
+#endif
+}
+
+/**
+ * Set the number of seconds after which the counters are written back to
+ * the store.
+ */
+static const char *set_flush_interval(cmd_parms *cmd, void *mconfig,
+                                      const char *arg)
+{
+    flush_interval = atoi(arg);
+    if (flush_interval < 0) {
+        return "BMXVHostFlushInterval must be a number of seconds, "
+               "or 0 to disable";
+    }
+    return NULL;
+}
+
+/**
+ * Set the number of requests after which the counters are written back to
+ * the store.
+ */
+static const char *set_flush_requests(cmd_parms *cmd, void *mconfig,
+                                      const char *arg)
+{
+    int n = atoi(arg);
+    if (n < 0) {
+        return "BMXVHostFlushRequests must be a number of requests, "
+               "or 0 to disable";
+    }
+    flush_requests = n;
+    return NULL;
+}
+
+/**
+ * Set the number of requests each child can queue for recording by its
+ * queue thread.
+ */
+static const char *set_queue_size(cmd_parms *cmd, void *mconfig,
+                                  const char *arg)
+{
+    queue_size = atoi(arg);
+    if (queue_size < 0) {
+        return "BMXVHostAsyncQueue must be a number of requests, "
+               "or 0 to disable";
+    }
+#if !APR_HAS_THREADS
+    if (queue_size) {
+        return "BMXVHostAsyncQueue requires APR thread support";
+    }
+#endif
+    return NULL;
+}
+
+/**
+ * Enable or disable recording requests for this server.
+ */
+static const char *set_enable(cmd_parms *cmd, void *mconfig, int flag)
+{
+    struct bmx_vhost_scfg *scfg;
+
+    scfg = ap_get_module_config(cmd->server->module_config, &bmx_vhost_module);
+    scfg->enable = flag;
+    return NULL;
+}
+
+/**
+ * Set the rate at which requests are sampled for this server.
+ */
+static const char *set_sample_rate(cmd_parms *cmd, void *mconfig,
+                                   const char *arg)
+{
+    struct bmx_vhost_scfg *scfg;
+
+    scfg = ap_get_module_config(cmd->server->module_config, &bmx_vhost_module);
+    scfg->sample_rate = atoi(arg);
+    if (scfg->sample_rate < 1) {
+        return "BMXVHostSampleRate must be a number of requests of which "
+               "one is recorded";
+    }
+    return NULL;
+}
+
+/**
+ * Set the number of seconds between the points of the series of each VHost,
+ * and the number of points kept.
+ */
+static const char *set_series(cmd_parms *cmd, void *mconfig,
+                              const char *step, const char *points)
+{
+    series_step = atoi(step);
+    series_points = atoi(points);
+    if (series_step < 1) {
+        return "BMXVHostSeries must be given a number of seconds between "
+               "points";
+    }
+    if (series_points < 0 || series_points > VHOST_SERIES_MAX) {
+        return "BMXVHostSeries must be given a number of points up to "
+               APR_STRINGIFY(VHOST_SERIES_MAX) ", or 0 to disable";
+    }
+    /* two more, the one before the oldest and the one being overwritten */
+    if (series_points) {
+        series_points += 2;
+    }
+    return NULL;
+}
+
+/**
+ * Set the number of path prefixes tracked for each VHost, and optionally
+ * the number of path segments of each prefix.
+ */
+static const char *set_top_paths(cmd_parms *cmd, void *mconfig,
+                                 const char *entries, const char *depth)
+{
+    top_entries = atoi(entries);
+    if (top_entries < 0 || top_entries > VHOST_TOP_MAX) {
+        return "BMXVHostTopPaths must be a number of paths up to "
+               APR_STRINGIFY(VHOST_TOP_MAX) ", or 0 to disable";
+    }
+    if (depth) {
+        top_depth = atoi(depth);
+        if (top_depth < 0) {
+            return "BMXVHostTopPaths depth must be a number of path "
+                   "segments, or 0 for the whole path";
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Set the number of top paths reported in each order.
+ */
+static const char *set_top_report(cmd_parms *cmd, void *mconfig,
+                                  const char *report)
+{
+    top_report = atoi(report);
+    if (top_report < 1 || top_report > VHOST_TOP_MAX) {
+        return "BMXVHostTopReport must be a number of paths from 1 to "
+               APR_STRINGIFY(VHOST_TOP_MAX);
+    }
+    return NULL;
+}
+
+/**
+ * Set the most shared memory the counters may take.
+ */
+static const char *set_memory_limit(cmd_parms *cmd, void *mconfig,
+                                    const char *limit)
+{
+    memory_limit = atoi(limit);
+    if (memory_limit < 1) {
+        return "BMXVHostMemoryLimit must be a number of megabytes";
+    }
+    return NULL;
+}
+
+/**
+ * Add a timespan or calendar window to those kept, in place of the default
+ * ones the first time.
+ */
+static const char *set_timespans(cmd_parms *cmd, void *mconfig,
+                                 const char *name)
+{
+    int type, w;
+
+    if (!timespans_set) {
+        vhost_timespans = 0;
+        timespans_set = 1;
+    }
+    for (type = 0; type < __N_VHOST_TYPES; type++) {
+        if (!strcasecmp(name, vhost_type_names[type])) {
+            vhost_timespans |= VHOST_KEEP(type);
+            return NULL;
+        }
+    }
+    for (w = 0; w < __N_VHOST_WINDOWS; w++) {
+        if (!strcasecmp(name, window_keywords[w])) {
+            vhost_timespans |= VHOST_KEEP_WINDOW(w);
+            return NULL;
+        }
+    }
+    return apr_pstrcat(cmd->pool, "BMXVHostTimespans does not know '", name,
+                       "', only forever, since-start, since-restart, hour "
+                       "and day", NULL);
+}
+
+/**
+ * Set the number of Host headers tracked apart from the VHosts.
+ */
+static const char *set_dynamic_hosts(cmd_parms *cmd, void *mconfig,
+                                     const char *entries)
+{
+    host_entries = atoi(entries);
+    if (host_entries < 0 || host_entries > VHOST_HOSTS_MAX) {
+        return "BMXVHostDynamicHosts must be a number of hosts up to "
+               APR_STRINGIFY(VHOST_HOSTS_MAX) ", or 0 to disable";
+    }
+    return NULL;
+}
+
+/* --------------------------------------------------------------------
+ * Utility routines
+ * -------------------------------------------------------------------- */
+
+/**
+ * Create the BMX Objectname of the given Type for a VHost. These are only
+ * made when a bean is printed, out of the request pool, rather than kept
+ * for every VHost for the lifetime of the configuration.
+ */
+static struct bmx_objectname *vhost_objectname(
+    apr_pool_t *p, const char *type, const struct bmx_vhost_scfg *scfg)
+{
+    struct bmx_objectname *objectname;
+
+    bmx_objectname_create(&objectname, BMX_VHOST_DOMAIN, p);
+    apr_table_setn(objectname->props, "Type", type);
+    apr_table_setn(objectname->props, "Host", scfg->host);
+    apr_table_setn(objectname->props, "Port", scfg->port
+                   ? apr_psprintf(p, "%d", scfg->port) : ANY_PORT);
+
+    return objectname;
+}
+
+/**
+ * The state of matching the properties of a query against a VHost bean,
+ * as in bmx_check_constraints.
+ */
+struct vhost_query_match_data {
+    /** The Type of the bean */
+    const char *type;
+    /** The VHost of the bean */
+    const struct bmx_vhost_scfg *scfg;
+    /** True if all properties have matched the bean so far */
+    int all_match;
+};
+
+static int vhost_query_match_iterator(void *rec, const char *key,
+                                      const char *value)
+{
+    struct vhost_query_match_data *data = rec;
+    const char *prop = NULL;
+    char port[16];
+
+    if (!strcasecmp(key, "Type")) {
+        prop = data->type;
+    } else if (!strcasecmp(key, "Host")) {
+        prop = data->scfg->host;
+    } else if (!strcasecmp(key, "Port")) {
+        if (data->scfg->port) {
+            apr_snprintf(port, sizeof(port), "%d", data->scfg->port);
+            prop = port;
+        } else {
+            prop = ANY_PORT;
+        }
+    }
+
+    data->all_match = prop && !strcmp(value, prop);
+    return data->all_match;
+}
+
+/**
+ * Check whether the query applies to the bean of the given Type of a
+ * VHost, with the same outcome as bmx_check_constraints on its objectname
+ * but without making one.
+ */
+static int vhost_query_match(const struct bmx_objectname *query,
+                             const char *type,
+                             const struct bmx_vhost_scfg *scfg)
+{
+    struct vhost_query_match_data data;
+
+    if (query == BMX_QUERY_ALL) {
+        return TRUE;
+    }
+    if (strcmp(query->domain, BMX_VHOST_DOMAIN)) {
+        return FALSE;
+    }
+    if (!query->props) {
+        return TRUE;
+    }
+
+    data.type = type;
+    data.scfg = scfg;
+    data.all_match = 0;
+    apr_table_do(vhost_query_match_iterator, &data, query->props, NULL);
+    return data.all_match;
 }
 
 /** Name for the special Global VHost Bean */
@@ -425,18 +1656,17 @@ static char *vhost_server_aliases_str(apr_pool_t *p, server_rec *s)
  * @param p The pool out of which to allocate this Bean.
  * @param vhost_info A pointer to an BMX Bean object that will be
  *        initialized and associated with this VHost.
+ * @param objectname The objectname of the bean.
  * @param s The server_rec containing this VHost's data.
- * @param hostname The hostname to use for this VHost.
- * @param port The port to use for this VHost.
  */
 static void create_vhost_info_bean(apr_pool_t *p,
                                    struct bmx_bean *vhost_info,
+                                   struct bmx_objectname *objectname,
                                    server_rec *s)
 {
     const char *server_name;
     const char *listen_addresses;
     const char *server_aliases;
-    struct bmx_objectname *vhost_info_objn;
 
     /* create the ServerName */
     if (s->port && s->server_hostname)
@@ -453,14 +1683,7 @@ static void create_vhost_info_bean(apr_pool_t *p,
     if (!server_aliases)
         server_aliases = "";
 
-    /* create the objectname for this vhost's bean */
-    bmx_objectname_create(&vhost_info_objn, BMX_VHOST_DOMAIN, p);
-    apr_table_set(vhost_info_objn->props, "Type", BMX_VHOST_INFO_TYPE);
-    apr_table_set(vhost_info_objn->props, "Host", s->server_hostname);
-    apr_table_set(vhost_info_objn->props, "Port",
-                  s->port ? apr_psprintf(p, "%d", s->port) : ANY_PORT);
-
-    bmx_bean_init(vhost_info, vhost_info_objn);
+    bmx_bean_init(vhost_info, objectname);
 
     bmx_bean_prop_add(vhost_info,
         bmx_property_string_create("ServerName", server_name, p));
@@ -470,6 +1693,32 @@ static void create_vhost_info_bean(apr_pool_t *p,
         bmx_property_string_create("ListenAddresses", listen_addresses, p));
 }
 
+/**
+ * Fill in the Host and Port of a VHost Server Config. The hostname is
+ * expected to live as long as the configuration.
+ */
+static void vhost_scfg_init(struct bmx_vhost_scfg *scfg,
+                            const char *hostname, int port)
+{
+    scfg->host = hostname;
+    scfg->port = port;
+}
+
+/** The size of the buffer of a DBM key, enough for any valid hostname */
+#define VHOST_KEY_LEN 512
+
+/**
+ * Print the key that identifies the record where the given VHost's data
+ * is stored in the map or DBM file into buf, of VHOST_KEY_LEN bytes.
+ */
+static void vhost_scfg_key(const struct bmx_vhost_scfg *scfg, char *buf,
+                           apr_datum_t *key)
+{
+    key->dptr = buf;
+    key->dsize = apr_snprintf(buf, VHOST_KEY_LEN, "%s-%s:%d", KEY_PREFIX,
+                              scfg->host, scfg->port);
+}
+
 /**
  * Create the Server Config Bean for this VHost and associate the data
  * with the server data for this VHost (so we can retrieve it later when
@@ -483,735 +1732,5695 @@ struct bmx_vhost_scfg *bmx_vhost_create_scfg(apr_pool_t *p,
 {
     struct bmx_vhost_scfg *scfg = apr_pcalloc(p, sizeof(*scfg));
 
-    create_scfg_objectname(p, &scfg->forever, FOREVER, hostname, port);
-    create_scfg_objectname(p, &scfg->since_start, SINCE_START, hostname, port);
-    create_scfg_objectname(p, &scfg->since_restart, SINCE_RESTART, hostname,
-                           port);
-
-    /* Create the DBM key to use to refer to the data for the given VHost. */
-    scfg->key.dptr = apr_psprintf(p, "%s-%s:%d", KEY_PREFIX, hostname, port);
-    scfg->key.dsize = strlen(scfg->key.dptr);
-
+    scfg->enable = -1;
+    vhost_scfg_init(scfg, hostname, port);
     return scfg;
 }
 
 
 /**
- * Fetch the vhost data for a given VHost and reset the 'since-restart" data
- * or allocate an entirely new record if the record did not already exist.
+ * Mix the bits of a value with the MurmurHash3 finalizer, so that every bit
+ * of the result depends on every bit of the value.
  */
-static int vhost_data_reset(apr_dbm_t *dbm, server_rec *s, apr_pool_t *ptemp,
-                            const struct bmx_vhost_scfg *scfg, int startup)
+static apr_uint64_t vhost_mix64(apr_uint64_t hash)
 {
-    int rv = APR_SUCCESS;
-    apr_datum_t value;
-    struct vhost_data vhost_data;
-    apr_time_t now = apr_time_now();
+    hash ^= hash >> 33;
+    hash *= APR_UINT64_C(0xff51afd7ed558ccd);
+    hash ^= hash >> 33;
+    hash *= APR_UINT64_C(0xc4ceb9fe1a85ec53);
+    hash ^= hash >> 33;
+    return hash;
+}
 
-    memset(&value, 0, sizeof(value));
+/**
+ * Hash a string with FNV-1a, followed by vhost_mix64().
+ */
+static apr_uint64_t vhost_hash(const char *str)
+{
+    apr_uint64_t hash = APR_UINT64_C(14695981039346656037);
 
-    rv = apr_dbm_fetch(dbm, scfg->key, &value);
-    if (rv != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, "Failed to fetch "
-                     "mod_bmx_vhost record for vhost '%s'", scfg->key.dptr);
-        goto out;
+    while (str && *str) {
+        hash = (hash ^ (unsigned char)*str++) * APR_UINT64_C(1099511628211);
     }
+    return vhost_mix64(hash);
+}
 
-    /* create the record the first time */
-    if (!value.dptr || value.dsize != sizeof(vhost_data)) {
-        memset(&vhost_data, 0, sizeof(vhost_data));
-        vhost_data.since_start.StartTime = now;
-        vhost_data.since_restart.StartTime = now;
-        vhost_data.forever.StartTime = now;
-    }
-    /* otherwise reuse the previous record */
-    else {
-        memcpy(&vhost_data, value.dptr, sizeof(vhost_data));
-        if (startup) {
-            /* clear since-start parts */
-            memset(&vhost_data.since_start, 0, sizeof(vhost_data.since_start));
-            vhost_data.since_start.StartTime = now;
+/**
+ * Raise a unique clients register to the given rank unless it is already
+ * as high, with a compare-and-swap, so no lock is needed.
+ */
+static void vhost_hll_raise(volatile apr_byte_t *mem, apr_byte_t rank)
+{
+    apr_byte_t reg, prev;
+
+    reg = *mem;
+    while (reg < rank) {
+        prev = vhost_atomic_cas8(mem, rank, reg);
+        if (prev == reg) {
+            break;
         }
-        /* clear since-restart parts */
-        memset(&vhost_data.since_restart, 0, sizeof(vhost_data.since_restart));
-        vhost_data.since_restart.StartTime = now;
+        reg = prev;
     }
+}
 
-    value.dsize = sizeof(vhost_data);
-    value.dptr = (void *)&vhost_data;
-
-    rv = apr_dbm_store(dbm, scfg->key, value);
-    if (rv != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, "Failed to store "
-                     "mod_bmx_vhost record for vhost '%s'", scfg->key.dptr);
-        goto out;
+/**
+ * Count a client of the given hash in the unique clients registers, as in
+ * HyperLogLog: its leading VHOST_HLL_BITS pick a register, which keeps the
+ * highest rank of the remaining bits seen, that is their leading zeros plus
+ * one.
+ */
+static void vhost_hll_add(apr_byte_t *regs, apr_uint64_t hash)
+{
+    const int bits = 64 - VHOST_HLL_BITS;
+    apr_uint64_t rest = hash & ((APR_UINT64_C(1) << bits) - 1);
+    apr_byte_t rank;
+
+    if (!rest) {
+        rank = bits + 1;
+    } else if (rest >> 32) {
+        rank = bits - 32 - vhost_log2((apr_uint32_t)(rest >> 32));
+    } else {
+        rank = bits - vhost_log2((apr_uint32_t)rest);
     }
-out:
-    return rv;
+    vhost_hll_raise(&regs[hash >> bits], rank);
 }
 
 /**
- * Update a timespan record in the DBM according to the data contained
- * in the given request_rec.
+ * Merge the unique clients registers of add into regs, which keeps the
+ * highest of each register, so the result counts the clients of both.
  */
-static void vhost_timespan_update(struct vhost_timespan *ts,
-                                  request_rec *r, request_rec *last)
-{
-    switch (r->method_number) {
-    case M_GET:
-        if (r->header_only) { /* HEAD */
-            ts->InBytesHEAD += r->read_length;
-            ts->InRequestsHEAD++;
-        } else { /* GET */
-            ts->InBytesGET += r->read_length;
-            ts->InRequestsGET++;
-        }
-        break;
-    case M_POST:
-        ts->InBytesPOST += r->read_length;
-        ts->InRequestsPOST++;
-        break;
-    case M_PUT:
-        ts->InBytesPUT += r->read_length;
-        ts->InRequestsPUT++;
-        break;
-    };
-
-    switch (r->status) {
-    case 200:
-        ts->OutBytes200 += r->bytes_sent ? r->bytes_sent : last->bytes_sent;
-        ts->OutResponses200++;
-        break;
-    case 301:
-        ts->OutBytes301 += r->bytes_sent ? r->bytes_sent : last->bytes_sent;
-        ts->OutResponses301++;
-        break;
-    case 302:
-        ts->OutBytes302 += r->bytes_sent ? r->bytes_sent : last->bytes_sent;
-        ts->OutResponses302++;
-        break;
-    case 401:
-        ts->OutBytes401 += r->bytes_sent ? r->bytes_sent : last->bytes_sent;
-        ts->OutResponses401++;
-        break;
-    case 403:
-        ts->OutBytes403 += r->bytes_sent ? r->bytes_sent : last->bytes_sent;
-        ts->OutResponses403++;
-        break;
-    case 404:
-        ts->OutBytes404 += r->bytes_sent ? r->bytes_sent : last->bytes_sent;
-        ts->OutResponses404++;
-        break;
-    case 500:
-        ts->OutBytes500 += r->bytes_sent ? r->bytes_sent : last->bytes_sent;
-        ts->OutResponses500++;
-        break;
-    };
-
-    ts->InLowBytes += r->read_length;
-    ts->OutLowBytes += r->bytes_sent ? r->bytes_sent : last->bytes_sent;
+static void vhost_hll_merge(apr_byte_t *regs, const apr_byte_t *add)
+{
+    int i;
 
-    ts->InRequests++;
-    ts->OutResponses++;
+    for (i = 0; i < VHOST_HLL_REGISTERS; i++) {
+        if (add[i] > regs[i]) {
+            regs[i] = add[i];
+        }
+    }
 }
 
 /**
- * Update all timespan records within the given VHost Data record.
+ * Estimate the number of unique clients from their registers, by the
+ * HyperLogLog harmonic mean, or by linear counting while it is small
+ * enough for the empty registers to tell more.
  */
-static void vhost_data_update(struct vhost_data *vhost_data,
-                              request_rec *r, request_rec *last)
+static apr_uint64_t vhost_hll_estimate(const apr_byte_t *regs)
 {
-    vhost_timespan_update(&(vhost_data->forever), r, last);
-    vhost_timespan_update(&(vhost_data->since_start), r, last);
-    vhost_timespan_update(&(vhost_data->since_restart), r, last);
+    const double m = VHOST_HLL_REGISTERS;
+    double sum = 0, estimate;
+    int zeros = 0, i, reg;
+
+    for (i = 0; i < VHOST_HLL_REGISTERS; i++) {
+        reg = regs[i];
+        sum += 1.0 / (double)(APR_UINT64_C(1) << reg);
+        if (!reg) {
+            zeros++;
+        }
+    }
+
+    estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+    if (estimate <= 2.5 * m && zeros) {
+        estimate = m * log(m / zeros);
+    }
+    return (apr_uint64_t)(estimate + 0.5);
 }
 
 /**
- * Print the given VHost bean to the response.
+ * Copy the leading top_depth segments of the given path into the sample,
+ * up to VHOST_TOP_PATH_LEN - 1 bytes, along with their FNV-1a hash, which
+ * is never zero.
  */
-static void print_vhost_bean(request_rec *r,
-                             bmx_bean_print print_bean_fn,
-                             struct bmx_objectname *objectname,
-                             struct vhost_timespan *timespan)
+static void vhost_top_path(struct vhost_sample *sample, const char *uri)
 {
-    struct bmx_bean bean;
-    apr_time_t now = apr_time_now();
-
-    bmx_bean_init(&bean, objectname);
-
-    bmx_bean_prop_add(&bean,
-        bmx_property_uint64_create("InBytesGET",
-                                   timespan->InBytesGET, r->pool));
-    bmx_bean_prop_add(&bean,
-        bmx_property_uint64_create("InBytesHEAD",
-                                   timespan->InBytesHEAD, r->pool));
-    bmx_bean_prop_add(&bean,
-        bmx_property_uint64_create("InBytesPOST",
-                                   timespan->InBytesPOST, r->pool));
-    bmx_bean_prop_add(&bean,
-        bmx_property_uint64_create("InBytesPUT",
-                                   timespan->InBytesPUT, r->pool));
+    apr_uint64_t hash = APR_UINT64_C(14695981039346656037);
+    int segments = 0, i;
 
-    bmx_bean_prop_add(&bean,
-        bmx_property_uint64_create("InRequestsGET",
-                                   timespan->InRequestsGET, r->pool));
-    bmx_bean_prop_add(&bean,
-        bmx_property_uint64_create("InRequestsHEAD",
-                                   timespan->InRequestsHEAD, r->pool));
-    bmx_bean_prop_add(&bean,
-        bmx_property_uint64_create("InRequestsPOST",
-                                   timespan->InRequestsPOST, r->pool));
-    bmx_bean_prop_add(&bean,
-        bmx_property_uint64_create("InRequestsPUT",
-                                   timespan->InRequestsPUT, r->pool));
+    for (i = 0; uri && i < VHOST_TOP_PATH_LEN - 1; i++) {
+        unsigned char c = uri[i];
 
-    bmx_bean_prop_add(&bean,
-        bmx_property_uint64_create("OutBytes200",
-                                   timespan->OutBytes200, r->pool));
-    bmx_bean_prop_add(&bean,
-        bmx_property_uint64_create("OutBytes301",
-                                   timespan->OutBytes301, r->pool));
-    bmx_bean_prop_add(&bean,
-        bmx_property_uint64_create("OutBytes302",
-                                   timespan->OutBytes302, r->pool));
-    bmx_bean_prop_add(&bean,
-        bmx_property_uint64_create("OutBytes401",
-                                   timespan->OutBytes401, r->pool));
-    bmx_bean_prop_add(&bean,
-        bmx_property_uint64_create("OutBytes403",
-                                   timespan->OutBytes403, r->pool));
-    bmx_bean_prop_add(&bean,
-        bmx_property_uint64_create("OutBytes404",
-                                   timespan->OutBytes404, r->pool));
-    bmx_bean_prop_add(&bean,
-        bmx_property_uint64_create("OutBytes500",
-                                   timespan->OutBytes500, r->pool));
+        if (c < ' ' || (c == '/' && top_depth && ++segments > top_depth)) {
+            break;
+        }
+        sample->path[i] = c;
+        hash = (hash ^ c) * APR_UINT64_C(1099511628211);
+    }
+    sample->path[i] = '\0';
+    sample->path_hash = hash ? hash : 1;
+}
 
-    bmx_bean_prop_add(&bean,
-        bmx_property_uint64_create("OutResponses200",
-                                   timespan->OutResponses200, r->pool));
-    bmx_bean_prop_add(&bean,
-        bmx_property_uint64_create("OutResponses301",
-                                   timespan->OutResponses301, r->pool));
-    bmx_bean_prop_add(&bean,
-        bmx_property_uint64_create("OutResponses302",
-                                   timespan->OutResponses302, r->pool));
-    bmx_bean_prop_add(&bean,
-        bmx_property_uint64_create("OutResponses401",
-                                   timespan->OutResponses401, r->pool));
-    bmx_bean_prop_add(&bean,
-        bmx_property_uint64_create("OutResponses403",
-                                   timespan->OutResponses403, r->pool));
-    bmx_bean_prop_add(&bean,
-        bmx_property_uint64_create("OutResponses404",
-                                   timespan->OutResponses404, r->pool));
-    bmx_bean_prop_add(&bean,
-        bmx_property_uint64_create("OutResponses500",
-                                   timespan->OutResponses500, r->pool));
+/**
+ * Find the bucket of the top paths of the given VHost where a path of the
+ * given hash is tracked.
+ */
+static struct vhost_top_bucket *vhost_top_bucket(int index, apr_uint64_t hash)
+{
+    apr_uint32_t bucket = (apr_uint32_t)(hash ^ (hash >> 32))
+                        & (top_buckets - 1);
 
-    bmx_bean_prop_add(&bean,
-        bmx_property_uint64_create("InLowBytes",
-                                   timespan->InLowBytes, r->pool));
-    bmx_bean_prop_add(&bean,
-        bmx_property_uint64_create("OutLowBytes",
-                                   timespan->OutLowBytes, r->pool));
+    return vhost_top + (apr_size_t)index * top_buckets + bucket;
+}
 
-    bmx_bean_prop_add(&bean,
-        bmx_property_uint64_create("InRequests",
-                                   timespan->InRequests, r->pool));
-    bmx_bean_prop_add(&bean,
-        bmx_property_uint64_create("OutResponses",
-                                   timespan->OutResponses, r->pool));
+/**
+ * Copy the Host of the request into the sample, or the ServerName of its
+ * VHost if it named none, along with its hash.
+ */
+static void vhost_host_name(struct vhost_sample *sample, request_rec *r)
+{
+    const char *host = r->hostname ? r->hostname : r->server->server_hostname;
 
-    bmx_bean_prop_add(&bean,
-        bmx_property_string_create("StartDate",
-                                   ap_ht_time(r->pool, timespan->StartTime,
-                                              DEFAULT_TIME_FORMAT, 0),
-                                   r->pool));
-    bmx_bean_prop_add(&bean,
-        bmx_property_uint64_create("StartTime",
-                                   timespan->StartTime, r->pool));
-    bmx_bean_prop_add(&bean,
-        bmx_property_uint64_create("StartElapsed",
-                                   now - timespan->StartTime, r->pool));
-        
-    print_bean_fn(r, &bean);
+    apr_cpystrn(sample->host, host ? host : "", sizeof(sample->host));
+    sample->host_hash = vhost_hash(sample->host);
 }
 
-/* --------------------------------------------------------------------
- * Hook processing
- * -------------------------------------------------------------------- */
-
 /**
- * Process an BMX Query by checking if the Query applies to our timespan
- * beans and then by fetching the appropriate data from the DBM and returning
- * it to the requesting client. 
+ * Copy the fields of the given request_rec needed to record it into a
+ * sample, taking the bytes counted on its connection since the previous
+ * request.
  */
-static int process_vhost_query(request_rec *r, 
-                               const struct bmx_objectname *query,
-                               bmx_bean_print print_bean_fn,
-                               struct bmx_vhost_scfg *scfg)
+static void vhost_sample_fill(struct vhost_sample *sample, request_rec *r,
+                              request_rec *last, int index,
+                              apr_uint32_t weight)
 {
-    int rv = DECLINED;
-    int forever = 0, since_start = 0, since_restart = 0;
+    struct vhost_conn *vc = ap_get_module_config(r->connection->conn_config,
+                                                 &bmx_vhost_module);
+
+    sample->index = index;
+    sample->weight = weight;
+    sample->slot = 0;
+    sample->method_number = r->method_number;
+    sample->header_only = r->header_only;
+    sample->status = r->status;
+    sample->read_length = r->read_length;
+    sample->bytes_sent = r->bytes_sent ? r->bytes_sent : last->bytes_sent;
+    sample->duration = apr_time_now() - r->request_time;
+
+    /* the bytes on the wire since the last request, else the bodies only */
+    if (vc) {
+        sample->in_low_bytes = vc->bytes_in;
+        sample->out_low_bytes = vc->bytes_out;
+        vc->bytes_in = vc->bytes_out = 0;
+    } else {
+        sample->in_low_bytes = sample->read_length;
+        sample->out_low_bytes = sample->bytes_sent;
+    }
 
-    forever = bmx_check_constraints(query, scfg->forever);
-    since_start = bmx_check_constraints(query, scfg->since_start);
-    since_restart = bmx_check_constraints(query, scfg->since_restart);
+    /* a sampled request stands for those left out alongside it */
+    if (weight > 1) {
+        sample->read_length *= weight;
+        sample->bytes_sent *= weight;
+        sample->in_low_bytes *= weight;
+        sample->out_low_bytes *= weight;
+    }
 
-    if (forever || since_start || since_restart) {
-        apr_datum_t value;
-        struct vhost_data vhost_data;
+#if AP_MODULE_MAGIC_AT_LEAST(20111130,0)
+    sample->client_hash = vhost_hash(r->useragent_ip);
+#else
+    sample->client_hash = vhost_hash(r->connection->remote_ip);
+#endif
 
-        memset(&value, 0, sizeof(value));
+    if (vhost_top) {
+        vhost_top_path(sample, r->uri);
+    }
+    if (vhost_hosts) {
+        vhost_host_name(sample, r);
+    }
+}
 
-        /* lock the DBM */
-        rv = apr_global_mutex_lock(dbmlock);
-        if (rv != APR_SUCCESS) {
-            ap_log_rerror(APLOG_MARK, APLOG_CRIT, rv, r, "Lock failure while "
-                          "processing BMX query");
-            goto error;
+/**
+ * The index of the given status code among the codes from 100 to 599, or
+ * VHOST_STATUSES for any other.
+ */
+static int vhost_status_index(int status)
+{
+    apr_uint32_t i = (apr_uint32_t)(status - VHOST_STATUS_MIN);
+
+    return i < VHOST_STATUSES ? (int)i : VHOST_STATUSES;
+}
+
+/**
+ * Find the counter of the given method number in the Methods table. HEAD
+ * requests are counted apart from GET in the last one, and unknown method
+ * numbers are counted as M_INVALID.
+ */
+static int vhost_method_index(int method_number, int header_only)
+{
+    apr_uint32_t i = (apr_uint32_t)method_number;
+
+    i = i < VHOST_METHODS ? i : M_INVALID;
+    return header_only && i == M_GET ? VHOST_METHODS : (int)i;
+}
+
+/**
+ * The byte and request counters of a method, or the byte and response
+ * counters of a status, which have fields of their own in a timespan
+ * record, as their offsets.
+ */
+struct vhost_field_pair {
+    apr_size_t bytes;
+    apr_size_t count;
+};
+
+#define VHOST_FIELD_PAIR(bytes, count) \
+    { APR_OFFSETOF(struct vhost_timespan, bytes), \
+      APR_OFFSETOF(struct vhost_timespan, count) }
+
+/** The counters of the methods with fields of their own */
+static const struct vhost_field_pair vhost_method_fields[] = {
+    VHOST_FIELD_PAIR(InBytesGET, InRequestsGET),
+    VHOST_FIELD_PAIR(InBytesHEAD, InRequestsHEAD),
+    VHOST_FIELD_PAIR(InBytesPOST, InRequestsPOST),
+    VHOST_FIELD_PAIR(InBytesPUT, InRequestsPUT)
+};
+
+/** The counters of the statuses with fields of their own */
+static const struct vhost_field_pair vhost_status_fields[] = {
+    VHOST_FIELD_PAIR(OutBytes200, OutResponses200),
+    VHOST_FIELD_PAIR(OutBytes301, OutResponses301),
+    VHOST_FIELD_PAIR(OutBytes302, OutResponses302),
+    VHOST_FIELD_PAIR(OutBytes401, OutResponses401),
+    VHOST_FIELD_PAIR(OutBytes403, OutResponses403),
+    VHOST_FIELD_PAIR(OutBytes404, OutResponses404),
+    VHOST_FIELD_PAIR(OutBytes500, OutResponses500)
+};
+
+/**
+ * The entry of vhost_method_fields of each entry of the Methods table, and
+ * of vhost_status_fields of each status index, or -1 for those without
+ * fields of their own. See vhost_fields_init().
+ */
+static signed char vhost_method_field[VHOST_METHODS + 1];
+static signed char vhost_status_field[VHOST_STATUSES + 1];
+
+/** A counter of a timespan record, by its offset */
+#define VHOST_FIELD(ts, type, offset) (*(type *)((char *)(ts) + (offset)))
+
+/**
+ * Fill in the tables from which vhost_timespan_update() finds the fields of
+ * each method and status.
+ */
+static void vhost_fields_init(void)
+{
+    static const int statuses[] = { 200, 301, 302, 401, 403, 404, 500 };
+    static const int methods[] = { M_GET, VHOST_METHODS, M_POST, M_PUT };
+    int i;
+
+    memset(vhost_method_field, -1, sizeof(vhost_method_field));
+    memset(vhost_status_field, -1, sizeof(vhost_status_field));
+    for (i = 0; i < (int)(sizeof(methods) / sizeof(methods[0])); i++) {
+        vhost_method_field[methods[i]] = (signed char)i;
+    }
+    for (i = 0; i < (int)(sizeof(statuses) / sizeof(statuses[0])); i++) {
+        vhost_status_field[statuses[i] - VHOST_STATUS_MIN] = (signed char)i;
+    }
+}
+
+/**
+ * Update a timespan record according to the data contained in the given
+ * sample.
+ */
+static void vhost_timespan_update(struct vhost_timespan *ts,
+                                  const struct vhost_sample *sample)
+{
+    int i;
+
+    /* HEAD has the entry after the last method, see vhost_method_index() */
+    i = vhost_method_field[vhost_method_index(sample->method_number,
+                                              sample->header_only)];
+    if (i >= 0) {
+        VHOST_FIELD(ts, apr_off_t, vhost_method_fields[i].bytes)
+            += sample->read_length;
+        VHOST_FIELD(ts, apr_uint64_t, vhost_method_fields[i].count)
+            += sample->weight;
+    }
+
+    i = vhost_status_field[vhost_status_index(sample->status)];
+    if (i >= 0) {
+        VHOST_FIELD(ts, apr_off_t, vhost_status_fields[i].bytes)
+            += sample->bytes_sent;
+        VHOST_FIELD(ts, apr_uint64_t, vhost_status_fields[i].count)
+            += sample->weight;
+    }
+
+    ts->InLowBytes += sample->in_low_bytes;
+    ts->OutLowBytes += sample->out_low_bytes;
+
+    ts->InRequests += sample->weight;
+    ts->OutResponses += sample->weight;
+}
+
+/**
+ * Add the counters of one timespan record to another. The StartTime of
+ * the destination is left untouched.
+ */
+static void vhost_timespan_add(struct vhost_timespan *ts,
+                               const struct vhost_timespan *add)
+{
+    ts->InBytesGET += add->InBytesGET;
+    ts->InBytesHEAD += add->InBytesHEAD;
+    ts->InBytesPOST += add->InBytesPOST;
+    ts->InBytesPUT += add->InBytesPUT;
+
+    ts->InRequestsGET += add->InRequestsGET;
+    ts->InRequestsHEAD += add->InRequestsHEAD;
+    ts->InRequestsPOST += add->InRequestsPOST;
+    ts->InRequestsPUT += add->InRequestsPUT;
+
+    ts->OutBytes200 += add->OutBytes200;
+    ts->OutBytes301 += add->OutBytes301;
+    ts->OutBytes302 += add->OutBytes302;
+    ts->OutBytes401 += add->OutBytes401;
+    ts->OutBytes403 += add->OutBytes403;
+    ts->OutBytes404 += add->OutBytes404;
+    ts->OutBytes500 += add->OutBytes500;
+
+    ts->OutResponses200 += add->OutResponses200;
+    ts->OutResponses301 += add->OutResponses301;
+    ts->OutResponses302 += add->OutResponses302;
+    ts->OutResponses401 += add->OutResponses401;
+    ts->OutResponses403 += add->OutResponses403;
+    ts->OutResponses404 += add->OutResponses404;
+    ts->OutResponses500 += add->OutResponses500;
+
+    ts->InLowBytes += add->InLowBytes;
+    ts->OutLowBytes += add->OutLowBytes;
+
+    ts->InRequests += add->InRequests;
+    ts->OutResponses += add->OutResponses;
+}
+
+/**
+ * Subtract the counters of one timespan record from another, as for
+ * vhost_timespan_add(), to find what was counted in between.
+ */
+static void vhost_timespan_sub(struct vhost_timespan *ts,
+                               const struct vhost_timespan *sub)
+{
+    ts->InBytesGET -= sub->InBytesGET;
+    ts->InBytesHEAD -= sub->InBytesHEAD;
+    ts->InBytesPOST -= sub->InBytesPOST;
+    ts->InBytesPUT -= sub->InBytesPUT;
+
+    ts->InRequestsGET -= sub->InRequestsGET;
+    ts->InRequestsHEAD -= sub->InRequestsHEAD;
+    ts->InRequestsPOST -= sub->InRequestsPOST;
+    ts->InRequestsPUT -= sub->InRequestsPUT;
+
+    ts->OutBytes200 -= sub->OutBytes200;
+    ts->OutBytes301 -= sub->OutBytes301;
+    ts->OutBytes302 -= sub->OutBytes302;
+    ts->OutBytes401 -= sub->OutBytes401;
+    ts->OutBytes403 -= sub->OutBytes403;
+    ts->OutBytes404 -= sub->OutBytes404;
+    ts->OutBytes500 -= sub->OutBytes500;
+
+    ts->OutResponses200 -= sub->OutResponses200;
+    ts->OutResponses301 -= sub->OutResponses301;
+    ts->OutResponses302 -= sub->OutResponses302;
+    ts->OutResponses401 -= sub->OutResponses401;
+    ts->OutResponses403 -= sub->OutResponses403;
+    ts->OutResponses404 -= sub->OutResponses404;
+    ts->OutResponses500 -= sub->OutResponses500;
+
+    ts->InLowBytes -= sub->InLowBytes;
+    ts->OutLowBytes -= sub->OutLowBytes;
+
+    ts->InRequests -= sub->InRequests;
+    ts->OutResponses -= sub->OutResponses;
+}
+
+/**
+ * Count n responses of the given status in the Statuses of a timespan
+ * record, in the entry of the status, or else in an unused one, which is
+ * claimed with a compare-and-swap in shared records. A status outside of
+ * 100 to 599, or for which no entry is left, is counted as StatusesOther.
+ * The counts are added atomically if the record is shared.
+ */
+static void vhost_status_add(struct vhost_timespan *ts, int status,
+                             apr_uint64_t n, int shared)
+{
+    apr_uint32_t code = (apr_uint32_t)status, prev;
+    apr_uint64_t *count = &ts->StatusesOther;
+    int i;
+
+    if (!n) {
+        return;
+    }
+    if (vhost_status_index(status) < VHOST_STATUSES) {
+        for (i = 0; i < VHOST_STATUS_CODES; i++) {
+            prev = ts->Statuses[i].status;
+            if (prev == 0 && shared) {
+                prev = apr_atomic_cas32(&ts->Statuses[i].status, code, 0);
+            }
+            else if (prev == 0) {
+                ts->Statuses[i].status = code;
+            }
+            if (prev == 0 || prev == code) {
+                count = &ts->Statuses[i].count;
+                break;
+            }
+        }
+    }
+
+    if (shared) {
+        vhost_atomic_add64(count, n);
+    }
+    else {
+        *count += n;
+    }
+}
+
+/**
+ * The number of responses of the given status counted in the Statuses of
+ * a timespan record, outside of StatusesOther.
+ */
+static apr_uint64_t vhost_status_get(const struct vhost_timespan *ts,
+                                     apr_uint32_t status)
+{
+    int i;
+
+    for (i = 0; i < VHOST_STATUS_CODES; i++) {
+        if (ts->Statuses[i].status == status) {
+            return ts->Statuses[i].count;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Add the counters of one timespan record which are only kept once per
+ * VHost, those after VHOST_LIVE_SIZE, to another.
+ */
+static void vhost_shared_add(struct vhost_timespan *ts,
+                             const struct vhost_timespan *add)
+{
+    int i;
+
+    for (i = 0; i < VHOST_DURATION_BUCKETS; i++) {
+        ts->Duration[i] += add->Duration[i];
+    }
+    for (i = 0; i < VHOST_STATUS_CODES; i++) {
+        vhost_status_add(ts, (int)add->Statuses[i].status,
+                         add->Statuses[i].count, 0);
+    }
+    ts->StatusesOther += add->StatusesOther;
+    for (i = 0; i <= VHOST_METHODS; i++) {
+        ts->Methods[i] += add->Methods[i];
+    }
+    vhost_hll_merge(ts->Clients, add->Clients);
+}
+
+/**
+ * Find the bucket counting the given duration. Durations below
+ * 2 << VHOST_DURATION_SUB_BITS microseconds have a bucket each, above that
+ * the bucket is found from the highest bit set and the bits just below it.
+ */
+static int vhost_duration_bucket(apr_time_t duration)
+{
+    apr_uint32_t v;
+    int shift;
+
+    v = duration <= 0 ? 0
+      : duration >= APR_INT64_C(1) << VHOST_DURATION_BITS ? APR_UINT32_MAX
+      : (apr_uint32_t)duration;
+    shift = vhost_log2(v | (1 << VHOST_DURATION_SUB_BITS))
+          - VHOST_DURATION_SUB_BITS;
+    return (shift << VHOST_DURATION_SUB_BITS) + (int)(v >> shift);
+}
+
+/**
+ * The smallest duration counted in the given bucket, in microseconds.
+ */
+static apr_uint64_t vhost_duration_lower(int bucket)
+{
+    int shift = (bucket >> VHOST_DURATION_SUB_BITS) - 1;
+
+    if (shift <= 0) {
+        return bucket;
+    }
+    return (apr_uint64_t)(bucket - (shift << VHOST_DURATION_SUB_BITS))
+           << shift;
+}
+
+/**
+ * Estimate the given percentiles, in tenths of a percent, of the durations
+ * counted in a timespan record. Each is reported as the upper end of the
+ * bucket holding it, so the real value is at most that. The percentiles
+ * must be given in increasing order.
+ */
+static void vhost_duration_percentiles(const struct vhost_timespan *ts,
+                                       const int *permille,
+                                       apr_uint64_t *values, int n)
+{
+    apr_uint64_t total = 0, seen = 0;
+    int i, bucket = 0;
+
+    for (i = 0; i < VHOST_DURATION_BUCKETS; i++) {
+        total += ts->Duration[i];
+    }
+
+    for (i = 0; i < n; i++) {
+        apr_uint64_t rank = (total * permille[i] + 999) / 1000;
+
+        if (!total) {
+            values[i] = 0;
+            continue;
+        }
+        while (bucket < VHOST_DURATION_BUCKETS - 1
+               && seen + ts->Duration[bucket] < rank) {
+            seen += ts->Duration[bucket++];
+        }
+        values[i] = vhost_duration_lower(bucket + 1);
+    }
+}
+
+/**
+ * Add the given Server Config to the index of VHosts by Host name.
+ */
+static void vhost_host_index_add(apr_pool_t *p, const char *hostname,
+                                 struct bmx_vhost_scfg *scfg)
+{
+    apr_array_header_t *scfgs = apr_hash_get(vhost_host_index, hostname,
+                                             APR_HASH_KEY_STRING);
+    if (!scfgs) {
+        scfgs = apr_array_make(p, 1, sizeof(struct bmx_vhost_scfg *));
+        apr_hash_set(vhost_host_index, hostname, APR_HASH_KEY_STRING, scfgs);
+    }
+    APR_ARRAY_PUSH(scfgs, struct bmx_vhost_scfg *) = scfg;
+}
+
+/**
+ * Fetch the head of the given slot. The slots are laid out one after
+ * another, and each slot holds its head followed by the leading
+ * VHOST_LIVE_SIZE bytes of one timespan record and its details for each
+ * of its VHOST_SLOT_ENTRIES entries, so a worker only ever writes within
+ * its own slot.
+ */
+static struct vhost_slot_head *vhost_slot_head(int slot)
+{
+    return (struct vhost_slot_head *)(vhost_slots
+                                      + (apr_size_t)slot * vhost_slot_size);
+}
+
+/**
+ * Fetch the live counters of the given entry of the given slot. Only the
+ * leading fields of the returned record may be used.
+ */
+static struct vhost_timespan *vhost_slot_entry(int slot, int entry)
+{
+    return (struct vhost_timespan *)((char *)vhost_slot_head(slot)
+                                     + VHOST_SLOT_HEAD
+                                     + (apr_size_t)entry * VHOST_ENTRY_SIZE);
+}
+
+/**
+ * Fetch the details following the live counters of an entry of a slot.
+ */
+static struct vhost_slot_details *vhost_slot_details(
+                                      const struct vhost_timespan *entry)
+{
+    return (struct vhost_slot_details *)((char *)entry + VHOST_LIVE_SIZE);
+}
+
+/**
+ * Count n in the given key of the details of a slot entry, unless it has
+ * no room left for it.
+ */
+static int vhost_details_count(struct vhost_slot_details *details, int key,
+                               apr_uint32_t n)
+{
+    apr_uint32_t i;
+
+    for (i = 0; i < details->used; i++) {
+        if (details->keys[i] == key) {
+            break;
+        }
+    }
+    if (i == details->used) {
+        if (i == VHOST_SLOT_DETAILS) {
+            return 0;
+        }
+        details->keys[i] = (apr_uint16_t)key;
+        details->counts[i] = 0;
+        details->used++;
+    }
+    if (details->counts[i] > APR_UINT32_MAX - n) {
+        return 0;
+    }
+    details->counts[i] += n;
+    return 1;
+}
+
+/**
+ * Add the details of a slot entry to the durations, statuses and methods
+ * of a timespan record, atomically if the record is shared.
+ */
+static void vhost_details_add(struct vhost_timespan *ts,
+                              const struct vhost_slot_details *details,
+                              int shared)
+{
+    apr_uint64_t *count;
+    apr_uint32_t i;
+    int key;
+
+    for (i = 0; i < details->used && i < VHOST_SLOT_DETAILS; i++) {
+        key = details->keys[i];
+        /* a copy taken while the slot was cleared may hold no key */
+        if (key < 1 || key > VHOST_KEY_METHOD + VHOST_METHODS) {
+            continue;
+        }
+        if (key >= VHOST_KEY_METHOD) {
+            count = &ts->Methods[key - VHOST_KEY_METHOD];
+        }
+        else if (key >= VHOST_KEY_STATUS) {
+            /* the last key of the statuses is for those out of range */
+            vhost_status_add(ts, key - VHOST_KEY_STATUS + VHOST_STATUS_MIN,
+                             details->counts[i], shared);
+            continue;
+        }
+        else {
+            count = &ts->Duration[key - 1];
+        }
+
+        if (shared) {
+            vhost_atomic_add64(count, details->counts[i]);
+        }
+        else {
+            *count += details->counts[i];
+        }
+    }
+}
+
+/**
+ * Mark the given slot as being written by making its sequence counter odd.
+ * A counter left odd by a worker which died while writing stays odd.
+ */
+static void vhost_slot_write_begin(int slot)
+{
+    volatile apr_uint32_t *seq = &vhost_slot_head(slot)->seq;
+
+    *seq = *seq | 1;
+    vhost_barrier();
+}
+
+/**
+ * Mark the given slot as consistent again by making its sequence counter
+ * even, and different from before the write.
+ */
+static void vhost_slot_write_end(int slot)
+{
+    volatile apr_uint32_t *seq = &vhost_slot_head(slot)->seq;
+
+    vhost_barrier();
+    *seq = *seq + 1;
+}
+
+/** Atomically add a counter of a timespan record to a shared one */
+#define VHOST_FOLD(ts, add, field) \
+    if ((add)->field) vhost_atomic_add64(&(ts)->field, (add)->field)
+
+/**
+ * Fold the live counters of an entry of a worker slot, if given, and its
+ * details into the shared record of its VHost, with atomic operations
+ * since other workers may be folding theirs, between the fold counters of
+ * the VHost and of the global record. The caller clears what was folded
+ * within the same write of its slot.
+ */
+static void vhost_shared_fold(int index, const struct vhost_timespan *add,
+                              const struct vhost_slot_details *details)
+{
+    struct vhost_timespan *ts = &vhost_shared[index];
+    struct vhost_folds *folds = &vhost_folds[index];
+    struct vhost_folds *all = &vhost_folds[vhost_nrecords - 1];
+
+    /* APR's atomic read-modify-write operations are full barriers */
+    apr_atomic_inc32(&folds->started);
+    apr_atomic_inc32(&all->started);
+
+    if (details) {
+        vhost_details_add(ts, details, 1);
+    }
+    if (!add) {
+        goto done;
+    }
+
+    VHOST_FOLD(ts, add, InBytesGET);
+    VHOST_FOLD(ts, add, InBytesHEAD);
+    VHOST_FOLD(ts, add, InBytesPOST);
+    VHOST_FOLD(ts, add, InBytesPUT);
+
+    VHOST_FOLD(ts, add, InRequestsGET);
+    VHOST_FOLD(ts, add, InRequestsHEAD);
+    VHOST_FOLD(ts, add, InRequestsPOST);
+    VHOST_FOLD(ts, add, InRequestsPUT);
+
+    VHOST_FOLD(ts, add, OutBytes200);
+    VHOST_FOLD(ts, add, OutBytes301);
+    VHOST_FOLD(ts, add, OutBytes302);
+    VHOST_FOLD(ts, add, OutBytes401);
+    VHOST_FOLD(ts, add, OutBytes403);
+    VHOST_FOLD(ts, add, OutBytes404);
+    VHOST_FOLD(ts, add, OutBytes500);
+
+    VHOST_FOLD(ts, add, OutResponses200);
+    VHOST_FOLD(ts, add, OutResponses301);
+    VHOST_FOLD(ts, add, OutResponses302);
+    VHOST_FOLD(ts, add, OutResponses401);
+    VHOST_FOLD(ts, add, OutResponses403);
+    VHOST_FOLD(ts, add, OutResponses404);
+    VHOST_FOLD(ts, add, OutResponses500);
+
+    VHOST_FOLD(ts, add, InLowBytes);
+    VHOST_FOLD(ts, add, OutLowBytes);
+
+    VHOST_FOLD(ts, add, InRequests);
+    VHOST_FOLD(ts, add, OutResponses);
+
+done:
+    apr_atomic_inc32(&all->finished);
+    apr_atomic_inc32(&folds->finished);
+}
+
+/**
+ * Find the entry of the given slot counting the given VHost, for the
+ * worker writing the slot. A VHost without one takes over an unused entry,
+ * or else the one least recently recorded into, whose counters are first
+ * folded into the shared record of its VHost.
+ */
+static struct vhost_timespan *vhost_slot_take(int slot, int index)
+{
+    struct vhost_slot_head *head = vhost_slot_head(slot);
+    apr_uint32_t vhost = (apr_uint32_t)index + 1;
+    apr_uint32_t age, oldest = 0;
+    struct vhost_timespan *ts;
+    int entry, victim = 0;
+
+    head->clock++;
+    for (entry = 0; entry < VHOST_SLOT_ENTRIES; entry++) {
+        if (head->vhost[entry] == vhost) {
+            head->used[entry] = head->clock;
+            return vhost_slot_entry(slot, entry);
+        }
+        /* an unused entry is older than any other */
+        age = head->vhost[entry] ? head->clock - head->used[entry]
+                                 : APR_UINT32_MAX;
+        if (age > oldest) {
+            oldest = age;
+            victim = entry;
+        }
+    }
+
+    ts = vhost_slot_entry(slot, victim);
+    if (head->vhost[victim]) {
+        vhost_shared_fold((int)head->vhost[victim] - 1, ts,
+                          vhost_slot_details(ts));
+    }
+    memset(ts, 0, VHOST_ENTRY_SIZE);
+    head->vhost[victim] = vhost;
+    head->used[victim] = head->clock;
+    return ts;
+}
+
+/**
+ * Count a sample in the entry of its VHost in the slot it was taken for,
+ * taking one over if need be, while writing the slot. Its duration, status
+ * and method are counted in the details of the entry, which are first
+ * folded into the shared record of the VHost when they have no room left.
+ */
+static void vhost_slot_update(const struct vhost_sample *sample)
+{
+    struct vhost_timespan *ts = vhost_slot_take(sample->slot, sample->index);
+    struct vhost_slot_details *details = vhost_slot_details(ts);
+    int keys[3], i;
+
+    vhost_timespan_update(ts, sample);
+
+    keys[0] = 1 + vhost_duration_bucket(sample->duration);
+    keys[1] = VHOST_KEY_STATUS + vhost_status_index(sample->status);
+    keys[2] = VHOST_KEY_METHOD + vhost_method_index(sample->method_number,
+                                                    sample->header_only);
+    for (i = 0; i < 3; i++) {
+        if (!vhost_details_count(details, keys[i], sample->weight)) {
+            vhost_shared_fold(sample->index, NULL, details);
+            memset(details, 0, sizeof(*details));
+            (void)vhost_details_count(details, keys[i], sample->weight);
+        }
+    }
+}
+
+/**
+ * Add the live counters and details of the given VHost within the given
+ * slot to ts, or those of all VHosts for the global record, looking only
+ * at the given entry of the slot unless it is -1. The entries are copied
+ * again whenever the writer of the slot was busy with it, up to
+ * VHOST_SEQ_TRIES times.
+ */
+static void vhost_slot_read(int slot, int entry, int index,
+                            struct vhost_timespan *ts)
+{
+    struct vhost_slot_head *head = vhost_slot_head(slot);
+    apr_uint32_t vhost = (apr_uint32_t)index + 1;
+    int global = index == vhost_nrecords - 1;
+    apr_uint64_t copy[VHOST_SLOT_ENTRIES * VHOST_ENTRY_SIZE
+                      / sizeof(apr_uint64_t)];
+    apr_uint32_t ids[VHOST_SLOT_ENTRIES];
+    const struct vhost_timespan *live;
+    apr_uint32_t before;
+    int tries = VHOST_SEQ_TRIES;
+    int from = entry < 0 ? 0 : entry;
+    int to = entry < 0 ? VHOST_SLOT_ENTRIES : entry + 1;
+
+    do {
+        before = head->seq;
+        vhost_barrier();
+
+        memcpy(ids, head->vhost, sizeof(ids));
+        memcpy(copy, vhost_slot_entry(slot, from),
+               (apr_size_t)(to - from) * VHOST_ENTRY_SIZE);
+
+        vhost_barrier();
+    } while (((before & 1) || head->seq != before)
+             && vhost_seq_retry(&tries));
+
+    for (entry = from; entry < to; entry++) {
+        if (ids[entry] == vhost || (global && ids[entry])) {
+            live = (const struct vhost_timespan *)
+                   ((char *)copy + (apr_size_t)(entry - from)
+                                   * VHOST_ENTRY_SIZE);
+            vhost_timespan_add(ts, live);
+            vhost_details_add(ts, vhost_slot_details(live), 0);
+        }
+    }
+}
+
+/**
+ * Find the slot owned by the worker handling this request. Returns the
+ * trailing shared slot if the connection has no usable scoreboard handle,
+ * or a worker beyond those configured, such as one of a child still
+ * finishing up after a graceful restart, in which case the caller must
+ * hold the global mutex of the first shard while updating it.
+ */
+static int vhost_slot_get(request_rec *r)
+{
+    ap_sb_handle_t *sbh = (ap_sb_handle_t *)r->connection->sbh;
+    int slot;
+
+    if (!sbh || sbh->child_num < 0 || sbh->thread_num < 0
+        || sbh->thread_num >= vhost_thread_limit) {
+        return vhost_nslots - 1;
+    }
+
+    slot = sbh->child_num * vhost_thread_limit + sbh->thread_num;
+    if (slot >= vhost_nslots - 1) {
+        return vhost_nslots - 1;
+    }
+    return slot;
+}
+
+/**
+ * Make room for an index of the entries of the worker slots.
+ */
+static struct vhost_live_index *vhost_live_index_make(apr_pool_t *p)
+{
+    struct vhost_live_index *where = apr_palloc(p, sizeof(*where));
+
+    where->first = apr_palloc(p, (apr_size_t)vhost_nrecords
+                                 * sizeof(*where->first));
+    where->next = apr_palloc(p, (apr_size_t)vhost_nslots
+                                * VHOST_SLOT_ENTRIES * sizeof(*where->next));
+    return where;
+}
+
+/**
+ * Find the entries of every VHost in one pass over the heads of the worker
+ * slots. Entries taken over by another VHost after this are skipped when
+ * read, and those a VHost takes after this are missed until the next
+ * index, but the counters of a VHost which were seen before can only be
+ * missed if its entry was folded, which the reader notices.
+ */
+static void vhost_live_index_build(struct vhost_live_index *where)
+{
+    struct vhost_slot_head *head;
+    apr_uint32_t vhost;
+    int slot, entry, at;
+
+    for (at = 0; at < vhost_nrecords; at++) {
+        where->first[at] = -1;
+    }
+    for (slot = 0; slot < vhost_nslots; slot++) {
+        head = vhost_slot_head(slot);
+        for (entry = 0; entry < VHOST_SLOT_ENTRIES; entry++) {
+            vhost = head->vhost[entry];
+            if (vhost == 0 || vhost >= (apr_uint32_t)vhost_nrecords) {
+                continue;
+            }
+            at = slot * VHOST_SLOT_ENTRIES + entry;
+            where->next[at] = where->first[vhost - 1];
+            where->first[vhost - 1] = at;
+        }
+    }
+}
+
+/**
+ * Sum up the live counters of this generation of the given VHost record,
+ * those of its entries in the worker slots and of its shared record, from
+ * the given index of the entries if any, or else from every slot. The live
+ * counters of the global record are those of all VHosts together. The
+ * counters are read again, from every slot, whenever an entry of the
+ * VHost was folded meanwhile, up to VHOST_SEQ_TRIES times.
+ */
+static void vhost_live_snapshot(int index,
+                                const struct vhost_live_index *where,
+                                struct vhost_timespan *live)
+{
+    struct vhost_folds *folds = &vhost_folds[index];
+    apr_uint32_t finished, started;
+    int tries = VHOST_SEQ_TRIES;
+    int slot, i, at;
+
+    do {
+        finished = folds->finished;
+        vhost_barrier();
+        started = folds->started;
+        vhost_barrier();
+
+        memset(live, 0, sizeof(*live));
+        if (where && index < vhost_nrecords - 1) {
+            for (at = where->first[index]; at >= 0; at = where->next[at]) {
+                vhost_slot_read(at / VHOST_SLOT_ENTRIES,
+                                at % VHOST_SLOT_ENTRIES, index, live);
+            }
+        }
+        else {
+            for (slot = 0; slot < vhost_nslots; slot++) {
+                vhost_slot_read(slot, -1, index, live);
+            }
+        }
+        where = NULL;
+
+        if (index < vhost_nrecords - 1) {
+            vhost_timespan_add(live, &vhost_shared[index]);
+            vhost_shared_add(live, &vhost_shared[index]);
+        }
+        else {
+            for (i = 0; i < vhost_nrecords - 1; i++) {
+                vhost_timespan_add(live, &vhost_shared[i]);
+                vhost_shared_add(live, &vhost_shared[i]);
+            }
+        }
+
+        vhost_barrier();
+    } while ((started != finished || folds->started != started)
+             && vhost_seq_retry(&tries));
+}
+
+/**
+ * Compute the current VHost Data record of the given VHost by adding its
+ * live counters to the record loaded at startup. Only the timespans kept
+ * are counted, the others are left as they were loaded.
+ */
+static void vhost_data_snapshot(const struct bmx_vhost_scfg *scfg,
+                                const struct vhost_timespan *live,
+                                struct vhost_data *vhost_data)
+{
+    struct vhost_timespan *timespans[__N_VHOST_TYPES];
+    int type;
+
+    memcpy(vhost_data, &vhost_bases[scfg->index], sizeof(*vhost_data));
+    timespans[FOREVER] = &vhost_data->forever;
+    timespans[SINCE_START] = &vhost_data->since_start;
+    timespans[SINCE_RESTART] = &vhost_data->since_restart;
+
+    for (type = 0; type < __N_VHOST_TYPES; type++) {
+        if (vhost_timespans & VHOST_KEEP(type)) {
+            vhost_timespan_add(timespans[type], live);
+            vhost_shared_add(timespans[type], live);
+        }
+    }
+}
+
+/**
+ * The weight of one tick in each moving average window, that is
+ * 1 - exp(-VHOST_RATE_TICK / window), as for the Unix load average.
+ */
+static const double vhost_rate_alpha[VHOST_RATE_WINDOWS] = {
+    0.07995558537067671,    /* 1 - exp(-5 / 60) */
+    0.01652854617838251,    /* 1 - exp(-5 / 300) */
+    0.005540151995103271    /* 1 - exp(-5 / 900) */
+};
+
+/**
+ * Fetch the live counters of the given VHost as last summed up by the
+ * process updating the rates. Only the leading VHOST_LIVE_SIZE bytes of the
+ * returned record may be used.
+ */
+static struct vhost_timespan *vhost_totals_record(int index)
+{
+    return (struct vhost_timespan *)(vhost_totals
+                                     + (apr_size_t)index * VHOST_LIVE_SIZE);
+}
+
+/**
+ * Fetch point n of the series of the given VHost, of which only the leading
+ * VHOST_LIVE_SIZE bytes may be used.
+ */
+static struct vhost_timespan *vhost_series_point(int index, apr_uint32_t n)
+{
+    apr_size_t point = (apr_size_t)index * series_points
+                     + n % (apr_uint32_t)series_points;
+
+    return (struct vhost_timespan *)(vhost_series_data
+                                     + point * VHOST_LIVE_SIZE);
+}
+
+/**
+ * Find when the window of the given kind holding the given time started,
+ * in local time.
+ */
+static apr_time_t vhost_window_start(apr_time_t t, int w)
+{
+    apr_time_exp_t exp;
+    apr_time_t start;
+
+    apr_time_exp_lt(&exp, t);
+    exp.tm_usec = exp.tm_sec = exp.tm_min = 0;
+    if (w == DAY) {
+        exp.tm_hour = 0;
+    }
+    if (apr_time_exp_gmt_get(&start, &exp) != APR_SUCCESS) {
+        return t;
+    }
+    return start;
+}
+
+/**
+ * Find when the window of the given kind which started at the given time
+ * ends, which is when the next one starts.
+ */
+static apr_time_t vhost_window_end(apr_time_t start, int w)
+{
+    /* a day is 23 or 25 hours long when the clocks change */
+    return vhost_window_start(start + apr_time_from_sec(w == DAY ? 30 * 3600
+                                                                 : 3600), w);
+}
+
+/**
+ * Fetch the mark of the given VHost in the given buffer of the windows of
+ * the given kind, of which only the leading VHOST_LIVE_SIZE bytes may be
+ * used.
+ */
+static struct vhost_timespan *vhost_window_mark(int w, int buffer, int index)
+{
+    apr_size_t mark = (apr_size_t)(window_pos[w] * 2 + buffer)
+                      * vhost_nrecords + index;
+
+    return (struct vhost_timespan *)(vhost_window_marks
+                                     + mark * VHOST_LIVE_SIZE);
+}
+
+/**
+ * Fetch the unique clients registers of the given VHost, which must not be
+ * the global one, in the given buffer of the windows of the given kind.
+ */
+static apr_byte_t *vhost_window_clients(int w, int buffer, int index)
+{
+    apr_size_t sketch = (apr_size_t)(window_pos[w] * 2 + buffer)
+                        * (vhost_nrecords - 1) + index;
+
+    return vhost_window_sketches + sketch * VHOST_HLL_REGISTERS;
+}
+
+/**
+ * Count a client of the given hash in the current window of each kind kept
+ * of the given VHost. A client seen as a window starts may be counted in
+ * the one before.
+ */
+static void vhost_windows_add_client(int index, apr_uint64_t hash)
+{
+    int w;
+
+    for (w = 0; w < __N_VHOST_WINDOWS; w++) {
+        if (window_pos[w] >= 0) {
+            vhost_hll_add(vhost_window_clients(w,
+                              (vhost_windows->seq[w] >> 1) & 1, index),
+                          hash);
+        }
+    }
+}
+
+/**
+ * Whether any window of a kind kept has ended by the given time.
+ */
+static int vhost_windows_due(apr_time_t now)
+{
+    int w;
+
+    for (w = 0; w < __N_VHOST_WINDOWS; w++) {
+        if (window_pos[w] >= 0 && now >= vhost_windows->next[w]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Start the next window of each kind which ended, marking the live
+ * counters of every VHost just summed up. These overwrite the marks of the
+ * window before the one which ended, whose unique clients are cleared,
+ * then the buffers swap roles. The sequence counter of the kind is odd
+ * meanwhile, see vhost_window_read(). A window starts at its calendar time
+ * even if this comes a tick later.
+ */
+static void vhost_windows_roll(apr_time_t now)
+{
+    apr_uint32_t seq;
+    int w, buffer, index;
+
+    for (w = 0; w < __N_VHOST_WINDOWS; w++) {
+        if (window_pos[w] < 0 || now < vhost_windows->next[w]) {
+            continue;
+        }
+
+        seq = vhost_windows->seq[w];
+        buffer = !((seq >> 1) & 1);
+        apr_atomic_set32(&vhost_windows->seq[w], seq + 1);
+        vhost_barrier();
+
+        for (index = 0; index < vhost_nrecords; index++) {
+            memcpy(vhost_window_mark(w, buffer, index),
+                   vhost_totals_record(index), VHOST_LIVE_SIZE);
+        }
+        memset(vhost_window_clients(w, buffer, 0), 0,
+               (apr_size_t)(vhost_nrecords - 1) * VHOST_HLL_REGISTERS);
+        vhost_windows->start[w][buffer] = vhost_window_start(now, w);
+        vhost_windows->next[w] = vhost_window_end(
+                                     vhost_windows->start[w][buffer], w);
+
+        vhost_barrier();
+        apr_atomic_set32(&vhost_windows->seq[w], seq + 2);
+    }
+}
+
+/**
+ * Copy the marks of the current and previous windows of the given kind of
+ * the given VHost, and when these windows started, under the sequence
+ * counter of that kind, retrying up to VHOST_SEQ_TRIES times while a new
+ * window is being started.
+ * @returns The buffer of the current window.
+ */
+static int vhost_window_read(int w, int index, struct vhost_timespan *marks,
+                             apr_time_t *start)
+{
+    volatile apr_uint32_t *seq = &vhost_windows->seq[w];
+    apr_uint32_t before;
+    int tries = VHOST_SEQ_TRIES;
+    int current;
+
+    do {
+        before = *seq;
+        vhost_barrier();
+
+        current = (before >> 1) & 1;
+        memcpy(&marks[0], vhost_window_mark(w, current, index),
+               VHOST_LIVE_SIZE);
+        memcpy(&marks[1], vhost_window_mark(w, !current, index),
+               VHOST_LIVE_SIZE);
+        start[0] = vhost_windows->start[w][current];
+        start[1] = vhost_windows->start[w][!current];
+
+        vhost_barrier();
+    } while (((before & 1) || *seq != before)
+             && vhost_seq_retry(&tries));
+
+    return current;
+}
+
+/**
+ * Whether the rates, the series or the windows were due to be updated at
+ * the given time.
+ */
+static int vhost_tick_due(apr_time_t now)
+{
+    return now >= vhost_ticker->next_tick
+           || (vhost_series && now >= vhost_series->next_point)
+           || (vhost_windows && vhost_windows_due(now));
+}
+
+/**
+ * Update the moving average rates of every VHost from the live counters
+ * just summed up, catching up on the ticks missed since the last one.
+ */
+static void vhost_rates_update(apr_time_t now)
+{
+    double seconds, instant;
+    apr_uint64_t total[VHOST_RATE_METRICS];
+    int ticks, index, m, w, n;
+
+    ticks = 1 + (int)((now - vhost_ticker->next_tick)
+                      / apr_time_from_sec(VHOST_RATE_TICK));
+    vhost_ticker->next_tick += ticks * apr_time_from_sec(VHOST_RATE_TICK);
+    if (ticks > VHOST_RATE_MAX_TICKS) {
+        ticks = VHOST_RATE_MAX_TICKS;
+    }
+    seconds = (double)(now - vhost_ticker->last_tick) / APR_USEC_PER_SEC;
+    vhost_ticker->last_tick = now;
+
+    apr_atomic_set32(&vhost_ticker->seq, vhost_ticker->seq + 1);
+    vhost_barrier();
+
+    for (index = 0; index < vhost_nrecords; index++) {
+        struct vhost_rates *rates = &vhost_rates[index];
+        const struct vhost_timespan *ts = vhost_totals_record(index);
+
+        total[0] = ts->InRequests;
+        total[1] = ts->InLowBytes;
+        total[2] = ts->OutLowBytes;
+
+        for (m = 0; m < VHOST_RATE_METRICS; m++) {
+            instant = total[m] > rates->last[m] && seconds > 0
+                    ? (double)(total[m] - rates->last[m]) / seconds : 0;
+            rates->last[m] = total[m];
+
+            /* each tick missed saw the same average rate */
+            for (w = 0; w < VHOST_RATE_WINDOWS; w++) {
+                for (n = 0; n < ticks; n++) {
+                    rates->rate[m][w] += vhost_rate_alpha[w]
+                                         * (instant - rates->rate[m][w]);
+                }
+            }
+        }
+    }
+
+    vhost_barrier();
+    apr_atomic_set32(&vhost_ticker->seq, vhost_ticker->seq + 1);
+}
+
+/**
+ * Copy the moving average rates of the given VHost under the sequence
+ * counter of the ticker, retrying up to VHOST_SEQ_TRIES times while they
+ * are being updated, since their 64 bit fields may be torn otherwise.
+ */
+static void vhost_rates_read(int index, struct vhost_rates *rates)
+{
+    volatile apr_uint32_t *seq = &vhost_ticker->seq;
+    apr_uint32_t before;
+    int tries = VHOST_SEQ_TRIES;
+
+    do {
+        before = *seq;
+        vhost_barrier();
+        memcpy(rates, &vhost_rates[index], sizeof(*rates));
+        vhost_barrier();
+    } while (((before & 1) || *seq != before)
+             && vhost_seq_retry(&tries));
+}
+
+/**
+ * Take the next point of the series of every VHost from the live counters
+ * just summed up. A point missed is not made up for; the next one simply
+ * spans a longer time. The count of points taken is published last, so
+ * readers never use a point being written, see print_series_beans().
+ */
+static void vhost_series_take(apr_time_t now)
+{
+    apr_interval_time_t step = apr_time_from_sec(series_step);
+    apr_uint32_t n = vhost_series->taken;
+    int index;
+
+    for (index = 0; index < vhost_nrecords; index++) {
+        memcpy(vhost_series_point(index, n), vhost_totals_record(index),
+               VHOST_LIVE_SIZE);
+    }
+    vhost_series_times[n % (apr_uint32_t)series_points] = now;
+
+    vhost_barrier();
+    apr_atomic_set32(&vhost_series->taken, n + 1);
+
+    vhost_series->next_point += step
+                              * (1 + (now - vhost_series->next_point) / step);
+}
+
+/**
+ * Sum up the live counters of this generation of every VHost into
+ * vhost_totals, in one pass over the worker slots, each copied under its
+ * sequence counter, and over the shared records. A VHost whose entries were
+ * folded meanwhile is summed up again on its own, so that its totals never
+ * go back. Those of the global record are the sum of all the others.
+ */
+static void vhost_live_totals(void)
+{
+    const int global = vhost_nrecords - 1;
+    apr_uint32_t *finished = vhost_totals_folds;
+    apr_uint32_t *started = vhost_totals_folds + vhost_nrecords;
+    apr_uint64_t copy[(VHOST_SLOT_HEAD + VHOST_SLOT_ENTRIES * VHOST_ENTRY_SIZE)
+                      / sizeof(apr_uint64_t)];
+    const struct vhost_slot_head *head = (struct vhost_slot_head *)copy;
+    struct vhost_timespan live;
+    apr_uint32_t before, vhost;
+    int slot, entry, index, tries;
+
+    for (index = 0; index < global; index++) {
+        finished[index] = vhost_folds[index].finished;
+    }
+    vhost_barrier();
+    for (index = 0; index < global; index++) {
+        started[index] = vhost_folds[index].started;
+    }
+    vhost_barrier();
+
+    memset(vhost_totals, 0, (apr_size_t)vhost_nrecords * VHOST_LIVE_SIZE);
+    for (slot = 0; slot < vhost_nslots; slot++) {
+        tries = VHOST_SEQ_TRIES;
+        do {
+            before = vhost_slot_head(slot)->seq;
+            vhost_barrier();
+            memcpy(copy, vhost_slot_head(slot), sizeof(copy));
+            vhost_barrier();
+        } while (((before & 1) || vhost_slot_head(slot)->seq != before)
+                 && vhost_seq_retry(&tries));
+
+        for (entry = 0; entry < VHOST_SLOT_ENTRIES; entry++) {
+            vhost = head->vhost[entry];
+            if (vhost == 0 || vhost > (apr_uint32_t)global) {
+                continue;
+            }
+            vhost_timespan_add(vhost_totals_record((int)vhost - 1),
+                               (const struct vhost_timespan *)
+                               ((char *)copy + VHOST_SLOT_HEAD
+                                + (apr_size_t)entry * VHOST_ENTRY_SIZE));
+        }
+    }
+    for (index = 0; index < global; index++) {
+        vhost_timespan_add(vhost_totals_record(index), &vhost_shared[index]);
+    }
+
+    vhost_barrier();
+    for (index = 0; index < global; index++) {
+        if (started[index] != finished[index]
+            || vhost_folds[index].started != started[index]) {
+            vhost_live_snapshot(index, NULL, &live);
+            memcpy(vhost_totals_record(index), &live, VHOST_LIVE_SIZE);
+        }
+        vhost_timespan_add(vhost_totals_record(global),
+                           vhost_totals_record(index));
+    }
+}
+
+static void vhost_write_behind(void);
+
+/**
+ * Whether the counters are due to be written behind by the clock, as set
+ * by BMXVHostFlushInterval. BMXVHostFlushRequests is only checked once the
+ * counters are summed up.
+ */
+static int vhost_flush_due(apr_time_t now)
+{
+    return flush_interval && now >= vhost_ticker->next_flush;
+}
+
+/**
+ * Update the moving average rates, take the next point of the series and
+ * start the next windows of every VHost, whichever is due, from the
+ * counters of all worker slots, then, if asked to flush, write the
+ * counters behind into the store when BMXVHostFlushInterval or
+ * BMXVHostFlushRequests says so. Only the monitor hook flushes, so a query
+ * catching up on a late tick never waits for the store. Only one process
+ * ticks at a time, unless it has been at it for VHOST_RATE_STALE seconds.
+ */
+static void vhost_rates_tick(apr_time_t now, int flush)
+{
+    const int global = vhost_nrecords - 1;
+
+    if (!(vhost_tick_due(now) || (flush && vhost_flush_due(now)))
+        || !vhost_busy_claim(&vhost_ticker->busy, now, VHOST_RATE_STALE)) {
+        return;
+    }
+    /* another process may have ticked since we looked */
+    if (!(vhost_tick_due(now) || (flush && vhost_flush_due(now)))) {
+        apr_atomic_set32(&vhost_ticker->busy, 0);
+        return;
+    }
+
+    vhost_live_totals();
+
+    if (now >= vhost_ticker->next_tick) {
+        vhost_rates_update(now);
+    }
+    if (vhost_series && now >= vhost_series->next_point) {
+        vhost_series_take(now);
+    }
+    if (vhost_windows) {
+        vhost_windows_roll(now);
+    }
+
+    if (flush
+        && (vhost_flush_due(now)
+            || (flush_requests
+                && vhost_totals_record(global)->InRequests
+                   - vhost_ticker->flushed_requests >= flush_requests))) {
+        vhost_ticker->next_flush = now + apr_time_from_sec(flush_interval);
+        vhost_ticker->flushed_requests
+            = vhost_totals_record(global)->InRequests;
+        vhost_write_behind();
+    }
+
+    vhost_barrier();
+    apr_atomic_set32(&vhost_ticker->busy, 0);
+}
+
+/* --------------------------------------------------------------------
+ * Persistent storage routines
+ * -------------------------------------------------------------------- */
+
+/**
+ * Give the files we created to the user the children run as, so that
+ * they are able to write to them.
+ */
+static void vhost_file_chown(const char *fname)
+{
+#if !defined(OS2) && !defined(WIN32) && !defined(BEOS) && !defined(NETWARE)
+    if (fname && geteuid() == 0 /* is superuser */)
+        chown(fname, unixd_config.user_id, -1 /* no gid change */);
+#endif
+}
+
+/**
+ * Add the record key of the given VHost to the set of live keys.
+ */
+static void vhost_live_key_add(apr_hash_t *keys,
+                               const struct bmx_vhost_scfg *scfg)
+{
+    apr_pool_t *p = apr_hash_pool_get(keys);
+    char buf[VHOST_KEY_LEN];
+    apr_datum_t key;
+
+    vhost_scfg_key(scfg, buf, &key);
+    apr_hash_set(keys, apr_pstrmemdup(p, key.dptr, key.dsize), key.dsize,
+                 &scfg->shard);
+}
+
+/**
+ * Make the set of the record keys of all our VHosts, the global one
+ * included, each mapped to the shard of the store holding it.
+ */
+static apr_hash_t *vhost_live_keys(server_rec *s, apr_pool_t *p)
+{
+    apr_hash_t *keys = apr_hash_make(p);
+    server_rec *vhost;
+
+    vhost_live_key_add(keys, global_scfg);
+    for (vhost = s; vhost; vhost = vhost->next) {
+        vhost_live_key_add(keys, ap_get_module_config(vhost->module_config,
+                                                      &bmx_vhost_module));
+    }
+    return keys;
+}
+
+/* The DBM backend */
+
+/**
+ * The largest part of a record stored under one DBM key. SDBM limits each
+ * key and value pair to about a thousand bytes, so records are split into
+ * chunks stored under the key of the record followed by '#' and the number
+ * of the chunk, the first chunk being stored under the key itself.
+ */
+#define VHOST_DBM_CHUNK 512
+/** The longest key for which a record can be stored in the DBM */
+#define VHOST_DBM_KEY_LEN 480
+
+/**
+ * Make the key of the given chunk of the record stored under key, in buf.
+ */
+static void vhost_dbm_chunk_key(apr_datum_t *ckey, char *buf,
+                                const apr_datum_t *key, int chunk)
+{
+    if (chunk == 0) {
+        *ckey = *key;
+        return;
+    }
+    ckey->dsize = apr_snprintf(buf, VHOST_DBM_KEY_LEN + 16, "%s#%d",
+                               key->dptr, chunk);
+    ckey->dptr = buf;
+}
+
+/** The magic string at the start of a DBM record with a header */
+#define VHOST_DBM_MAGIC "BMXV"
+
+/**
+ * The header stored ahead of each VHost Data record in the DBM, with the
+ * size of struct vhost_timespan in the module which wrote it, so that the
+ * records of an earlier layout are extended when they are loaded rather
+ * than discarded. Records written before there was a header have none,
+ * and the size of their timespans is found from their own size.
+ */
+struct vhost_dbm_header {
+    /** VHOST_DBM_MAGIC, without its NUL */
+    char magic[4];
+    /** The size of struct vhost_timespan in the module which wrote it */
+    apr_uint32_t timespan_size;
+};
+
+/**
+ * The size of the leading fields of a timespan record which a stored
+ * layout with the given size has in common with ours. A layout larger
+ * than ours is not an earlier one, as the tables after StartTime shrank
+ * when they were made sparse, so only the fields every layout had are
+ * kept from it.
+ */
+static apr_size_t vhost_timespan_common(apr_size_t timespan_size)
+{
+    return timespan_size <= sizeof(struct vhost_timespan)
+        ? timespan_size : VHOST_BASE_SIZE;
+}
+
+/**
+ * Fetch the given chunk of the record stored under key, leaving the value
+ * NULL if there is none.
+ */
+static apr_status_t vhost_dbm_chunk_fetch(apr_dbm_t *dbm,
+                                          const apr_datum_t *key, int chunk,
+                                          apr_datum_t *value)
+{
+    char buf[VHOST_DBM_KEY_LEN + 16];
+    apr_datum_t ckey;
+
+    vhost_dbm_chunk_key(&ckey, buf, key, chunk);
+    memset(value, 0, sizeof(*value));
+    return apr_dbm_fetch(dbm, ckey, value);
+}
+
+/**
+ * Fetch the leading keep bytes of a VHost Data record from the chunks
+ * stored in a DBM, setting found if they add up to a record of some layout.
+ * Each timespan is copied up to the size both layouts have in common, so
+ * fields appended to struct vhost_timespan since the record was written
+ * start from zero, as do the records of the map file, see
+ * vhost_map_rebuild(). The chunks past keep are not fetched again.
+ */
+static apr_status_t vhost_dbm_fetch(apr_dbm_t *dbm, const apr_datum_t *key,
+                                    struct vhost_data *vhost_data,
+                                    apr_size_t keep, int *found)
+{
+    const apr_size_t size = sizeof(struct vhost_timespan);
+    struct vhost_dbm_header header;
+    apr_datum_t value;
+    apr_size_t total = 0, skip = 0, timespan_size, offset, at, within, len;
+    apr_size_t common, to, n;
+    apr_status_t rv;
+    int chunk, chunks;
+
+    *found = 0;
+    if (key->dsize > VHOST_DBM_KEY_LEN) {
+        return APR_SUCCESS;
+    }
+
+    /* add up the chunks, of which only the last one is short */
+    memset(&header, 0, sizeof(header));
+    for (chunks = 0; ; ) {
+        rv = vhost_dbm_chunk_fetch(dbm, key, chunks, &value);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+        if (!value.dptr) {
+            break;
+        }
+        if (chunks++ == 0 && value.dsize >= sizeof(header)) {
+            memcpy(&header, value.dptr, sizeof(header));
+        }
+        total += value.dsize;
+        if (value.dsize != VHOST_DBM_CHUNK) {
+            break;
+        }
+    }
+
+    if (!memcmp(header.magic, VHOST_DBM_MAGIC, sizeof(header.magic))) {
+        skip = sizeof(header);
+        timespan_size = header.timespan_size;
+        if (total - skip != __N_VHOST_TYPES * (apr_size_t)timespan_size) {
+            return APR_SUCCESS;
+        }
+    }
+    else {
+        /* written before records had a header */
+        if (total % __N_VHOST_TYPES) {
+            return APR_SUCCESS;
+        }
+        timespan_size = total / __N_VHOST_TYPES;
+    }
+    /* every layout had the live counters and the StartTime */
+    if (timespan_size < VHOST_BASE_SIZE) {
+        return APR_SUCCESS;
+    }
+
+    /* only the fields missing from another layout are left to clear */
+    common = vhost_timespan_common(timespan_size);
+    if (common < size) {
+        memset(vhost_data, 0, keep);
+    }
+    for (chunk = 0, at = 0;
+         chunk < chunks && at < skip + keep / size * timespan_size;
+         chunk++) {
+        rv = vhost_dbm_chunk_fetch(dbm, key, chunk, &value);
+        if (rv != APR_SUCCESS || !value.dptr) {
+            return rv;
+        }
+
+        /* copy the run of each timespan within the chunk */
+        for (offset = 0; offset < value.dsize; offset += len, at += len) {
+            len = value.dsize - offset;
+            if (at < skip) {
+                len = len < skip - at ? len : skip - at;
+                continue;
+            }
+            within = (at - skip) % timespan_size;
+            if (len > timespan_size - within) {
+                len = timespan_size - within;
+            }
+            to = (at - skip) / timespan_size * size + within;
+            if (within < common && to < keep) {
+                n = len < common - within ? len : common - within;
+                memcpy((char *)vhost_data + to, value.dptr + offset,
+                       n < keep - to ? n : keep - to);
+            }
+        }
+    }
+
+    *found = 1;
+    return APR_SUCCESS;
+}
+
+/**
+ * Store a VHost Data record in a DBM, chunk by chunk, after its header,
+ * then delete any chunk left over from a longer record.
+ */
+static apr_status_t vhost_dbm_put(apr_dbm_t *dbm, const apr_datum_t *key,
+                                  const struct vhost_data *vhost_data)
+{
+    char buf[VHOST_DBM_KEY_LEN + 16], first[VHOST_DBM_CHUNK];
+    struct vhost_dbm_header header;
+    apr_size_t total = sizeof(header) + sizeof(*vhost_data);
+    apr_datum_t ckey, value;
+    apr_size_t offset, len;
+    apr_status_t rv;
+    int chunk = 0;
+
+    if (key->dsize > VHOST_DBM_KEY_LEN) {
+        return APR_EINVAL;
+    }
+
+    memcpy(header.magic, VHOST_DBM_MAGIC, sizeof(header.magic));
+    header.timespan_size = sizeof(struct vhost_timespan);
+    memcpy(first, &header, sizeof(header));
+    memcpy(first + sizeof(header), vhost_data,
+           VHOST_DBM_CHUNK - sizeof(header));
+
+    for (offset = 0; offset < total; offset += len) {
+        len = total - offset;
+        if (len > VHOST_DBM_CHUNK) {
+            len = VHOST_DBM_CHUNK;
+        }
+
+        vhost_dbm_chunk_key(&ckey, buf, key, chunk++);
+        value.dsize = len;
+        value.dptr = offset ? (char *)vhost_data + offset - sizeof(header)
+                            : first;
+        rv = apr_dbm_store(dbm, ckey, value);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+    }
+
+    for (;;) {
+        vhost_dbm_chunk_key(&ckey, buf, key, chunk++);
+        if (!apr_dbm_exists(dbm, ckey)) {
+            break;
+        }
+        (void)apr_dbm_delete(dbm, ckey);
+    }
+    return APR_SUCCESS;
+}
+
+/** The DBMs where this process stores records, one per shard */
+static apr_dbm_t *store_dbm[VHOST_SHARDS_MAX];
+/** The pools of the DBMs opened by begin() for just one batch, if any */
+static apr_pool_t *store_dbm_pool[VHOST_SHARDS_MAX];
+
+/**
+ * Forget about a DBM once the pool it was opened from is gone.
+ */
+static apr_status_t vhost_dbm_closed(void *data)
+{
+    *(apr_dbm_t **)data = NULL;
+    return APR_SUCCESS;
+}
+
+/**
+ * The name of the DBM file of the given shard. A single DBM keeps the name
+ * it always had.
+ */
+static const char *vhost_dbm_fname(apr_pool_t *p, int shard)
+{
+    if (dbm_shards <= 1) {
+        return dbm_fname;
+    }
+    return apr_psprintf(p, "%s.%d", dbm_fname, shard);
+}
+
+/**
+ * Delete the records of the given shard of the store which belong to no
+ * VHost of ours, or to another shard, as left behind by a VHost removed
+ * from the configuration or by a change of BMXVHostDBMShards.
+ * @returns The number of DBM keys deleted.
+ */
+static int vhost_dbm_prune(apr_dbm_t *dbm, int shard, apr_hash_t *live,
+                           apr_pool_t *p)
+{
+    apr_array_header_t *stale = apr_array_make(p, 16, sizeof(apr_datum_t));
+    apr_datum_t key, *dead;
+    const int *live_shard;
+    apr_size_t len;
+    apr_status_t rv;
+    int i;
+
+    for (rv = apr_dbm_firstkey(dbm, &key);
+         rv == APR_SUCCESS && key.dptr;
+         rv = apr_dbm_nextkey(dbm, &key)) {
+        if (key.dsize < sizeof(KEY_PREFIX) - 1
+            || memcmp(key.dptr, KEY_PREFIX, sizeof(KEY_PREFIX) - 1)) {
+            continue;
+        }
+        /* the chunks after the first have '#' and a number appended */
+        for (len = 0; len < key.dsize && key.dptr[len] != '#'; len++)
+            ;
+        live_shard = apr_hash_get(live, key.dptr, len);
+        if (live_shard && *live_shard == shard) {
+            continue;
+        }
+        /* the DBM is not changed while it is being walked */
+        dead = apr_array_push(stale);
+        dead->dptr = apr_pmemdup(p, key.dptr, key.dsize);
+        dead->dsize = key.dsize;
+    }
+
+    dead = (apr_datum_t *)stale->elts;
+    for (i = 0; i < stale->nelts; i++) {
+        (void)apr_dbm_delete(dbm, dead[i]);
+    }
+    return stale->nelts;
+}
+
+static apr_status_t vhost_dbm_open(server_rec *s, apr_pool_t *pconf,
+                                   apr_pool_t *ptemp)
+{
+    const char *fname, *dbmfile1 = NULL, *dbmfile2 = NULL;
+    apr_hash_t *live = vhost_live_keys(s, ptemp);
+    apr_status_t rv;
+    int i, pruned;
+
+    for (i = 0; i < vhost_nlocks; i++) {
+        fname = vhost_dbm_fname(ptemp, i);
+        rv = apr_dbm_open(&store_dbm[i], fname, APR_DBM_RWCREATE,
+                          APR_OS_DEFAULT, ptemp);
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, "Failed to open "
+                         "mod_bmx_vhost DBM file '%s'", fname);
+            store_dbm[i] = NULL;
+            return rv;
+        }
+        apr_pool_cleanup_register(ptemp, &store_dbm[i], vhost_dbm_closed,
+                                  apr_pool_cleanup_null);
+
+        /*
+         * We have to make sure the Apache child processes have access to
+         * the DBM file.  WARN: With apr_dbm_open_ex, apr_dbm_get_usednames_ex
+         * is required to determine the correct filenames.
+         */
+        apr_dbm_get_usednames(ptemp, fname, &dbmfile1, &dbmfile2);
+        vhost_file_chown(dbmfile1);
+        vhost_file_chown(dbmfile2);
+
+        pruned = vhost_dbm_prune(store_dbm[i], i, live, ptemp);
+        if (pruned) {
+            ap_log_error(APLOG_MARK, APLOG_INFO, 0, s, "Deleted %d stale "
+                         "keys from mod_bmx_vhost DBM file '%s'", pruned,
+                         fname);
+        }
+    }
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t vhost_dbm_load(server_rec *s,
+                                   const struct bmx_vhost_scfg *scfg,
+                                   struct vhost_data *vhost_data,
+                                   apr_size_t keep, int *found)
+{
+    char buf[VHOST_KEY_LEN];
+    apr_datum_t key;
+    apr_status_t rv;
+
+    vhost_scfg_key(scfg, buf, &key);
+    rv = vhost_dbm_fetch(store_dbm[scfg->shard], &key, vhost_data, keep,
+                         found);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, "Failed to fetch "
+                     "mod_bmx_vhost record for vhost '%s'", key.dptr);
+    }
+    return rv;
+}
+
+static apr_status_t vhost_dbm_begin(server_rec *s, int shard)
+{
+    const char *fname;
+    apr_status_t rv;
+
+    if (store_dbm[shard]) {
+        return APR_SUCCESS;
+    }
+
+    rv = apr_pool_create(&store_dbm_pool[shard], s->process->pool);
+    if (rv != APR_SUCCESS) {
+        store_dbm_pool[shard] = NULL;
+        return rv;
+    }
+
+    /* a DBM removed while running means the statistics are to be reset */
+    fname = vhost_dbm_fname(store_dbm_pool[shard], shard);
+    rv = apr_dbm_open(&store_dbm[shard], fname, APR_DBM_READWRITE,
+                      APR_OS_DEFAULT, store_dbm_pool[shard]);
+    if (APR_STATUS_IS_ENOENT(rv)) {
+        ap_log_error(APLOG_MARK, APLOG_NOTICE, rv, s, "mod_bmx_vhost DBM "
+                     "file '%s' was removed, statistics are reset", fname);
+        goto fail;
+    } else if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, "Failed to open "
+                     "mod_bmx_vhost DBM file '%s'", fname);
+        goto fail;
+    }
+    apr_pool_cleanup_register(store_dbm_pool[shard], &store_dbm[shard],
+                              vhost_dbm_closed, apr_pool_cleanup_null);
+    return APR_SUCCESS;
+
+fail:
+    apr_pool_destroy(store_dbm_pool[shard]);
+    store_dbm_pool[shard] = NULL;
+    store_dbm[shard] = NULL;
+    return rv;
+}
+
+static apr_status_t vhost_dbm_store(server_rec *s,
+                                    const struct bmx_vhost_scfg *scfg,
+                                    const struct vhost_data *vhost_data)
+{
+    char buf[VHOST_KEY_LEN];
+    apr_datum_t key;
+    apr_status_t rv;
+
+    vhost_scfg_key(scfg, buf, &key);
+    rv = vhost_dbm_put(store_dbm[scfg->shard], &key, vhost_data);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, "Failed to store "
+                     "mod_bmx_vhost record for vhost '%s'", key.dptr);
+    }
+    return rv;
+}
+
+static apr_status_t vhost_dbm_commit(server_rec *s, int shard)
+{
+    if (store_dbm_pool[shard]) {
+        apr_pool_destroy(store_dbm_pool[shard]);
+        store_dbm_pool[shard] = NULL;
+    }
+    return APR_SUCCESS;
+}
+
+static const struct vhost_store vhost_store_dbm = {
+    "dbm",
+    vhost_dbm_open,
+    vhost_dbm_load,
+    vhost_dbm_begin,
+    vhost_dbm_store,
+    vhost_dbm_commit
+};
+
+/* The map backend */
+
+/** The magic string at the start of a mod_bmx_vhost map file */
+#define VHOST_MAP_MAGIC "BMXVHMAP"
+/** The version of the map file layout, only rev on incompatible changes */
+#define VHOST_MAP_VERSION 1
+/** The space reserved for each key in the index of the map file */
+#define VHOST_MAP_KEY_LEN 320
+/** The number of records by which the map file grows */
+#define VHOST_MAP_GROW 64
+/** The alignment of the parts of the map file synced, a multiple of the
+ * page size of any platform */
+#define VHOST_MAP_PAGE 65536
+
+/**
+ * The header at the start of the map file. It is followed by the index of
+ * the keys of all records, and then by two areas holding all records, of
+ * which only the active one is known to be consistent. A checkpoint writes
+ * the other area and only then makes it the active one, so a crash never
+ * leaves the file with half written records.
+ */
+struct vhost_map_header {
+    /** VHOST_MAP_MAGIC */
+    char magic[8];
+    /** VHOST_MAP_VERSION */
+    apr_uint32_t version;
+    /** The size of struct vhost_timespan in the module which wrote the file */
+    apr_uint32_t timespan_size;
+    /** The number of records the file has room for */
+    apr_uint32_t capacity;
+    /** The number of keys in use in the index */
+    apr_uint32_t nkeys;
+    /** The area holding the last checkpoint, 0 or 1 */
+    apr_uint32_t active;
+    /** Unused, keeps the checkpoint counter aligned */
+    apr_uint32_t reserved;
+    /** The number of checkpoints written to this file */
+    apr_uint64_t checkpoints;
+};
+
+/** The mapped map file, starting with its header */
+static struct vhost_map_header *vhost_map;
+/** The slot of each VHost record in the map file, or -1 if it has none */
+static int *vhost_map_slots;
+/** Whether each slot of the map file was stored in the current batch */
+static char *vhost_map_stored;
+/** The slot of each key in the map file, only while loading records */
+static apr_hash_t *vhost_map_index;
+/** The DBM from which a new map file is filled, only while loading records */
+static apr_dbm_t *vhost_map_import;
+
+/** The size of the map file header, records start on a cache line */
+#define VHOST_MAP_HEADER_SIZE \
+    APR_ALIGN(sizeof(struct vhost_map_header), VHOST_CACHE_LINE)
+
+/**
+ * The size of one record in a map file written with the given size of
+ * struct vhost_timespan.
+ */
+static apr_size_t vhost_map_record_size(apr_uint32_t timespan_size)
+{
+    return APR_ALIGN(__N_VHOST_TYPES * (apr_size_t)timespan_size,
+                     VHOST_CACHE_LINE);
+}
+
+/**
+ * The size of a map file with the given size of struct vhost_timespan and
+ * room for the given number of records.
+ */
+static apr_size_t vhost_map_size(apr_uint32_t timespan_size,
+                                 apr_uint32_t capacity)
+{
+    return VHOST_MAP_HEADER_SIZE + (apr_size_t)capacity
+        * (VHOST_MAP_KEY_LEN + 2 * vhost_map_record_size(timespan_size));
+}
+
+/**
+ * Fetch the key of the given slot in the index of a map file.
+ */
+static char *vhost_map_key(const struct vhost_map_header *map, int slot)
+{
+    return (char *)map + VHOST_MAP_HEADER_SIZE
+        + (apr_size_t)slot * VHOST_MAP_KEY_LEN;
+}
+
+/**
+ * Fetch the record of the given slot within the given area of a map file.
+ */
+static char *vhost_map_record(const struct vhost_map_header *map, int area,
+                              int slot)
+{
+    apr_size_t record_size = vhost_map_record_size(map->timespan_size);
+
+    return vhost_map_key(map, map->capacity)
+        + ((apr_size_t)area * map->capacity + slot) * record_size;
+}
+
+/**
+ * Check that the mapped file of the given size is a map file we can read.
+ */
+static int vhost_map_valid(const struct vhost_map_header *map,
+                           apr_size_t size)
+{
+    return size >= VHOST_MAP_HEADER_SIZE
+        && !memcmp(map->magic, VHOST_MAP_MAGIC, sizeof(map->magic))
+        && map->version == VHOST_MAP_VERSION
+        && map->timespan_size > 0
+        && map->active <= 1
+        && map->nkeys <= map->capacity
+        && size >= vhost_map_size(map->timespan_size, map->capacity);
+}
+
+/**
+ * Write the mapped changes to the part of the map file between the given
+ * offsets to disk, from the start of the page holding the first one.
+ */
+static void vhost_map_sync(apr_size_t from, apr_size_t to)
+{
+#if !defined(OS2) && !defined(WIN32) && !defined(BEOS) && !defined(NETWARE)
+    from &= ~(apr_size_t)(VHOST_MAP_PAGE - 1);
+    msync((char *)vhost_map + from, to - from, MS_SYNC);
+#endif
+}
+
+/**
+ * Map the map file into memory for reading and writing. A file too short
+ * to hold a header is not mapped, and leaves mm NULL.
+ */
+static apr_status_t vhost_map_mmap(apr_mmap_t **mm, apr_pool_t *p)
+{
+    apr_status_t rv;
+    apr_file_t *f;
+    apr_finfo_t finfo;
+
+    rv = apr_file_open(&f, map_fname, APR_FOPEN_READ | APR_FOPEN_WRITE
+                       | APR_FOPEN_BINARY, APR_OS_DEFAULT, p);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+
+    *mm = NULL;
+    rv = apr_file_info_get(&finfo, APR_FINFO_SIZE, f);
+    if (rv == APR_SUCCESS && finfo.size >= (apr_off_t)VHOST_MAP_HEADER_SIZE) {
+        rv = apr_mmap_create(mm, f, 0, (apr_size_t)finfo.size,
+                             APR_MMAP_READ | APR_MMAP_WRITE, p);
+    }
+
+    /* the mapping outlives the file descriptor */
+    apr_file_close(f);
+    return rv;
+}
+
+/**
+ * Write a new map file with room for the records of all our VHosts, and
+ * copy the keys of the given live ones and their last checkpoint from the
+ * old map file into it, if there was one. Each timespan is copied up to
+ * the size both layouts have in common, see vhost_timespan_common(), so
+ * fields appended to struct vhost_timespan start from zero. The file is
+ * written a record at a time rather than built in memory whole.
+ */
+static apr_status_t vhost_map_rebuild(server_rec *s, apr_pool_t *ptemp,
+                                      const struct vhost_map_header *old,
+                                      apr_hash_t *live)
+{
+    struct vhost_map_header *map;
+    apr_uint32_t capacity, slot, *copied;
+    apr_size_t record_size, head, size, at, len;
+    char *record, *zeros;
+    const char *tmp_fname = apr_pstrcat(ptemp, map_fname, ".tmp", NULL);
+    apr_file_t *f;
+    apr_status_t rv;
+
+    /* the file is sized for the VHosts we have, the others are dropped */
+    capacity = APR_ALIGN(vhost_nrecords, VHOST_MAP_GROW);
+    record_size = vhost_map_record_size(sizeof(struct vhost_timespan));
+    size = vhost_map_size(sizeof(struct vhost_timespan), capacity);
+
+    /* only the header and the index of keys are built in memory */
+    head = VHOST_MAP_HEADER_SIZE + (apr_size_t)capacity * VHOST_MAP_KEY_LEN;
+    map = apr_pcalloc(ptemp, head);
+    memcpy(map->magic, VHOST_MAP_MAGIC, sizeof(map->magic));
+    map->version = VHOST_MAP_VERSION;
+    map->timespan_size = sizeof(struct vhost_timespan);
+    map->capacity = capacity;
+
+    /* the slot of the old file from which each record is copied */
+    copied = apr_palloc(ptemp, capacity * sizeof(*copied));
+    if (old) {
+        map->checkpoints = old->checkpoints;
+        for (slot = 0; slot < old->nkeys && map->nkeys < capacity; slot++) {
+            if (apr_hash_get(live, vhost_map_key(old, slot),
+                             APR_HASH_KEY_STRING)) {
+                memcpy(vhost_map_key(map, map->nkeys),
+                       vhost_map_key(old, slot), VHOST_MAP_KEY_LEN);
+                copied[map->nkeys++] = slot;
+            }
+        }
+    }
+
+    /* write aside and rename, so the old file stays whole until replaced */
+    rv = apr_file_open(&f, tmp_fname, APR_FOPEN_WRITE | APR_FOPEN_CREATE
+                       | APR_FOPEN_TRUNCATE | APR_FOPEN_BINARY,
+                       APR_OS_DEFAULT, ptemp);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, "Failed to create "
+                     "mod_bmx_vhost map file '%s'", tmp_fname);
+        return rv;
+    }
+
+    rv = apr_file_write_full(f, map, head, NULL);
+    at = head;
+
+    /* the copied records at the start of area 0 */
+    if (map->nkeys) {
+        apr_size_t common = vhost_timespan_common(old->timespan_size);
+
+        record = apr_palloc(ptemp, record_size);
+        for (slot = 0; slot < map->nkeys && rv == APR_SUCCESS; slot++) {
+            const char *from = vhost_map_record(old, old->active,
+                                                (int)copied[slot]);
+            int type;
+
+            memset(record, 0, record_size);
+            for (type = 0; type < __N_VHOST_TYPES; type++) {
+                memcpy(record + type * map->timespan_size,
+                       from + type * old->timespan_size, common);
+            }
+            rv = apr_file_write_full(f, record, record_size, NULL);
+            at += record_size;
+        }
+    }
+
+    /* then zeros up to the end of area 1 */
+    zeros = apr_pcalloc(ptemp, VHOST_MAP_PAGE);
+    for (; at < size && rv == APR_SUCCESS; at += len) {
+        len = size - at < VHOST_MAP_PAGE ? size - at : VHOST_MAP_PAGE;
+        rv = apr_file_write_full(f, zeros, len, NULL);
+    }
+    apr_file_close(f);
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_rename(tmp_fname, map_fname, ptemp);
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, "Failed to write "
+                     "mod_bmx_vhost map file '%s'", map_fname);
+        apr_file_remove(tmp_fname, ptemp);
+        return rv;
+    }
+
+    vhost_file_chown(map_fname);
+    return APR_SUCCESS;
+}
+
+/**
+ * Forget about the key index and the imported DBM once the records are
+ * loaded and the pool they were allocated from is gone.
+ */
+static apr_status_t vhost_map_loaded(void *data)
+{
+    vhost_map_index = NULL;
+    vhost_map_import = NULL;
+    return APR_SUCCESS;
+}
+
+static apr_status_t vhost_map_open(server_rec *s, apr_pool_t *pconf,
+                                   apr_pool_t *ptemp)
+{
+    struct vhost_map_header *map = NULL;
+    apr_hash_t *live = vhost_live_keys(s, ptemp);
+    apr_mmap_t *mm = NULL;
+    apr_uint32_t slot, present = 0;
+    apr_status_t rv;
+
+    vhost_map = NULL;
+    vhost_map_slots = apr_palloc(pconf, vhost_nrecords * sizeof(int));
+    apr_pool_cleanup_register(ptemp, NULL, vhost_map_loaded,
+                              apr_pool_cleanup_null);
+
+    rv = vhost_map_mmap(&mm, pconf);
+    if (rv == APR_SUCCESS) {
+        if (!mm || !vhost_map_valid(mm->mm, mm->size)) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "'%s' is not a "
+                         "mod_bmx_vhost map file of version %d, statistics "
+                         "are reset", map_fname, VHOST_MAP_VERSION);
+        } else {
+            map = mm->mm;
+        }
+    } else if (!APR_STATUS_IS_ENOENT(rv)) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, "Failed to map "
+                     "mod_bmx_vhost map file '%s'", map_fname);
+        return rv;
+    } else {
+        /* fill a new map file with the records of an earlier DBM file */
+        if (apr_dbm_open(&vhost_map_import, dbm_fname, APR_DBM_READONLY,
+                         APR_OS_DEFAULT, ptemp) != APR_SUCCESS) {
+            vhost_map_import = NULL;
+        } else {
+            ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s, "Creating "
+                         "mod_bmx_vhost map file '%s' from the records of "
+                         "DBM file '%s'", map_fname, dbm_fname);
+        }
+    }
+
+    if (map) {
+        for (slot = 0; slot < map->nkeys; slot++) {
+            if (vhost_map_key(map, slot)[VHOST_MAP_KEY_LEN - 1] == '\0'
+                && apr_hash_get(live, vhost_map_key(map, slot),
+                                APR_HASH_KEY_STRING)) {
+                present++;
+            }
+        }
+    }
+
+    /*
+     * Upgrade the layout, drop the keys of VHosts we no longer have, or
+     * make room for the new ones
+     */
+    if (!map || map->timespan_size != sizeof(struct vhost_timespan)
+        || present < map->nkeys
+        || map->capacity - map->nkeys < vhost_nrecords - present) {
+        rv = vhost_map_rebuild(s, ptemp, map, live);
+        if (mm) {
+            apr_mmap_delete(mm);
+        }
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+        rv = vhost_map_mmap(&mm, pconf);
+        if (rv != APR_SUCCESS || !mm) {
+            ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, "Failed to map "
+                         "mod_bmx_vhost map file '%s'", map_fname);
+            return rv != APR_SUCCESS ? rv : APR_EGENERAL;
+        }
+        map = mm->mm;
+    }
+
+    vhost_map = map;
+    vhost_map_stored = apr_palloc(pconf, map->capacity);
+
+    vhost_map_index = apr_hash_make(ptemp);
+    for (slot = 0; slot < map->nkeys; slot++) {
+        apr_uint32_t *val;
+        if (vhost_map_key(map, slot)[VHOST_MAP_KEY_LEN - 1] != '\0') {
+            continue;
+        }
+        val = apr_palloc(ptemp, sizeof(*val));
+        *val = slot;
+        apr_hash_set(vhost_map_index, vhost_map_key(map, slot),
+                     APR_HASH_KEY_STRING, val);
+    }
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t vhost_map_load(server_rec *s,
+                                   const struct bmx_vhost_scfg *scfg,
+                                   struct vhost_data *vhost_data,
+                                   apr_size_t keep, int *found)
+{
+    char buf[VHOST_KEY_LEN];
+    apr_datum_t key;
+    apr_uint32_t *slot;
+
+    *found = 0;
+
+    vhost_scfg_key(scfg, buf, &key);
+    slot = apr_hash_get(vhost_map_index, key.dptr, key.dsize);
+    if (slot) {
+        memcpy(vhost_data, vhost_map_record(vhost_map, vhost_map->active,
+                                            *slot), keep);
+        vhost_map_slots[scfg->index] = *slot;
+        *found = 1;
+        return APR_SUCCESS;
+    }
+
+    if (key.dsize >= VHOST_MAP_KEY_LEN
+        || vhost_map->nkeys >= vhost_map->capacity) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "No room in mod_bmx_vhost "
+                     "map file for vhost '%s', its statistics are not saved",
+                     key.dptr);
+        vhost_map_slots[scfg->index] = -1;
+        return APR_SUCCESS;
+    }
+
+    /* take the next free slot, the key is written before it is counted */
+    slot = apr_palloc(apr_hash_pool_get(vhost_map_index), sizeof(*slot));
+    *slot = vhost_map->nkeys;
+    memcpy(vhost_map_key(vhost_map, *slot), key.dptr, key.dsize);
+    vhost_map_key(vhost_map, *slot)[key.dsize] = '\0';
+    vhost_map->nkeys++;
+    apr_hash_set(vhost_map_index, vhost_map_key(vhost_map, *slot),
+                 key.dsize, slot);
+    vhost_map_slots[scfg->index] = *slot;
+
+    if (vhost_map_import) {
+        (void)vhost_dbm_fetch(vhost_map_import, &key, vhost_data, keep,
+                              found);
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t vhost_map_begin(server_rec *s, int shard)
+{
+    if (!vhost_map) {
+        return APR_EGENERAL;
+    }
+
+    memset(vhost_map_stored, 0, vhost_map->capacity);
+    return APR_SUCCESS;
+}
+
+static apr_status_t vhost_map_store(server_rec *s,
+                                    const struct bmx_vhost_scfg *scfg,
+                                    const struct vhost_data *vhost_data)
+{
+    int slot = vhost_map_slots[scfg->index];
+
+    if (slot >= 0) {
+        memcpy(vhost_map_record(vhost_map, !vhost_map->active, slot),
+               vhost_data, sizeof(*vhost_data));
+        vhost_map_stored[slot] = 1;
+    }
+    return APR_SUCCESS;
+}
+
+/**
+ * Finish a checkpoint: only the records not stored in this batch are
+ * copied over from the last one, and only the index and the records in use
+ * are synced, before the header makes them the active ones.
+ */
+static apr_status_t vhost_map_commit(server_rec *s, int shard)
+{
+    apr_size_t record_size = vhost_map_record_size(vhost_map->timespan_size);
+    char *area = vhost_map_record(vhost_map, !vhost_map->active, 0);
+    apr_uint32_t slot;
+
+    for (slot = 0; slot < vhost_map->nkeys; slot++) {
+        if (!vhost_map_stored[slot]) {
+            memcpy(area + slot * record_size,
+                   vhost_map_record(vhost_map, vhost_map->active, slot),
+                   record_size);
+        }
+    }
+
+    /* the records must be on disk before the header points at them */
+    vhost_map_sync(0, vhost_map_key(vhost_map, vhost_map->nkeys)
+                      - (char *)vhost_map);
+    vhost_map_sync(area - (char *)vhost_map,
+                   area + vhost_map->nkeys * record_size
+                   - (char *)vhost_map);
+    vhost_map->active = !vhost_map->active;
+    vhost_map->checkpoints++;
+    vhost_map_sync(0, VHOST_MAP_HEADER_SIZE);
+    return APR_SUCCESS;
+}
+
+static const struct vhost_store vhost_store_map = {
+    "map",
+    vhost_map_open,
+    vhost_map_load,
+    vhost_map_begin,
+    vhost_map_store,
+    vhost_map_commit
+};
+
+#ifdef BMX_HAVE_SOCACHE
+/* The socache backend */
+
+/**
+ * How long a record is kept by the socache provider after it was last
+ * stored. This is kept below the 30 days memcached takes as relative.
+ */
+#define VHOST_SOCACHE_EXPIRY apr_time_from_sec(29 * 24 * 60 * 60)
+
+/** The scratch pool of the socache calls, cleared after each batch */
+static apr_pool_t *socache_pool;
+
+/**
+ * Set for each record which could not be fetched from the cache, as it was
+ * unreachable, and which must not be stored over what it holds.
+ */
+static char *socache_unloaded;
+
+/** The key of the socache instance kept in the process pool */
+#define SOCACHE_KEPT_KEY "bmx_vhost_socache"
+
+/**
+ * The socache instance, kept in the process pool of the parent so that a
+ * provider which keeps its entries in memory, such as shmcb, carries them
+ * over a restart. It is made again when the provider or its arguments
+ * change, and lost when the server stops.
+ */
+struct vhost_socache_kept {
+    /** The name of the provider of the instance, "" once destroyed */
+    const char *name;
+    /** The arguments the instance was made with */
+    const char *args;
+    ap_socache_instance_t *instance;
+};
+
+static apr_status_t vhost_socache_open(server_rec *s, apr_pool_t *pconf,
+                                       apr_pool_t *ptemp)
+{
+    apr_pool_t *p = s->process->pool;
+    struct vhost_socache_kept *kept = NULL;
+    const ap_socache_provider_t *provider;
+    struct ap_socache_hints hints;
+    const char *err;
+    apr_status_t rv;
+
+    socache_unloaded = apr_pcalloc(pconf, vhost_nrecords);
+
+    apr_pool_userdata_get((void **)&kept, SOCACHE_KEPT_KEY, p);
+    if (!kept) {
+        kept = apr_pcalloc(p, sizeof(*kept));
+        kept->name = "";
+        apr_pool_userdata_set(kept, SOCACHE_KEPT_KEY, apr_pool_cleanup_null,
+                              p);
+    }
+    else if (!strcmp(kept->name, socache_provider->name)
+             && !strcmp(kept->args, socache_args)) {
+        socache_instance = kept->instance;
+        return apr_pool_create(&socache_pool, pconf);
+    }
+    else if (*kept->name) {
+        /* the module of the previous provider may be gone by now */
+        provider = ap_lookup_provider(AP_SOCACHE_PROVIDER_GROUP, kept->name,
+                                      AP_SOCACHE_PROVIDER_VERSION);
+        if (provider) {
+            provider->destroy(kept->instance, s);
+        }
+        kept->name = "";
+    }
+
+    err = socache_provider->create(&socache_instance, socache_args, ptemp,
+                                   p);
+    if (err) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, 0, s, "Failed to create the "
+                     "mod_bmx_vhost '%s' socache: %s", socache_provider->name,
+                     err);
+        return APR_EGENERAL;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.avg_id_len = sizeof(KEY_PREFIX "-www.example.com:80") - 1;
+    hints.avg_obj_size = sizeof(struct vhost_data);
+    hints.expiry_interval = VHOST_SOCACHE_EXPIRY;
+
+    rv = socache_provider->init(socache_instance, BMX_VHOST_DOMAIN, &hints,
+                                s, p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, "Failed to initialise "
+                     "the mod_bmx_vhost '%s' socache", socache_provider->name);
+        return rv;
+    }
+    kept->name = apr_pstrdup(p, socache_provider->name);
+    kept->args = apr_pstrdup(p, socache_args);
+    kept->instance = socache_instance;
+
+    return apr_pool_create(&socache_pool, pconf);
+}
+
+static apr_status_t vhost_socache_load(server_rec *s,
+                                       const struct bmx_vhost_scfg *scfg,
+                                       struct vhost_data *vhost_data,
+                                       apr_size_t keep, int *found)
+{
+    unsigned int len = sizeof(*vhost_data);
+    unsigned char *record = apr_palloc(socache_pool, len);
+    char buf[VHOST_KEY_LEN];
+    apr_datum_t key;
+    apr_status_t rv;
+
+    *found = 0;
+
+    /* the whole record is returned, into the pool of this batch */
+    vhost_scfg_key(scfg, buf, &key);
+    rv = socache_provider->retrieve(socache_instance, s,
+                                    (unsigned char *)key.dptr,
+                                    key.dsize, record, &len,
+                                    socache_pool);
+    if (rv == APR_SUCCESS && len == sizeof(*vhost_data)) {
+        memcpy(vhost_data, record, keep);
+        *found = 1;
+    }
+    else if (rv == APR_SUCCESS || !APR_STATUS_IS_NOTFOUND(rv)) {
+        /* a cache which is unavailable must not keep the server down, nor
+         * have the record it could not return overwritten */
+        socache_unloaded[scfg->index] = 1;
+        ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s, "Failed to fetch "
+                     "mod_bmx_vhost record for vhost '%s' from the '%s' "
+                     "socache, it is not saved until the next restart",
+                     key.dptr, socache_provider->name);
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t vhost_socache_begin(server_rec *s, int shard)
+{
+    return APR_SUCCESS;
+}
+
+static apr_status_t vhost_socache_store(server_rec *s,
+                                        const struct bmx_vhost_scfg *scfg,
+                                        const struct vhost_data *vhost_data)
+{
+    char buf[VHOST_KEY_LEN];
+    apr_datum_t key;
+    apr_status_t rv;
+
+    if (socache_unloaded[scfg->index]) {
+        return APR_SUCCESS;
+    }
+
+    vhost_scfg_key(scfg, buf, &key);
+    rv = socache_provider->store(socache_instance, s,
+                                 (unsigned char *)key.dptr,
+                                 key.dsize,
+                                 apr_time_now() + VHOST_SOCACHE_EXPIRY,
+                                 (unsigned char *)vhost_data,
+                                 sizeof(*vhost_data), socache_pool);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "Failed to store "
+                     "mod_bmx_vhost record for vhost '%s' in the '%s' "
+                     "socache", key.dptr, socache_provider->name);
+    }
+    return rv;
+}
+
+static apr_status_t vhost_socache_commit(server_rec *s, int shard)
+{
+    apr_pool_clear(socache_pool);
+    return APR_SUCCESS;
+}
+
+static const struct vhost_store vhost_store_socache = {
+    "socache",
+    vhost_socache_open,
+    vhost_socache_load,
+    vhost_socache_begin,
+    vhost_socache_store,
+    vhost_socache_commit
+};
+#endif
+
+/**
+ * Find the storage backend of the given name.
+ */
+static const struct vhost_store *vhost_store_find(const char *name)
+{
+    if (!strcasecmp(name, vhost_store_map.name)) {
+        return &vhost_store_map;
+    }
+    if (!strcasecmp(name, vhost_store_dbm.name)) {
+        return &vhost_store_dbm;
+    }
+    return NULL;
+}
+
+/**
+ * Load the parts of the vhost data for a given VHost which outlive this
+ * reset from the store straight into its base record in shared memory,
+ * which is still clear, or start an entirely new record if the record did
+ * not already exist, then store it back. The caller has begun a batch.
+ */
+static apr_status_t vhost_data_reset(server_rec *s,
+                                     const struct bmx_vhost_scfg *scfg,
+                                     int startup, apr_time_t now)
+{
+    apr_status_t rv;
+    struct vhost_data *vhost_data = &vhost_bases[scfg->index];
+    int found;
+
+    /* the 'since-restart' parts, and 'since-start' ones at startup, stay 0 */
+    rv = vhost_store->load(s, scfg, vhost_data,
+                           startup ? APR_OFFSETOF(struct vhost_data,
+                                                  since_start)
+                                   : APR_OFFSETOF(struct vhost_data,
+                                                  since_restart),
+                           &found);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+
+    if (!found) {
+        vhost_data->forever.StartTime = now;
+    }
+    if (!found || startup) {
+        vhost_data->since_start.StartTime = now;
+    }
+    vhost_data->since_restart.StartTime = now;
+
+    /* the live counters of this generation are added to this record */
+    return vhost_store->store(s, scfg, vhost_data);
+}
+
+/**
+ * Reset the records of all VHosts, in one batch of each shard of the store,
+ * in the order of their base records, the global one last. These are
+ * loaded over base records which were cleared together with the rest of
+ * the shared memory it was just created in, see vhost_shm_create().
+ */
+static apr_status_t vhost_data_reset_all(server_rec *s, int startup)
+{
+    apr_time_t now = apr_time_now();
+    apr_status_t rv = APR_SUCCESS;
+    struct bmx_vhost_scfg *scfg;
+    server_rec *vhost;
+    int shard;
+
+    for (shard = 0; shard < vhost_nlocks && rv == APR_SUCCESS; shard++) {
+        rv = vhost_store->begin(s, shard);
+        if (rv != APR_SUCCESS) {
+            break;
+        }
+
+        for (vhost = s; vhost && rv == APR_SUCCESS; vhost = vhost->next) {
+            scfg = ap_get_module_config(vhost->module_config,
+                                        &bmx_vhost_module);
+            if (scfg->shard == shard) {
+                rv = vhost_data_reset(s, scfg, startup, now);
+            }
+        }
+        if (rv == APR_SUCCESS && global_scfg->shard == shard) {
+            rv = vhost_data_reset(s, global_scfg, startup, now);
+        }
+
+        (void)vhost_store->commit(s, shard);
+    }
+
+    return rv;
+}
+
+/**
+ * Store the current VHost Data record of the given VHost, whose entries in
+ * the worker slots were indexed. Records which saw no traffic during this
+ * generation are left alone, as are those which saw none since they were
+ * last stored, if the caller tracks that in the flushed array. The live
+ * counters stored are left in the taken array of records if given.
+ */
+static apr_status_t vhost_data_fold(server_rec *s,
+                                    const struct bmx_vhost_scfg *scfg,
+                                    apr_uint64_t *flushed,
+                                    struct vhost_timespan *taken)
+{
+    apr_status_t rv;
+    struct vhost_timespan live;
+    struct vhost_data vhost_data;
+
+    vhost_live_snapshot(scfg->index, vhost_index, &live);
+    if (live.InRequests == 0) {
+        return APR_SUCCESS;
+    }
+    if (flushed && flushed[scfg->index] == live.InRequests) {
+        return APR_SUCCESS;
+    }
+
+    vhost_data_snapshot(scfg, &live, &vhost_data);
+    rv = vhost_store->store(s, scfg, &vhost_data);
+    if (rv == APR_SUCCESS && flushed) {
+        flushed[scfg->index] = live.InRequests;
+    }
+    if (rv == APR_SUCCESS && taken) {
+        memcpy(&taken[scfg->index], &live, sizeof(live));
+    }
+    return rv;
+}
+
+/**
+ * Take the lock of the given shard of the store, counting how long that
+ * took in the statistics of the lock.
+ */
+static apr_status_t vhost_lock(server_rec *s, int shard, const char *what)
+{
+    struct vhost_lock_stats *stats;
+    apr_time_t start = apr_time_now();
+    apr_uint64_t wait;
+    apr_status_t rv;
+
+    /* already logged when the child started */
+    if (vhost_locks_lost) {
+        return APR_ENOLOCK;
+    }
+
+    rv = apr_global_mutex_lock(vhost_locks[shard]);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, "Lock failure while "
+                     "%s", what);
+        return rv;
+    }
+
+    if (vhost_lock_stats) {
+        stats = &vhost_lock_stats[shard];
+        wait = apr_time_now() - start;
+        stats->acquired++;
+        stats->wait_time += wait;
+        if (wait > stats->max_wait) {
+            stats->max_wait = wait;
+        }
+    }
+    return APR_SUCCESS;
+}
+
+/**
+ * Release the lock of the given shard of the store.
+ */
+static apr_status_t vhost_unlock(server_rec *s, int shard, const char *what)
+{
+    apr_status_t rv;
+
+    rv = apr_global_mutex_unlock(vhost_locks[shard]);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, "Unlock failure while "
+                     "%s", what);
+    }
+    return rv;
+}
+
+/**
+ * Store the current VHost Data records of the global server and of all
+ * vhosts, in one batch per shard of the store, each under the lock of its
+ * shard. Children start from different shards so they seldom wait for one
+ * another. The entries of the worker slots are indexed once for all.
+ */
+static apr_status_t vhost_data_fold_all(server_rec *s, apr_uint64_t *flushed,
+                                        struct vhost_timespan *taken,
+                                        const char *what)
+{
+    apr_status_t rv, ret = APR_SUCCESS;
+    struct bmx_vhost_scfg *scfg;
+    server_rec *vhost;
+    int first = (int)(apr_time_now() % vhost_nlocks);
+    int i, shard;
+
+    vhost_live_index_build(vhost_index);
+
+    for (i = 0; i < vhost_nlocks; i++) {
+        shard = (first + i) % vhost_nlocks;
+        if (vhost_lock(s, shard, what) != APR_SUCCESS) {
+            continue;
+        }
+
+        rv = vhost_store->begin(s, shard);
+        if (rv == APR_SUCCESS && global_scfg->shard == shard) {
+            rv = vhost_data_fold(s, global_scfg, flushed, taken);
+        }
+        for (vhost = s; vhost && rv == APR_SUCCESS; vhost = vhost->next) {
+            scfg = ap_get_module_config(vhost->module_config,
+                                        &bmx_vhost_module);
+            if (scfg->shard == shard) {
+                rv = vhost_data_fold(s, scfg, flushed, taken);
+            }
+        }
+        (void)vhost_store->commit(s, shard);
+
+        (void)vhost_unlock(s, shard, what);
+        if (rv != APR_SUCCESS) {
+            ret = rv;
+        }
+    }
+    return ret;
+}
+
+/**
+ * Whether the given status already has properties of its own, OutBytes
+ * and OutResponses.
+ */
+static int vhost_status_reported(int status)
+{
+    switch (status) {
+    case 200:
+    case 301:
+    case 302:
+    case 401:
+    case 403:
+    case 404:
+    case 500:
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Copy the Statuses of a timespan record in the order of their codes, the
+ * unused entries last.
+ */
+static void vhost_statuses_sort(const struct vhost_timespan *timespan,
+                                struct vhost_status_count *statuses)
+{
+    const struct vhost_status_count *sc;
+    int i, j, n = 0;
+
+    memset(statuses, 0, VHOST_STATUS_CODES * sizeof(*statuses));
+    for (i = 0; i < VHOST_STATUS_CODES; i++) {
+        sc = &timespan->Statuses[i];
+        if (!sc->status) {
+            continue;
+        }
+        for (j = n++; j > 0 && statuses[j - 1].status > sc->status; j--) {
+            statuses[j] = statuses[j - 1];
+        }
+        statuses[j] = *sc;
+    }
+}
+
+/** The names of the properties reporting the moving average rates */
+static const char *const rate_names[VHOST_RATE_METRICS][VHOST_RATE_WINDOWS] = {
+    { "ReqPerSec1m", "ReqPerSec5m", "ReqPerSec15m" },
+    { "InBytesPerSec1m", "InBytesPerSec5m", "InBytesPerSec15m" },
+    { "OutBytesPerSec1m", "OutBytesPerSec5m", "OutBytesPerSec15m" }
+};
+
+/** The number of duration percentiles reported for each timespan */
+#define N_DURATION_PERCENTILES 4
+/** The duration percentiles reported, in tenths of a percent */
+static const int duration_permille[N_DURATION_PERCENTILES] = {
+    500, 900, 990, 999
+};
+/** The names of the properties reporting the duration percentiles */
+static const char *const duration_names[N_DURATION_PERCENTILES] = {
+    "DurationP50", "DurationP90", "DurationP99", "DurationP999"
+};
+
+/**
+ * Create a property of a count, as a counter if it only ever grows rather
+ * than counting what happened within some time.
+ */
+static struct bmx_property *vhost_count_create(const char *key,
+                                               apr_uint64_t count,
+                                               int counter, apr_pool_t *p)
+{
+    return counter ? bmx_property_counter_create(key, count, p)
+                   : bmx_property_uint64_create(key, count, p);
+}
+
+/**
+ * Add the properties of the live counters of a timespan record, those
+ * before VHOST_LIVE_SIZE, to the given bean, as counters if they only ever
+ * grow.
+ */
+static void vhost_bean_add_counters(struct bmx_bean *bean,
+                                    const struct vhost_timespan *timespan,
+                                    int counter, apr_pool_t *p)
+{
+    bmx_bean_prop_add(bean,
+        vhost_count_create("InBytesGET",
+                           timespan->InBytesGET, counter, p));
+    bmx_bean_prop_add(bean,
+        vhost_count_create("InBytesHEAD",
+                           timespan->InBytesHEAD, counter, p));
+    bmx_bean_prop_add(bean,
+        vhost_count_create("InBytesPOST",
+                           timespan->InBytesPOST, counter, p));
+    bmx_bean_prop_add(bean,
+        vhost_count_create("InBytesPUT",
+                           timespan->InBytesPUT, counter, p));
+
+    bmx_bean_prop_add(bean,
+        vhost_count_create("InRequestsGET",
+                           timespan->InRequestsGET, counter, p));
+    bmx_bean_prop_add(bean,
+        vhost_count_create("InRequestsHEAD",
+                           timespan->InRequestsHEAD, counter, p));
+    bmx_bean_prop_add(bean,
+        vhost_count_create("InRequestsPOST",
+                           timespan->InRequestsPOST, counter, p));
+    bmx_bean_prop_add(bean,
+        vhost_count_create("InRequestsPUT",
+                           timespan->InRequestsPUT, counter, p));
+
+    bmx_bean_prop_add(bean,
+        vhost_count_create("OutBytes200",
+                           timespan->OutBytes200, counter, p));
+    bmx_bean_prop_add(bean,
+        vhost_count_create("OutBytes301",
+                           timespan->OutBytes301, counter, p));
+    bmx_bean_prop_add(bean,
+        vhost_count_create("OutBytes302",
+                           timespan->OutBytes302, counter, p));
+    bmx_bean_prop_add(bean,
+        vhost_count_create("OutBytes401",
+                           timespan->OutBytes401, counter, p));
+    bmx_bean_prop_add(bean,
+        vhost_count_create("OutBytes403",
+                           timespan->OutBytes403, counter, p));
+    bmx_bean_prop_add(bean,
+        vhost_count_create("OutBytes404",
+                           timespan->OutBytes404, counter, p));
+    bmx_bean_prop_add(bean,
+        vhost_count_create("OutBytes500",
+                           timespan->OutBytes500, counter, p));
+
+    bmx_bean_prop_add(bean,
+        vhost_count_create("OutResponses200",
+                           timespan->OutResponses200, counter, p));
+    bmx_bean_prop_add(bean,
+        vhost_count_create("OutResponses301",
+                           timespan->OutResponses301, counter, p));
+    bmx_bean_prop_add(bean,
+        vhost_count_create("OutResponses302",
+                           timespan->OutResponses302, counter, p));
+    bmx_bean_prop_add(bean,
+        vhost_count_create("OutResponses401",
+                           timespan->OutResponses401, counter, p));
+    bmx_bean_prop_add(bean,
+        vhost_count_create("OutResponses403",
+                           timespan->OutResponses403, counter, p));
+    bmx_bean_prop_add(bean,
+        vhost_count_create("OutResponses404",
+                           timespan->OutResponses404, counter, p));
+    bmx_bean_prop_add(bean,
+        vhost_count_create("OutResponses500",
+                           timespan->OutResponses500, counter, p));
+
+    bmx_bean_prop_add(bean,
+        vhost_count_create("InLowBytes",
+                           timespan->InLowBytes, counter, p));
+    bmx_bean_prop_add(bean,
+        vhost_count_create("OutLowBytes",
+                           timespan->OutLowBytes, counter, p));
+
+    bmx_bean_prop_add(bean,
+        vhost_count_create("InRequests",
+                           timespan->InRequests, counter, p));
+    bmx_bean_prop_add(bean,
+        vhost_count_create("OutResponses",
+                           timespan->OutResponses, counter, p));
+}
+
+/**
+ * Print the bean of the moving average rates of the given VHost, which
+ * are the same for all its timespans.
+ */
+static void print_rates_bean(request_rec *r, bmx_bean_print print_bean_fn,
+                             const struct bmx_vhost_scfg *scfg)
+{
+    struct bmx_bean bean;
+    struct vhost_rates rates;
+    apr_pool_t *p;
+    int i, w;
+
+    vhost_rates_read(scfg->index, &rates);
+
+    apr_pool_create(&p, r->pool);
+
+    bmx_bean_init(&bean, vhost_objectname(p, BMX_VHOST_RATES_TYPE, scfg));
+    for (i = 0; i < VHOST_RATE_METRICS; i++) {
+        for (w = 0; w < VHOST_RATE_WINDOWS; w++) {
+            bmx_bean_prop_add(&bean,
+                bmx_property_double_create(rate_names[i][w],
+                                           rates.rate[i][w], p));
+        }
+    }
+
+    print_bean_fn(r, &bean);
+    apr_pool_destroy(p);
+}
+
+/**
+ * Print the VHost bean of the given Type to the response.
+ */
+static void print_vhost_bean(request_rec *r,
+                             bmx_bean_print print_bean_fn,
+                             const char *type,
+                             const struct bmx_vhost_scfg *scfg,
+                             struct vhost_timespan *timespan)
+{
+    struct bmx_bean bean;
+    apr_time_t now = apr_time_now();
+    apr_uint64_t durations[N_DURATION_PERCENTILES];
+    struct vhost_status_count statuses[VHOST_STATUS_CODES];
+    apr_uint64_t other = 0;
+    apr_array_header_t *buckets;
+    apr_pool_t *p;
+    int i;
+
+    /* the bean is built in a pool of its own, destroyed once printed, so
+     * the memory of a query does not grow with the number of VHosts */
+    apr_pool_create(&p, r->pool);
+    bmx_bean_init(&bean, vhost_objectname(p, type, scfg));
+
+    vhost_bean_add_counters(&bean, timespan, 1, p);
+
+    bmx_bean_prop_add(&bean,
+        bmx_property_uint64_create("UniqueClients",
+                                   vhost_hll_estimate(timespan->Clients), p));
+
+    bmx_bean_prop_add(&bean,
+        bmx_property_string_create("StartDate",
+                                   ap_ht_time(p, timespan->StartTime,
+                                              DEFAULT_TIME_FORMAT, 0),
+                                   p));
+    bmx_bean_prop_add(&bean,
+        bmx_property_uint64_create("StartTime",
+                                   timespan->StartTime, p));
+    bmx_bean_prop_add(&bean,
+        bmx_property_uint64_create("StartElapsed",
+                                   now - timespan->StartTime, p));
+
+    vhost_duration_percentiles(timespan, duration_permille, durations,
+                               N_DURATION_PERCENTILES);
+    for (i = 0; i < N_DURATION_PERCENTILES; i++) {
+        bmx_bean_prop_add(&bean,
+            bmx_property_uint64_create(duration_names[i], durations[i], p));
+    }
+
+    /* the non-empty buckets as lower bound:count, for merging elsewhere */
+    buckets = apr_array_make(p, 16, sizeof(char *));
+    for (i = 0; i < VHOST_DURATION_BUCKETS; i++) {
+        if (timespan->Duration[i]) {
+            APR_ARRAY_PUSH(buckets, char *) =
+                apr_psprintf(p, "%" APR_UINT64_T_FMT ":%"
+                             APR_UINT64_T_FMT, vhost_duration_lower(i),
+                             timespan->Duration[i]);
+        }
+    }
+    bmx_bean_prop_add(&bean,
+        bmx_property_string_create("DurationBuckets",
+                                   apr_array_pstrcat(p, buckets, ' '), p));
+
+    /* the statuses and methods without a property of their own above */
+    vhost_statuses_sort(timespan, statuses);
+    for (i = 0; i < VHOST_STATUS_CODES; i++) {
+        if (statuses[i].count
+            && !vhost_status_reported((int)statuses[i].status)) {
+            bmx_bean_prop_add(&bean,
+                bmx_property_counter_create(
+                    apr_psprintf(p, "OutResponses%u", statuses[i].status),
+                    statuses[i].count, p));
+        }
+    }
+    if (timespan->StatusesOther) {
+        bmx_bean_prop_add(&bean,
+            bmx_property_counter_create("OutResponsesOther",
+                                        timespan->StatusesOther, p));
+    }
+    for (i = 0; i < VHOST_METHODS; i++) {
+        const char *method;
+
+        if (!timespan->Methods[i] || i == M_GET || i == M_POST || i == M_PUT) {
+            continue;
+        }
+        method = i != M_INVALID ? ap_method_name_of(p, i) : NULL;
+        if (method) {
+            bmx_bean_prop_add(&bean,
+                bmx_property_counter_create(apr_pstrcat(p, "InRequests",
+                                                        method, NULL),
+                                            timespan->Methods[i], p));
+        } else {
+            other += timespan->Methods[i];
+        }
+    }
+    if (other) {
+        bmx_bean_prop_add(&bean,
+            bmx_property_counter_create("InRequestsOther", other, p));
+    }
+
+    print_bean_fn(r, &bean);
+    apr_pool_destroy(p);
+}
+
+/* --------------------------------------------------------------------
+ * Hook processing
+ * -------------------------------------------------------------------- */
+
+/**
+ * Print the bean reporting the queues of BMXVHostAsyncQueue, summed over
+ * all children.
+ */
+static void print_queue_bean(request_rec *r, bmx_bean_print print_bean_fn)
+{
+    struct bmx_bean bean;
+    apr_uint64_t depth = 0, drops = 0, drained = 0;
+    int i;
+
+    for (i = 0; i < vhost_server_limit; i++) {
+        depth += vhost_queue_stats[i].depth;
+        drops += vhost_queue_stats[i].drops;
+        drained += vhost_queue_stats[i].drained;
+    }
+
+    bmx_bean_init(&bean, queue_objectname);
+
+    bmx_bean_prop_add(&bean,
+        bmx_property_int32_create("Capacity", queue_size, r->pool));
+    bmx_bean_prop_add(&bean,
+        bmx_property_uint64_create("Depth", depth, r->pool));
+    bmx_bean_prop_add(&bean,
+        bmx_property_counter_create("Drops", drops, r->pool));
+    bmx_bean_prop_add(&bean,
+        bmx_property_counter_create("Drained", drained, r->pool));
+
+    print_bean_fn(r, &bean);
+}
+
+/**
+ * Print the beans reporting the lock of each shard of the store, as
+ * mod_bmx_vhost:Type=store-lock,Shard=N, for those the query applies to.
+ */
+static int print_lock_beans(request_rec *r,
+                            const struct bmx_objectname *query,
+                            bmx_bean_print print_bean_fn)
+{
+    struct bmx_objectname *objectname;
+    struct vhost_lock_stats copy;
+    struct bmx_bean bean;
+    int rv = DECLINED;
+    int i;
+
+    for (i = 0; i < vhost_nlocks; i++) {
+        bmx_objectname_create(&objectname, BMX_VHOST_DOMAIN, r->pool);
+        apr_table_set(objectname->props, "Type", BMX_VHOST_LOCK_TYPE);
+        apr_table_set(objectname->props, "Shard", apr_itoa(r->pool, i));
+        if (!bmx_check_constraints(query, objectname)) {
+            continue;
+        }
+
+        /* updated under the lock, a torn read only skews one query */
+        copy = vhost_lock_stats[i];
+
+        bmx_bean_init(&bean, objectname);
+        bmx_bean_prop_add(&bean,
+            bmx_property_counter_create("Acquisitions", copy.acquired,
+                                        r->pool));
+        bmx_bean_prop_add(&bean,
+            bmx_property_counter_create("WaitTime", copy.wait_time, r->pool));
+        bmx_bean_prop_add(&bean,
+            bmx_property_uint64_create("MaxWaitTime", copy.max_wait,
+                                       r->pool));
+        print_bean_fn(r, &bean);
+        rv = OK;
+    }
+    return rv;
+}
+
+static const char *const top_names[__N_TOP_ORDERS] = {
+    "TopRequests",
+    "TopOutBytes",
+    "TopDuration"
+};
+
+/**
+ * Fetch the count of the given top paths entry by which they are ordered,
+ * which includes the error inherited in that order.
+ */
+static apr_uint64_t vhost_top_count(const struct vhost_top_entry *entry,
+                                    enum vhost_top_order order)
+{
+    switch (order) {
+    case TOP_BYTES:
+        return entry->bytes;
+    case TOP_DURATION:
+        return entry->duration;
+    default:
+        return entry->requests;
+    }
+}
+
+/**
+ * Print the top paths bean of the given VHost, with the top_report paths of
+ * the most requests, bytes written and time taken, and the error of each.
+ * Each entry is copied without a lock, and skipped if it was being taken
+ * over meanwhile.
+ */
+static void print_top_bean(request_rec *r, bmx_bean_print print_bean_fn,
+                           const struct bmx_vhost_scfg *scfg)
+{
+    struct vhost_top_bucket *buckets = vhost_top
+                                     + (apr_size_t)scfg->index * top_buckets;
+    struct vhost_top_entry *entries, **top;
+    struct bmx_bean bean;
+    apr_pool_t *p;
+    apr_uint32_t b;
+    int n = 0, ntop, i, j, order;
+
+    apr_pool_create(&p, r->pool);
+    entries = apr_palloc(p, (apr_size_t)top_buckets * VHOST_TOP_WAYS
+                            * sizeof(*entries));
+    top = apr_palloc(p, (apr_size_t)top_report * sizeof(*top));
+    for (b = 0; b < top_buckets; b++) {
+        for (i = 0; i < VHOST_TOP_WAYS; i++) {
+            struct vhost_top_entry *entry = &buckets[b].entry[i];
+            apr_uint64_t hash = entry->hash;
+
+            vhost_barrier();
+            memcpy(&entries[n], entry, sizeof(*entry));
+            vhost_barrier();
+            if (hash && entry->hash == hash) {
+                entries[n].path[VHOST_TOP_PATH_LEN - 1] = '\0';
+                n++;
+            }
+        }
+    }
+
+    bmx_bean_init(&bean, vhost_objectname(p, BMX_VHOST_TOP_TYPE, scfg));
+
+    for (order = 0; order < __N_TOP_ORDERS; order++) {
+        /* keep the largest so far in descending order */
+        ntop = 0;
+        for (i = 0; i < n; i++) {
+            apr_uint64_t count = vhost_top_count(&entries[i], order);
+
+            for (j = ntop; j > 0 && vhost_top_count(top[j - 1], order) < count;
+                 j--) {
+                if (j < top_report) {
+                    top[j] = top[j - 1];
+                }
+            }
+            if (j < top_report) {
+                top[j] = &entries[i];
+                if (ntop < top_report) {
+                    ntop++;
+                }
+            }
+        }
+
+        for (i = 0; i < ntop; i++) {
+            bmx_bean_prop_add(&bean,
+                bmx_property_string_create(
+                    apr_psprintf(p, "%sPath%d", top_names[order], i + 1),
+                    top[i]->path, p));
+            bmx_bean_prop_add(&bean,
+                bmx_property_uint64_create(
+                    apr_psprintf(p, "%s%d", top_names[order], i + 1),
+                    vhost_top_count(top[i], order), p));
+            bmx_bean_prop_add(&bean,
+                bmx_property_uint64_create(
+                    apr_psprintf(p, "%sError%d", top_names[order], i + 1),
+                    top[i]->error[order], p));
+        }
+    }
+
+    print_bean_fn(r, &bean);
+    apr_pool_destroy(p);
+}
+
+/**
+ * Print the bean of the given entry of the table of Hosts if the query
+ * applies to it. The entry is copied without a lock, and skipped if it was
+ * being taken over meanwhile.
+ */
+static int print_host_bean(request_rec *r, const struct bmx_objectname *query,
+                           bmx_bean_print print_bean_fn,
+                           const struct vhost_host_entry *entry, int other)
+{
+    struct vhost_host_entry copy;
+    struct bmx_vhost_scfg scfg;
+    struct bmx_bean bean;
+    apr_uint32_t tag = entry->tag;
+    apr_pool_t *p;
+
+    if (!other && (!tag || (tag & VHOST_HOST_PENDING))) {
+        return DECLINED;
+    }
+    vhost_barrier();
+    memcpy(&copy, entry, sizeof(copy));
+    vhost_barrier();
+    if (entry->tag != tag) {
+        return DECLINED;
+    }
+    copy.host[VHOST_HOST_LEN - 1] = '\0';
+
+    /* the Host is matched as that of a VHost of any port */
+    memset(&scfg, 0, sizeof(scfg));
+    scfg.host = copy.host;
+    if (!vhost_query_match(query, BMX_VHOST_HOST_TYPE, &scfg)) {
+        return DECLINED;
+    }
+    apr_pool_create(&p, r->pool);
+    scfg.host = apr_pstrdup(p, copy.host);
+
+    bmx_bean_init(&bean, vhost_objectname(p, BMX_VHOST_HOST_TYPE, &scfg));
+    bmx_bean_prop_add(&bean,
+        bmx_property_counter_create("InRequests", copy.requests, p));
+    bmx_bean_prop_add(&bean,
+        bmx_property_counter_create("InLowBytes", copy.in_bytes, p));
+    bmx_bean_prop_add(&bean,
+        bmx_property_counter_create("OutLowBytes", copy.out_bytes, p));
+    bmx_bean_prop_add(&bean,
+        bmx_property_counter_create("OutResponses4xx", copy.client_errors, p));
+    bmx_bean_prop_add(&bean,
+        bmx_property_counter_create("OutResponses5xx", copy.server_errors, p));
+    bmx_bean_prop_add(&bean,
+        bmx_property_counter_create("DurationTotal", copy.duration, p));
+    if (other) {
+        bmx_bean_prop_add(&bean,
+            bmx_property_counter_create("Evictions", copy.evictions, p));
+    }
+    bmx_bean_prop_add(&bean,
+        bmx_property_uint64_create("StartTime", copy.start_time, p));
+    bmx_bean_prop_add(&bean,
+        bmx_property_uint64_create("StartElapsed",
+                                   r->request_time - copy.start_time, p));
+
+    print_bean_fn(r, &bean);
+    apr_pool_destroy(p);
+    return OK;
+}
+
+/**
+ * Print the beans of the table of Hosts the query applies to. For a query
+ * of a given Host only the entries where it may be found are looked at.
+ */
+static int print_host_beans(request_rec *r,
+                            const struct bmx_objectname *query,
+                            bmx_bean_print print_bean_fn, const char *host)
+{
+    apr_uint32_t first = 0, n = host_mask + 1, i;
+    int rv = DECLINED;
+
+    if (host) {
+        first = (apr_uint32_t)vhost_hash(host) & host_mask;
+        n = VHOST_HOST_PROBE;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (print_host_bean(r, query, print_bean_fn,
+                            &vhost_hosts[(first + i) & host_mask], 0) == OK) {
+            rv = OK;
+        }
+    }
+    if (print_host_bean(r, query, print_bean_fn, &vhost_hosts[host_mask + 1],
+                        1) == OK) {
+        rv = OK;
+    }
+    return rv;
+}
+
+/**
+ * Find the value of the given argument following the query, as in
+ * ?query=mod_bmx_vhost:Type=series&from=..., or NULL if not given.
+ * The value runs up to the next '&'.
+ */
+static const char *vhost_query_arg(request_rec *r, const char *name)
+{
+    apr_size_t len = strlen(name);
+    const char *arg = r->args;
+
+    while (arg) {
+        if (!strncmp(arg, name, len) && arg[len] == '=') {
+            return arg + len + 1;
+        }
+        arg = strchr(arg, '&');
+        if (arg) {
+            arg++;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Parse the from or to argument of a series query, in seconds since the
+ * epoch or, if negative, in seconds before the given time.
+ */
+static apr_time_t vhost_query_time(request_rec *r, const char *name,
+                                   apr_time_t now, apr_time_t dflt)
+{
+    const char *arg = vhost_query_arg(r, name);
+    apr_int64_t sec;
+
+    if (!arg || !*arg || *arg == '&') {
+        return dflt;
+    }
+    sec = apr_atoi64(arg);
+    return sec < 0 ? now + apr_time_from_sec(sec) : apr_time_from_sec(sec);
+}
+
+/**
+ * Whether the query asks for the points of the series by their Type. These
+ * are never reported for a wildcard query, lest every scrape return all
+ * the points of every VHost.
+ */
+static int vhost_query_series(const struct bmx_objectname *query)
+{
+    const char *type;
+
+    if (!vhost_series || query == BMX_QUERY_ALL || !query->props) {
+        return 0;
+    }
+    type = apr_table_get(query->props, "Type");
+    return type && !strcmp(type, BMX_VHOST_SERIES_TYPE);
+}
+
+/**
+ * Print one bean for each point of the series of the given VHost taken
+ * between the from and to arguments of the request, with the counts since
+ * the point before. The points are copied before the number of points
+ * taken is read again, and those the ticker may have been overwriting
+ * meanwhile are dropped, so no lock is taken.
+ */
+static void print_series_beans(request_rec *r, bmx_bean_print print_bean_fn,
+                               const struct bmx_vhost_scfg *scfg)
+{
+    const apr_uint32_t npoints = (apr_uint32_t)series_points;
+    apr_time_t from, to, *times;
+    apr_uint32_t taken, oldest, first, last, n, i;
+    char *points;
+    apr_pool_t *p;
+
+    from = vhost_query_time(r, "from", r->request_time, 0);
+    to = vhost_query_time(r, "to", r->request_time, r->request_time);
+
+    /* the oldest point which is not being overwritten by the next one */
+    taken = apr_atomic_read32(&vhost_series->taken);
+    vhost_barrier();
+    oldest = taken > npoints ? taken - npoints + 1 : 0;
+
+    /* each point reported needs the one before it */
+    for (first = oldest + 1; first < taken; first++) {
+        if (vhost_series_times[first % npoints] >= from) {
+            break;
+        }
+    }
+    for (last = first; last < taken; last++) {
+        if (vhost_series_times[last % npoints] > to) {
+            break;
+        }
+    }
+    if (first >= last) {
+        return;
+    }
+
+    n = last - first + 1;
+    times = apr_palloc(r->pool, n * sizeof(*times));
+    points = apr_palloc(r->pool, (apr_size_t)n * VHOST_LIVE_SIZE);
+    for (i = 0; i < n; i++) {
+        times[i] = vhost_series_times[(first - 1 + i) % npoints];
+        memcpy(points + (apr_size_t)i * VHOST_LIVE_SIZE,
+               vhost_series_point(scfg->index, first - 1 + i),
+               VHOST_LIVE_SIZE);
+    }
+
+    /* drop the points overwritten while they were copied */
+    vhost_barrier();
+    taken = apr_atomic_read32(&vhost_series->taken);
+    oldest = taken > npoints ? taken - npoints + 1 : 0;
+    i = first - 1 < oldest ? oldest - (first - 1) : 0;
+
+    apr_pool_create(&p, r->pool);
+    for (i++; i < n; i++) {
+        struct vhost_timespan *point, *prev;
+        struct bmx_objectname *objectname;
+        struct bmx_bean bean;
+
+        prev = (struct vhost_timespan *)(points
+                                         + (apr_size_t)(i - 1) * VHOST_LIVE_SIZE);
+        point = (struct vhost_timespan *)(points
+                                          + (apr_size_t)i * VHOST_LIVE_SIZE);
+        vhost_timespan_sub(point, prev);
+
+        /* the same objectname, told apart by the time of the point */
+        objectname = vhost_objectname(p, BMX_VHOST_SERIES_TYPE, scfg);
+        apr_table_setn(objectname->props, "Time",
+                      apr_psprintf(p, "%" APR_TIME_T_FMT,
+                                   apr_time_sec(times[i])));
+
+        bmx_bean_init(&bean, objectname);
+        bmx_bean_prop_add(&bean,
+            bmx_property_uint64_create("StartTime", times[i - 1], p));
+        bmx_bean_prop_add(&bean,
+            bmx_property_uint64_create("EndTime", times[i], p));
+        vhost_bean_add_counters(&bean, point, 0, p);
+
+        print_bean_fn(r, &bean);
+        apr_pool_clear(p);
+    }
+    apr_pool_destroy(p);
+}
+
+/**
+ * Print the bean of a window of the given VHost, with the counts and the
+ * unique clients of the window between the given start and end, or so far
+ * if it has none.
+ */
+static void print_window_bean(request_rec *r, bmx_bean_print print_bean_fn,
+                              const char *type,
+                              const struct bmx_vhost_scfg *scfg,
+                              const struct vhost_timespan *counts,
+                              const apr_byte_t *clients,
+                              apr_time_t start, apr_time_t end)
+{
+    struct bmx_bean bean;
+    apr_pool_t *p;
+
+    apr_pool_create(&p, r->pool);
+    bmx_bean_init(&bean, vhost_objectname(p, type, scfg));
+    bmx_bean_prop_add(&bean,
+        bmx_property_uint64_create("StartTime", start, p));
+    if (end) {
+        bmx_bean_prop_add(&bean,
+            bmx_property_uint64_create("EndTime", end, p));
+    }
+    vhost_bean_add_counters(&bean, counts, 0, p);
+    bmx_bean_prop_add(&bean,
+        bmx_property_uint64_create("UniqueClients",
+                                   vhost_hll_estimate(clients), p));
+
+    print_bean_fn(r, &bean);
+    apr_pool_destroy(p);
+}
+
+/**
+ * Fetch the unique clients registers of the given VHost in the given
+ * buffer of the windows of the given kind, merged over all VHosts into
+ * regs for the global one.
+ */
+static const apr_byte_t *vhost_window_clients_read(int w, int buffer,
+                                                   int index,
+                                                   apr_byte_t *regs)
+{
+    if (index < vhost_nrecords - 1) {
+        return vhost_window_clients(w, buffer, index);
+    }
+    memset(regs, 0, VHOST_HLL_REGISTERS);
+    for (index = 0; index < vhost_nrecords - 1; index++) {
+        vhost_hll_merge(regs, vhost_window_clients(w, buffer, index));
+    }
+    return regs;
+}
+
+/**
+ * Print the beans of the current and previous windows kept of the given
+ * VHost the query applies to, given its live counters if already summed
+ * up. The previous window is left out until one has ended.
+ */
+static int print_window_beans(request_rec *r,
+                              const struct bmx_objectname *query,
+                              bmx_bean_print print_bean_fn,
+                              const struct bmx_vhost_scfg *scfg,
+                              const struct vhost_timespan *live)
+{
+    struct vhost_timespan sum, marks[2], counts;
+    apr_byte_t *regs = NULL;
+    apr_time_t start[2];
+    int rv = DECLINED;
+    int w, current, previous, buffer;
+
+    for (w = 0; w < __N_VHOST_WINDOWS; w++) {
+        if (!(vhost_timespans & VHOST_KEEP_WINDOW(w))) {
+            continue;
+        }
+        current = vhost_query_match(query, window_names[w][0], scfg);
+        previous = vhost_query_match(query, window_names[w][1], scfg);
+        if (!current && !previous) {
+            continue;
+        }
+
+        buffer = vhost_window_read(w, scfg->index, marks, start);
+        if (!regs && scfg->index == vhost_nrecords - 1) {
+            regs = apr_palloc(r->pool, VHOST_HLL_REGISTERS);
+        }
+
+        if (current) {
+            if (!live) {
+                vhost_live_snapshot(scfg->index, NULL, &sum);
+                live = &sum;
+            }
+            memcpy(&counts, live, VHOST_LIVE_SIZE);
+            vhost_timespan_sub(&counts, &marks[0]);
+            print_window_bean(r, print_bean_fn, window_names[w][0], scfg,
+                              &counts,
+                              vhost_window_clients_read(w, buffer,
+                                                        scfg->index, regs),
+                              start[0], 0);
+            rv = OK;
+        }
+        if (previous && start[1]) {
+            memcpy(&counts, &marks[0], VHOST_LIVE_SIZE);
+            vhost_timespan_sub(&counts, &marks[1]);
+            print_window_bean(r, print_bean_fn, window_names[w][1], scfg,
+                              &counts,
+                              vhost_window_clients_read(w, !buffer,
+                                                        scfg->index, regs),
+                              start[1], start[0]);
+            rv = OK;
+        }
+    }
+    return rv;
+}
+
+/**
+ * Process an BMX Query by checking if the Query applies to our timespan
+ * beans and then by adding up the live counters from shared memory, from
+ * the given index of the entries of the worker slots if any, and returning
+ * them to the requesting client. No lock is taken, so a query never holds
+ * up the workers recording their hits.
+ */
+static int process_vhost_query(request_rec *r,
+                               const struct bmx_objectname *query,
+                               bmx_bean_print print_bean_fn,
+                               struct bmx_vhost_scfg *scfg,
+                               const struct vhost_live_index *where)
+{
+    int rv = DECLINED;
+    int forever = 0, since_start = 0, since_restart = 0;
+    struct vhost_timespan live;
+    const struct vhost_timespan *have_live = NULL;
+
+    forever = (vhost_timespans & VHOST_KEEP(FOREVER))
+              && vhost_query_match(query, vhost_type_names[FOREVER], scfg);
+    since_start = (vhost_timespans & VHOST_KEEP(SINCE_START))
+                  && vhost_query_match(query, vhost_type_names[SINCE_START],
+                                       scfg);
+    since_restart = (vhost_timespans & VHOST_KEEP(SINCE_RESTART))
+                    && vhost_query_match(query,
+                                         vhost_type_names[SINCE_RESTART],
+                                         scfg);
+
+    if (forever || since_start || since_restart) {
+        struct vhost_data vhost_data;
+
+        vhost_live_snapshot(scfg->index, where, &live);
+        have_live = &live;
+        vhost_data_snapshot(scfg, &live, &vhost_data);
+
+        if (forever) {
+            print_vhost_bean(r, print_bean_fn, vhost_type_names[FOREVER],
+                             scfg, &vhost_data.forever);
+            rv = OK;
+        }
+
+        if (since_start) {
+            print_vhost_bean(r, print_bean_fn, vhost_type_names[SINCE_START],
+                             scfg, &vhost_data.since_start);
+            rv = OK;
+        }
+
+        if (since_restart) {
+            print_vhost_bean(r, print_bean_fn, vhost_type_names[SINCE_RESTART],
+                             scfg, &vhost_data.since_restart);
+            rv = OK;
+        }
+    }
+
+    if (vhost_query_match(query, BMX_VHOST_RATES_TYPE, scfg)) {
+        print_rates_bean(r, print_bean_fn, scfg);
+        rv = OK;
+    }
+
+    if (vhost_windows
+        && print_window_beans(r, query, print_bean_fn, scfg,
+                              have_live) == OK) {
+        rv = OK;
+    }
+
+    if (vhost_query_series(query)
+        && vhost_query_match(query, BMX_VHOST_SERIES_TYPE, scfg)) {
+        print_series_beans(r, print_bean_fn, scfg);
+        rv = OK;
+    }
+
+    /* the global record tracks no paths of its own */
+    if (vhost_top && scfg != global_scfg
+        && vhost_query_match(query, BMX_VHOST_TOP_TYPE, scfg)) {
+        print_top_bean(r, print_bean_fn, scfg);
+        rv = OK;
+    }
+
+    return rv;
+}
+
+/**
+ * Print the info bean of the given VHost if the query applies to it,
+ * building it from the server_rec of the VHost. The global VHost has none.
+ */
+static int print_info_bean(request_rec *r, const struct bmx_objectname *query,
+                           bmx_bean_print print_bean_fn,
+                           const struct bmx_vhost_scfg *scfg)
+{
+    struct bmx_bean bean;
+    apr_pool_t *p;
+
+    if (!scfg->server
+        || !vhost_query_match(query, BMX_VHOST_INFO_TYPE, scfg)) {
+        return DECLINED;
+    }
+
+    apr_pool_create(&p, r->pool);
+    create_vhost_info_bean(p, &bean,
+                           vhost_objectname(p, BMX_VHOST_INFO_TYPE, scfg),
+                           scfg->server);
+    print_bean_fn(r, &bean);
+    apr_pool_destroy(p);
+    return OK;
+}
+
+/**
+ * Process an BMX Query by checking if the Query applies to our bean(s)
+ * and then by calling the appropriate bean generation routines.
+ */
+static int bmx_vhost_query_hook(request_rec *r,
+                                const struct bmx_objectname *query,
+                                bmx_bean_print print_bean_fn)
+{
+    int rv, rv2, hosts_rv = DECLINED;
+    server_rec *s;
+    const char *host = NULL;
+    struct vhost_live_index *where;
+
+    /* none of our beans can match a query for another domain */
+    if (query != BMX_QUERY_ALL) {
+        if (strcmp(query->domain, BMX_VHOST_DOMAIN)) {
+            return DECLINED;
+        }
+        if (query->props) {
+            host = apr_table_get(query->props, "Host");
+        }
+    }
+
+    /* update the rates if the parent does not, as on some MPMs, but leave
+     * writing the counters behind to it */
+    if (vhost_ticker && vhost_tick_due(r->request_time - VHOST_RATE_LATE)) {
+        vhost_rates_tick(r->request_time, 0);
+    }
+
+    /* the Hosts seen in requests are tracked apart from the vhosts */
+    if (vhost_hosts) {
+        hosts_rv = print_host_beans(r, query, print_bean_fn, host);
+    }
+
+    /* only look at the vhosts of the given Host, if any */
+    if (host) {
+        apr_array_header_t *scfgs;
+        int i;
+
+        if (!vhost_host_index) {
+            return hosts_rv;
+        }
+        scfgs = apr_hash_get(vhost_host_index, host, APR_HASH_KEY_STRING);
+        if (!scfgs) {
+            return hosts_rv;
+        }
+
+        rv = hosts_rv;
+        for (i = 0; i < scfgs->nelts; i++) {
+            struct bmx_vhost_scfg *scfg
+                = APR_ARRAY_IDX(scfgs, i, struct bmx_vhost_scfg *);
+            rv2 = process_vhost_query(r, query, print_bean_fn, scfg, NULL);
+            if (rv2 == OK) {
+                rv = OK;
+            } else if (rv2 != DECLINED) {
+                /* we hit some error (reported already) */
+                return rv2;
+            }
+
+            if (print_info_bean(r, query, print_bean_fn, scfg) == OK) {
+                rv = OK;
+            }
+        }
+        return rv;
+    }
+
+    /* check the global too */
+    rv = process_vhost_query(r, query, print_bean_fn, global_scfg, NULL);
+    if (rv != OK && rv != DECLINED) {
+        /* we hit some error (reported already) */
+        return rv;
+    }
+    if (hosts_rv == OK) {
+        rv = OK;
+    }
+
+    if (queue_objectname && vhost_queue_stats
+        && bmx_check_constraints(query, queue_objectname)) {
+        print_queue_bean(r, print_bean_fn);
+        rv = OK;
+    }
+    if (vhost_lock_stats
+        && print_lock_beans(r, query, print_bean_fn) == OK) {
+        rv = OK;
+    }
+
+    /* read each entry of the worker slots once for all vhosts */
+    where = vhost_live_index_make(r->pool);
+    vhost_live_index_build(where);
+
+    for (s = main_server; s; s = s->next) {
+        struct bmx_vhost_scfg *scfg = ap_get_module_config(s->module_config,
+                                                           &bmx_vhost_module);
+        /* Print out the mod_bmx_vhost:Type=forever/since-start/since-restart
+           beans for this vhost */
+        rv2 = process_vhost_query(r, query, print_bean_fn, scfg, where);
+        if (rv2 == OK) {
+            rv = OK;
+        } else if (rv2 != DECLINED) {
+            /* we hit some error (reported already) */
+            return rv2;
+        }
+
+        if (print_info_bean(r, query, print_bean_fn, scfg) == OK) {
+            rv = OK;
+        }
+    }
+
+    return rv;
+}
+
+/*
+ *  BMX Virtual Host Extension to mod_status
+ */
+static int bmx_vhost_status_hook(request_rec *r, int flags)
+{
+    if (flags & AP_STATUS_SHORT)
+        return OK;
+
+#ifdef TODO_STATUS_REPORT
+    /* status output, will probably introduce a custom print_bean_fn e.g. */
+        ap_rputs("\n\n<table border=\"0\"><tr>"
+                 "<th>SSes</th><th>Timeout</th><th>Method</th>"
+                 "</tr>\n", r);
+        ap_rprintf(r, "<tr><td>%s</td><td>%s</td></tr>\n", name, value);
+        ap_rputs("</table>\n", r);
+
+    int rv, rv2;
+    server_rec *s;
+
+    ap_rputs("<hr />\n<h1>BMX Virtual Host Tracking Summary</h1>\n", r);
+
+    /* check the global too */
+    rv = process_vhost_query(r, query, print_bean_fn, global_scfg, NULL);
+    if (rv != OK && rv != DECLINED) {
+        /* we hit some error (reported already) */
+        return rv;
+    }
+
+    for (s = main_server; s; s = s->next) {
+        struct bmx_vhost_scfg *scfg = ap_get_module_config(s->module_config,
+                                                           &bmx_vhost_module);
+        /* Print out the mod_bmx_vhost:Type=forever/since-start/since-restart
+           beans for this vhost */
+        rv2 = process_vhost_query(r, query, print_bean_fn, scfg, NULL);
+        if (rv2 == OK) {
+            rv = OK;
+        } else if (rv2 != DECLINED) {
+            /* we hit some error (reported already) */
+            return rv2;
+        }
+
+        if (print_info_bean(r, query, print_bean_fn, scfg) == OK) {
+            rv = OK;
+        }
+
+    }
+#endif
+
+    return OK;
+}
+
+static int bmx_vhost_pre_config(apr_pool_t *pconf, apr_pool_t *plog,
+                                apr_pool_t *ptemp)
+{
+    map_fname = ap_server_root_relative(pconf, MAP_FNAME);
+    dbm_fname = ap_server_root_relative(pconf, DBM_FNAME);
+#ifdef BMX_HAVE_AP_MUTEX
+    /* the Mutex directive places the lock files unless we are told to */
+    dbmlock_fname = NULL;
+    ap_mutex_register(pconf, VHOST_MUTEX_TYPE, NULL, APR_LOCK_DEFAULT, 0);
+#else
+    dbmlock_fname = ap_server_root_relative(pconf, DBMLOCK_FNAME);
+#endif
+    dbm_shards = 1;
+    flush_interval = FLUSH_INTERVAL;
+    flush_requests = FLUSH_REQUESTS;
+    queue_size = 0;
+    queue_objectname = NULL;
+    series_step = 0;
+    series_points = 0;
+    top_entries = 0;
+    top_depth = TOP_DEPTH;
+    top_report = TOP_REPORT;
+    memory_limit = MEMORY_LIMIT;
+    vhost_fields_init();
+    host_entries = 0;
+    vhost_timespans = VHOST_KEEP_DEFAULT;
+    timespans_set = 0;
+    vhost_store = vhost_store_find("map");
+
+    APR_OPTIONAL_HOOK(bmx, query_hook, bmx_vhost_query_hook, NULL, NULL,
+                      APR_HOOK_MIDDLE);
+    APR_OPTIONAL_HOOK(ap, status_hook, bmx_vhost_status_hook, NULL, NULL,
+                      APR_HOOK_MIDDLE);
+    return OK;
+}
+
+/** The key of the windows saved across restarts in the process pool */
+#define WINDOWS_SAVED_KEY "bmx_vhost_windows"
+/** The size of the marks and unique clients saved of each VHost */
+#define WINDOWS_SAVED_SIZE ((apr_size_t)__N_VHOST_WINDOWS * 2 \
+                            * (VHOST_LIVE_SIZE + VHOST_HLL_REGISTERS))
+/** The offset of the unique clients saved of a VHost's buffer of windows */
+#define WINDOWS_SAVED_CLIENTS(w, buffer) \
+    ((apr_size_t)__N_VHOST_WINDOWS * 2 * VHOST_LIVE_SIZE \
+     + (apr_size_t)((w) * 2 + (buffer)) * VHOST_HLL_REGISTERS)
+
+/**
+ * The windows of the generation which just ended, kept in the process pool
+ * of the parent so that they carry over a restart. They are lost when the
+ * server stops.
+ */
+struct vhost_windows_saved {
+    /** Set once the windows of the generation which just ended are saved */
+    int saved;
+    /** The timespans that generation kept, of which only windows are saved */
+    int kept;
+    struct vhost_windows windows;
+    /**
+     * The marks of each VHost by its key, less the live counters of the
+     * generation, so that they apply to the live counters of the next one,
+     * followed by the unique clients of its windows, see WINDOWS_SAVED_SIZE.
+     */
+    apr_hash_t *marks;
+};
+
+static struct vhost_windows_saved *vhost_windows_saved_get(server_rec *s)
+{
+    struct vhost_windows_saved *saved = NULL;
+    apr_pool_t *p = s->process->pool;
+
+    apr_pool_userdata_get((void **)&saved, WINDOWS_SAVED_KEY, p);
+    if (!saved) {
+        saved = apr_pcalloc(p, sizeof(*saved));
+        saved->marks = apr_hash_make(p);
+        apr_pool_userdata_set(saved, WINDOWS_SAVED_KEY, apr_pool_cleanup_null,
+                              p);
+    }
+    return saved;
+}
+
+/**
+ * Save the marks of the windows of the given VHost, less its live
+ * counters, and its unique clients. The buffer of each VHost is allocated
+ * once, and reused by every later restart.
+ */
+static void vhost_window_save(struct vhost_windows_saved *saved,
+                              apr_pool_t *p,
+                              const struct bmx_vhost_scfg *scfg)
+{
+    char buf[VHOST_KEY_LEN];
+    apr_datum_t key;
+    struct vhost_timespan live, *mark;
+    char *marks;
+    int w, buffer;
+
+    vhost_scfg_key(scfg, buf, &key);
+    marks = apr_hash_get(saved->marks, key.dptr, key.dsize);
+    if (!marks) {
+        marks = apr_palloc(p, WINDOWS_SAVED_SIZE);
+        apr_hash_set(saved->marks, apr_pmemdup(p, key.dptr, key.dsize),
+                     key.dsize, marks);
+    }
+
+    vhost_live_snapshot(scfg->index, vhost_index, &live);
+
+    for (w = 0; w < __N_VHOST_WINDOWS; w++) {
+        if (window_pos[w] < 0) {
+            continue;
+        }
+        for (buffer = 0; buffer < 2; buffer++) {
+            mark = (struct vhost_timespan *)
+                   (marks + (apr_size_t)(w * 2 + buffer) * VHOST_LIVE_SIZE);
+            memcpy(mark, vhost_window_mark(w, buffer, scfg->index),
+                   VHOST_LIVE_SIZE);
+            vhost_timespan_sub(mark, &live);
+            if (scfg->index < vhost_nrecords - 1) {
+                memcpy(marks + WINDOWS_SAVED_CLIENTS(w, buffer),
+                       vhost_window_clients(w, buffer, scfg->index),
+                       VHOST_HLL_REGISTERS);
+            }
+        }
+    }
+}
+
+/**
+ * Save the windows of every VHost when this generation ends.
+ */
+static void vhost_windows_save(server_rec *s)
+{
+    struct vhost_windows_saved *saved = vhost_windows_saved_get(s);
+    server_rec *vhost;
+
+    memcpy(&saved->windows, vhost_windows, sizeof(saved->windows));
+    saved->kept = vhost_timespans;
+    vhost_live_index_build(vhost_index);
+    vhost_window_save(saved, s->process->pool, global_scfg);
+    for (vhost = s; vhost; vhost = vhost->next) {
+        vhost_window_save(saved, s->process->pool,
+                          ap_get_module_config(vhost->module_config,
+                                               &bmx_vhost_module));
+    }
+    saved->saved = 1;
+}
+
+/**
+ * Restore the marks of the windows of the given VHost saved by the
+ * generation which just ended, if it had any, of the kinds both keep.
+ */
+static void vhost_window_restore(struct vhost_windows_saved *saved,
+                                 const struct bmx_vhost_scfg *scfg)
+{
+    char buf[VHOST_KEY_LEN];
+    apr_datum_t key;
+    const char *marks;
+    int w, buffer;
+
+    vhost_scfg_key(scfg, buf, &key);
+    marks = apr_hash_get(saved->marks, key.dptr, key.dsize);
+    if (!marks) {
+        return;
+    }
+
+    for (w = 0; w < __N_VHOST_WINDOWS; w++) {
+        if (window_pos[w] < 0 || !(saved->kept & VHOST_KEEP_WINDOW(w))) {
+            continue;
+        }
+        for (buffer = 0; buffer < 2; buffer++) {
+            memcpy(vhost_window_mark(w, buffer, scfg->index),
+                   marks + (apr_size_t)(w * 2 + buffer) * VHOST_LIVE_SIZE,
+                   VHOST_LIVE_SIZE);
+            if (scfg->index < vhost_nrecords - 1) {
+                memcpy(vhost_window_clients(w, buffer, scfg->index),
+                       marks + WINDOWS_SAVED_CLIENTS(w, buffer),
+                       VHOST_HLL_REGISTERS);
+            }
+        }
+    }
+}
+
+/**
+ * Carry the windows of the generation which just ended over to this one,
+ * or else start the current window of each kind kept now, with no window
+ * before it. So does a kind the generation before did not keep.
+ */
+static void vhost_windows_init(server_rec *s, apr_time_t now)
+{
+    struct vhost_windows_saved *saved = vhost_windows_saved_get(s);
+    server_rec *vhost;
+    int w;
+
+    if (saved->saved) {
+        vhost_window_restore(saved, global_scfg);
+        for (vhost = s; vhost; vhost = vhost->next) {
+            vhost_window_restore(saved,
+                                 ap_get_module_config(vhost->module_config,
+                                                      &bmx_vhost_module));
+        }
+    }
+    for (w = 0; w < __N_VHOST_WINDOWS; w++) {
+        if (window_pos[w] < 0) {
+            continue;
+        }
+        if (saved->saved && (saved->kept & VHOST_KEEP_WINDOW(w))) {
+            vhost_windows->seq[w] = saved->windows.seq[w];
+            vhost_windows->start[w][0] = saved->windows.start[w][0];
+            vhost_windows->start[w][1] = saved->windows.start[w][1];
+            vhost_windows->next[w] = saved->windows.next[w];
+        }
+        else {
+            vhost_windows->start[w][0] = now;
+            vhost_windows->next[w] = vhost_window_end(
+                                         vhost_window_start(now, w), w);
+        }
+    }
+
+    /* nothing is carried over again unless this generation saves it */
+    saved->saved = 0;
+}
+
+#define RETIRED_KEY "bmx_vhost_retired"
+
+/**
+ * The shared memory segment of a generation which ended, kept by the
+ * parent while children of that generation may still be finishing their
+ * requests, so that the counters they record after the segment was folded
+ * into the store are added to a later generation once they are all gone.
+ * Only data is kept here, as the module may be loaded anew at a restart.
+ */
+struct vhost_retired {
+    struct vhost_retired *next;
+    /** The pool of the segment, which also holds this */
+    apr_pool_t *pool;
+    int generation;
+    int nrecords;
+    int nslots;
+    apr_size_t slot_size;
+    char *slots;
+    struct vhost_timespan *shared;
+    /** The index of the record of each VHost, by its key */
+    apr_hash_t *indexes;
+    /** The live counters of each record folded into the store */
+    struct vhost_timespan *taken;
+};
+
+/**
+ * The segments retired and not yet added to a later generation, kept in
+ * the process pool of the parent.
+ */
+struct vhost_retired_list {
+    struct vhost_retired *first;
+};
+
+static struct vhost_retired_list *vhost_retired_list_get(server_rec *s)
+{
+    struct vhost_retired_list *list = NULL;
+    apr_pool_t *p = s->process->pool;
+
+    apr_pool_userdata_get((void **)&list, RETIRED_KEY, p);
+    if (!list) {
+        list = apr_pcalloc(p, sizeof(*list));
+        apr_pool_userdata_set(list, RETIRED_KEY, apr_pool_cleanup_null, p);
+    }
+    return list;
+}
+
+/**
+ * Retire the shared memory segment of this generation, which from then on
+ * belongs to the list of retired segments rather than to this
+ * configuration.
+ */
+static struct vhost_retired *vhost_shm_retire(server_rec *s)
+{
+    struct vhost_retired_list *list = vhost_retired_list_get(s);
+    struct vhost_retired *retired;
+    struct bmx_vhost_scfg *scfg;
+    apr_pool_t *p = vhost_shm_pool;
+    server_rec *vhost;
+    char buf[VHOST_KEY_LEN];
+    apr_datum_t key;
+
+    retired = apr_pcalloc(p, sizeof(*retired));
+    retired->pool = p;
+    retired->generation = vhost_generation;
+    retired->nrecords = vhost_nrecords;
+    retired->nslots = vhost_nslots;
+    retired->slot_size = vhost_slot_size;
+    retired->slots = vhost_slots;
+    retired->shared = vhost_shared;
+    retired->indexes = apr_hash_make(p);
+    retired->taken = apr_pcalloc(p, (apr_size_t)vhost_nrecords
+                                    * sizeof(struct vhost_timespan));
+    for (vhost = s; vhost; vhost = vhost->next) {
+        scfg = ap_get_module_config(vhost->module_config, &bmx_vhost_module);
+        vhost_scfg_key(scfg, buf, &key);
+        apr_hash_set(retired->indexes, apr_pmemdup(p, key.dptr, key.dsize),
+                     key.dsize, apr_pmemdup(p, &scfg->index, sizeof(int)));
+    }
+
+    retired->next = list->first;
+    list->first = retired;
+    vhost_shm_pool = NULL;
+    return retired;
+}
+
+/**
+ * Whether a child of the given retired generation is still running.
+ */
+static int vhost_retired_busy(const struct vhost_retired *retired)
+{
+    int i;
+
+    if (!ap_scoreboard_image) {
+        return 0;
+    }
+    for (i = 0; i < vhost_server_limit; i++) {
+        if (ap_scoreboard_image->parent[i].pid
+            && ap_scoreboard_image->parent[i].generation
+                   == retired->generation) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Find what was counted in the given record of a retired generation since
+ * it was folded into the store, now that no child writes to it. Counts of
+ * the histograms which went back are left out, as are the unique clients
+ * registers which did not rise.
+ */
+static void vhost_retired_late(const struct vhost_retired *retired,
+                               int index, struct vhost_timespan *late)
+{
+    const struct vhost_timespan *taken = &retired->taken[index];
+    const struct vhost_timespan *entry_ts;
+    const struct vhost_slot_head *head;
+    struct vhost_status_count statuses[VHOST_STATUS_CODES];
+    apr_uint32_t vhost = (apr_uint32_t)index + 1;
+    apr_uint64_t before;
+    int slot, entry, i;
+
+    memcpy(late, &retired->shared[index], sizeof(*late));
+    for (slot = 0; slot < retired->nslots; slot++) {
+        head = (const struct vhost_slot_head *)
+               (retired->slots + (apr_size_t)slot * retired->slot_size);
+        for (entry = 0; entry < VHOST_SLOT_ENTRIES; entry++) {
+            if (head->vhost[entry] != vhost) {
+                continue;
+            }
+            entry_ts = (const struct vhost_timespan *)
+                       ((const char *)head + VHOST_SLOT_HEAD
+                        + (apr_size_t)entry * VHOST_ENTRY_SIZE);
+            vhost_timespan_add(late, entry_ts);
+            vhost_details_add(late, vhost_slot_details(entry_ts), 0);
+        }
+    }
+    vhost_timespan_sub(late, taken);
+
+    for (i = 0; i < VHOST_DURATION_BUCKETS; i++) {
+        late->Duration[i] = late->Duration[i] > taken->Duration[i]
+                          ? late->Duration[i] - taken->Duration[i] : 0;
+    }
+    memcpy(statuses, late->Statuses, sizeof(statuses));
+    memset(late->Statuses, 0, sizeof(late->Statuses));
+    for (i = 0; i < VHOST_STATUS_CODES; i++) {
+        before = vhost_status_get(taken, statuses[i].status);
+        if (statuses[i].count > before) {
+            vhost_status_add(late, (int)statuses[i].status,
+                             statuses[i].count - before, 0);
+        }
+    }
+    late->StatusesOther = late->StatusesOther > taken->StatusesOther
+                        ? late->StatusesOther - taken->StatusesOther : 0;
+    for (i = 0; i <= VHOST_METHODS; i++) {
+        late->Methods[i] = late->Methods[i] > taken->Methods[i]
+                         ? late->Methods[i] - taken->Methods[i] : 0;
+    }
+    for (i = 0; i < VHOST_HLL_REGISTERS; i++) {
+        if (late->Clients[i] <= taken->Clients[i]) {
+            late->Clients[i] = 0;
+        }
+    }
+}
+
+/**
+ * Add late counts of a retired generation to the shared record of the
+ * given VHost, with atomic operations as the workers are recording theirs.
+ */
+static void vhost_retired_add(int index, const struct vhost_timespan *late)
+{
+    struct vhost_timespan *ts = &vhost_shared[index];
+    int i;
+
+    vhost_shared_fold(index, late, NULL);
+    for (i = 0; i < VHOST_DURATION_BUCKETS; i++) {
+        VHOST_FOLD(ts, late, Duration[i]);
+    }
+    for (i = 0; i < VHOST_STATUS_CODES; i++) {
+        vhost_status_add(ts, (int)late->Statuses[i].status,
+                         late->Statuses[i].count, 1);
+    }
+    VHOST_FOLD(ts, late, StatusesOther);
+    for (i = 0; i <= VHOST_METHODS; i++) {
+        VHOST_FOLD(ts, late, Methods[i]);
+    }
+    for (i = 0; i < VHOST_HLL_REGISTERS; i++) {
+        vhost_hll_raise(&ts->Clients[i], late->Clients[i]);
+    }
+}
+
+/**
+ * Add what the children of each retired generation counted since it was
+ * folded into the store to the VHosts of this generation of the same key,
+ * once the last of those children has exited, and let go of its segment.
+ * The counts are then written behind with those of this generation.
+ */
+static void vhost_retired_fold(server_rec *s)
+{
+    struct vhost_retired_list *list = vhost_retired_list_get(s);
+    struct vhost_retired **at = &list->first, *retired;
+    struct vhost_timespan late;
+    struct bmx_vhost_scfg *scfg;
+    server_rec *vhost;
+    char buf[VHOST_KEY_LEN];
+    apr_datum_t key;
+    int *index;
+
+    while ((retired = *at) != NULL) {
+        if (vhost_retired_busy(retired)) {
+            at = &retired->next;
+            continue;
+        }
+        *at = retired->next;
+
+        for (vhost = s; vhost; vhost = vhost->next) {
+            scfg = ap_get_module_config(vhost->module_config,
+                                        &bmx_vhost_module);
+            vhost_scfg_key(scfg, buf, &key);
+            index = apr_hash_get(retired->indexes, key.dptr, key.dsize);
+            if (!index) {
+                continue;
+            }
+            /* a VHost configured twice only gets them once */
+            apr_hash_set(retired->indexes, key.dptr, key.dsize, NULL);
+            vhost_retired_late(retired, *index, &late);
+            vhost_retired_add(scfg->index, &late);
+        }
+        apr_pool_destroy(retired->pool);
+    }
+}
+
+/**
+ * Fold the live counters of this generation into the store, so the
+ * 'forever' and 'since-start' tallies carry over to the next generation,
+ * and retire its shared memory segment until its last child has exited.
+ * This is registered as a cleanup of the configuration pool, so it runs in
+ * the parent whenever the server is restarted or stopped.
+ */
+static apr_status_t vhost_shm_fold(void *data)
+{
+    server_rec *s = data;
+    struct vhost_retired *retired = vhost_shm_retire(s);
+
+    (void)vhost_data_fold_all(s, NULL, retired->taken,
+                              "saving mod_bmx_vhost records");
+
+    if (vhost_windows) {
+        vhost_windows_save(s);
+    }
+    return APR_SUCCESS;
+}
+
+/**
+ * Write the counters behind into the store, taking the lock of each shard
+ * once for all its records. This is up to the process updating the rates,
+ * normally the parent from its monitor hook, so that no request waits for
+ * it, and the counters of a child which exits are still in shared memory.
+ * A child of an earlier generation no longer writes, since the parent
+ * already folded its counters into the store when the server was
+ * restarted, and adds those it records since once it has exited, see
+ * vhost_retired_fold().
+ */
+static void vhost_write_behind(void)
+{
+    if (child_started
+        && (vhost_locks_lost || !ap_scoreboard_image
+            || ap_scoreboard_image->global->running_generation
+                   != child_generation)) {
+        return;
+    }
+
+    (void)vhost_data_fold_all(main_server, vhost_flushed, NULL,
+                              "writing mod_bmx_vhost records");
+}
+
+/**
+ * The shard of the store holding the record of the given VHost, found from
+ * its record key so that it stays the same across restarts.
+ */
+static int vhost_scfg_shard(const struct bmx_vhost_scfg *scfg)
+{
+    char buf[VHOST_KEY_LEN];
+    apr_datum_t key;
+
+    if (vhost_nlocks <= 1) {
+        return 0;
+    }
+    vhost_scfg_key(scfg, buf, &key);
+    return (int)(vhost_hash(key.dptr) % vhost_nlocks);
+}
+
+/**
+ * Forget the locks of a generation once its configuration pool, which
+ * destroys them, is cleared.
+ */
+static apr_status_t vhost_locks_cleanup(void *data)
+{
+    vhost_locks = NULL;
+    vhost_lock_fnames = NULL;
+    return APR_SUCCESS;
+}
+
+/**
+ * Create the global mutex of each shard of the store, for the generation
+ * of the given configuration pool. With ap_mutex, the Mutex directive
+ * chooses the mechanism and the directory of the lock files, each shard
+ * being an instance of the bmx-vhost mutex type, unless
+ * BMXVHostLockFilename names the lock file.
+ */
+static apr_status_t vhost_locks_create(apr_pool_t *p, server_rec *s)
+{
+    const char *fname;
+    apr_status_t rv;
+    int i;
+
+    vhost_locks = apr_pcalloc(p, vhost_nlocks * sizeof(*vhost_locks));
+    vhost_lock_fnames = apr_pcalloc(p, vhost_nlocks
+                                       * sizeof(*vhost_lock_fnames));
+    /* run after the cleanups of the mutexes, registered later */
+    apr_pool_cleanup_register(p, NULL, vhost_locks_cleanup,
+                              apr_pool_cleanup_null);
+
+    for (i = 0; i < vhost_nlocks; i++) {
+        fname = dbmlock_fname;
+        if (fname && vhost_nlocks > 1) {
+            fname = apr_psprintf(p, "%s.%d", dbmlock_fname, i);
+        }
+
+#ifdef BMX_HAVE_AP_MUTEX
+        if (!fname) {
+            rv = ap_global_mutex_create(&vhost_locks[i], NULL,
+                                        VHOST_MUTEX_TYPE,
+                                        vhost_nlocks > 1 ? apr_itoa(p, i)
+                                                         : NULL,
+                                        s, p, 0);
+            if (rv != APR_SUCCESS) {
+                ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, "Failed to "
+                             "create mod_bmx_vhost global mutex for DBM");
+                return rv;
+            }
+            vhost_lock_fnames[i] = apr_global_mutex_lockfile(vhost_locks[i]);
+            continue;
         }
+#endif
 
-        /* open the DBM */
-        rv = apr_dbm_open(&dbm, dbm_fname, APR_DBM_READONLY,
-                          APR_OS_DEFAULT, r->pool);
+        rv = apr_global_mutex_create(&vhost_locks[i], fname, APR_LOCK_DEFAULT,
+                                     p);
         if (rv != APR_SUCCESS) {
-            ap_log_rerror(APLOG_MARK, APLOG_CRIT, rv, r, "DBM failure while "
-                          "processing BMX query");
-            goto unlock_error;
+            ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, "Failed to create "
+                         "mod_bmx_vhost global mutex for DBM in file '%s'",
+                         fname);
+            return rv;
         }
+        vhost_lock_fnames[i] = fname;
 
-        /* fetch the record for this vhost */
-        rv = apr_dbm_fetch(dbm, scfg->key, &value);
+#ifdef AP_NEED_SET_MUTEX_PERMS
+        rv = unixd_set_global_mutex_perms(vhost_locks[i]);
         if (rv != APR_SUCCESS) {
-            ap_log_rerror(APLOG_MARK, APLOG_CRIT, rv, r, "DBM fetch failure "
-                          "while processing BMX query");
-            goto close_error;
+            ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s,
+                         "mod_bmx_vhost could not set permissions on global "
+                         "mutex for DBM in file '%s'; check User and Group "
+                         "directives", fname);
+            return rv;
         }
+#endif
+    }
+    return APR_SUCCESS;
+}
 
-        if (value.dptr) {
-            memcpy(&vhost_data, value.dptr, value.dsize);
-            value.dptr = (void *)&vhost_data;
-        } else {
-            ap_log_rerror(APLOG_MARK, APLOG_CRIT, 0, r, "No DBM record found "
-                          "while processing BMX query");
-            goto close_error;
+/**
+ * Destroy the shared memory segment with the configuration pool unless it
+ * was retired.
+ */
+static apr_status_t vhost_shm_cleanup(void *data)
+{
+    if (vhost_shm_pool) {
+        apr_pool_destroy(vhost_shm_pool);
+        vhost_shm_pool = NULL;
+    }
+    return APR_SUCCESS;
+}
+
+/**
+ * Create the shared memory segment holding one base record per VHost,
+ * followed by one shared record and the fold counters of each VHost, the
+ * rates of each VHost and what was last written behind of it, the series
+ * of each VHost if kept, the top paths of each VHost if tracked, the table
+ * of Hosts if tracked, the windows of each VHost if kept, then by one slot
+ * of VHOST_SLOT_ENTRIES entries of live counters for every configured
+ * worker plus the trailing shared slot, and by the queue statistics of each
+ * child if requests are queued. A segment larger than BMXVHostMemoryLimit
+ * is refused.
+ */
+static apr_status_t vhost_shm_create(apr_pool_t *pconf, apr_pool_t *ptemp,
+                                     server_rec *s)
+{
+    apr_status_t rv;
+    apr_size_t bases_size, shared_size, rates_size, slots_size, shm_size;
+    apr_size_t series_head = 0, series_size = 0, top_size = 0;
+    apr_size_t hosts_size = 0, windows_head = 0, windows_marks = 0;
+    apr_size_t windows_size = 0;
+    apr_size_t queue_stats_size = 0, locks_size;
+    int server_limit = 0, max_daemons = 0, nwindows = 0, w;
+    char *base;
+
+    /*
+     * Only the workers configured by MaxRequestWorkers get a slot, rather
+     * than all those the ServerLimit and ThreadLimit would allow, which
+     * are far more on threaded MPMs.
+     */
+    ap_mpm_query(AP_MPMQ_HARD_LIMIT_DAEMONS, &server_limit);
+    ap_mpm_query(AP_MPMQ_MAX_DAEMONS, &max_daemons);
+    ap_mpm_query(AP_MPMQ_MAX_THREADS, &vhost_thread_limit);
+    if (server_limit < 1)
+        server_limit = 1;
+    if (max_daemons < 1 || max_daemons > server_limit)
+        max_daemons = server_limit;
+    if (vhost_thread_limit < 1)
+        vhost_thread_limit = 1;
+    vhost_server_limit = server_limit;
+
+    vhost_nslots = max_daemons * vhost_thread_limit + 1;
+    vhost_slot_size = APR_ALIGN(VHOST_SLOT_HEAD
+                                    + VHOST_SLOT_ENTRIES * VHOST_ENTRY_SIZE,
+                                VHOST_CACHE_LINE);
+    bases_size = APR_ALIGN(vhost_nrecords * sizeof(struct vhost_data),
+                           VHOST_CACHE_LINE);
+    shared_size = APR_ALIGN((vhost_nrecords - 1)
+                                * sizeof(struct vhost_timespan)
+                                + vhost_nrecords * sizeof(struct vhost_folds),
+                            VHOST_CACHE_LINE);
+    rates_size = APR_ALIGN(vhost_nrecords * sizeof(struct vhost_rates)
+                               + sizeof(struct vhost_ticker)
+                               + vhost_nrecords * sizeof(apr_uint64_t),
+                           VHOST_CACHE_LINE);
+    if (series_points) {
+        series_head = APR_ALIGN(sizeof(struct vhost_series)
+                                    + series_points * sizeof(apr_time_t),
+                                VHOST_CACHE_LINE);
+        series_size = series_head
+                    + APR_ALIGN((apr_size_t)vhost_nrecords * series_points
+                                    * VHOST_LIVE_SIZE,
+                                VHOST_CACHE_LINE);
+    }
+    if (top_entries) {
+        for (top_buckets = 1;
+             top_buckets * VHOST_TOP_WAYS < (apr_uint32_t)top_entries;
+             top_buckets <<= 1)
+            ;
+        top_size = APR_ALIGN((apr_size_t)(vhost_nrecords - 1) * top_buckets
+                                 * sizeof(struct vhost_top_bucket),
+                             VHOST_CACHE_LINE);
+    }
+    if (host_entries) {
+        for (host_mask = VHOST_HOST_PROBE;
+             host_mask < (apr_uint32_t)host_entries;
+             host_mask <<= 1)
+            ;
+        /* and one more for the other hosts */
+        hosts_size = APR_ALIGN((apr_size_t)(host_mask + 1)
+                                   * sizeof(struct vhost_host_entry),
+                               VHOST_CACHE_LINE);
+        host_mask--;
+    }
+    /* only the kinds of windows kept have marks */
+    for (w = 0; w < __N_VHOST_WINDOWS; w++) {
+        window_pos[w] = (vhost_timespans & VHOST_KEEP_WINDOW(w))
+                        ? nwindows++ : -1;
+    }
+    if (nwindows) {
+        windows_head = APR_ALIGN(sizeof(struct vhost_windows),
+                                 VHOST_CACHE_LINE);
+        windows_marks = APR_ALIGN((apr_size_t)nwindows * 2
+                                      * vhost_nrecords * VHOST_LIVE_SIZE,
+                                  VHOST_CACHE_LINE);
+        windows_size = windows_head + windows_marks
+                     + (apr_size_t)nwindows * 2 * (vhost_nrecords - 1)
+                       * VHOST_HLL_REGISTERS;
+    }
+    slots_size = (apr_size_t)vhost_nslots * vhost_slot_size;
+    shm_size = bases_size + shared_size + rates_size + series_size
+             + top_size + hosts_size + windows_size + slots_size;
+    if (queue_size) {
+        queue_stats_size = APR_ALIGN(server_limit
+                                         * sizeof(struct vhost_queue_stats),
+                                     VHOST_CACHE_LINE);
+    }
+    locks_size = APR_ALIGN(vhost_nlocks * sizeof(struct vhost_lock_stats),
+                           VHOST_CACHE_LINE);
+    shm_size += queue_stats_size + locks_size;
+
+    if (shm_size / (1024 * 1024) >= (apr_size_t)memory_limit) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, 0, s, "mod_bmx_vhost would "
+                     "need %" APR_SIZE_T_FMT " bytes of shared memory for "
+                     "%d vhosts and %d workers, beyond the BMXVHostMemoryLimit "
+                     "of %d MB", shm_size, vhost_nrecords - 1,
+                     vhost_nslots - 1, memory_limit);
+        return APR_ENOMEM;
+    }
+
+    /* the segment is retired rather than destroyed with the configuration
+     * when children of this generation may still use it */
+    apr_pool_create(&vhost_shm_pool, s->process->pool);
+    apr_pool_cleanup_register(pconf, NULL, vhost_shm_cleanup,
+                              apr_pool_cleanup_null);
+
+    /* anonymous shared memory where available, else name it after the DBM
+     * and the generation, as that of the last one may be kept a while */
+    rv = apr_shm_create(&vhost_shm, shm_size, NULL, vhost_shm_pool);
+    if (APR_STATUS_IS_ENOTIMPL(rv)) {
+        const char *shm_fname = apr_psprintf(ptemp, "%s.shm.%d", dbm_fname,
+                                             vhost_generation);
+        (void)apr_shm_remove(shm_fname, ptemp);
+        rv = apr_shm_create(&vhost_shm, shm_size, shm_fname, vhost_shm_pool);
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, "Failed to create "
+                     "mod_bmx_vhost shared memory of %" APR_SIZE_T_FMT
+                     " bytes", shm_size);
+        return rv;
+    }
+
+    base = apr_shm_baseaddr_get(vhost_shm);
+    memset(base, 0, shm_size);
+    vhost_bases = (struct vhost_data *)base;
+    vhost_shared = (struct vhost_timespan *)(base + bases_size);
+    vhost_folds = (struct vhost_folds *)(vhost_shared + vhost_nrecords - 1);
+    vhost_rates = (struct vhost_rates *)(base + bases_size + shared_size);
+    vhost_ticker = (struct vhost_ticker *)(vhost_rates + vhost_nrecords);
+    vhost_flushed = (apr_uint64_t *)(vhost_ticker + 1);
+    base += bases_size + shared_size + rates_size;
+    vhost_series = series_size ? (struct vhost_series *)base : NULL;
+    vhost_series_times = series_size ? (apr_time_t *)(vhost_series + 1)
+                                     : NULL;
+    vhost_series_data = series_size ? base + series_head : NULL;
+    vhost_top = top_size ? (struct vhost_top_bucket *)(base + series_size)
+                         : NULL;
+    vhost_hosts = hosts_size ? (struct vhost_host_entry *)
+                               (base + series_size + top_size) : NULL;
+    base += series_size + top_size + hosts_size;
+    vhost_windows = windows_size ? (struct vhost_windows *)base : NULL;
+    vhost_window_marks = windows_size ? base + windows_head : NULL;
+    vhost_window_sketches = windows_size ? (apr_byte_t *)vhost_window_marks
+                                           + windows_marks : NULL;
+    vhost_slots = base + windows_size;
+    if (vhost_hosts) {
+        struct vhost_host_entry *other = &vhost_hosts[host_mask + 1];
+        apr_cpystrn(other->host, OTHER_HOSTS_NAME, sizeof(other->host));
+        other->start_time = apr_time_now();
+    }
+    vhost_queue_stats = queue_size ? (struct vhost_queue_stats *)
+                                     (vhost_slots + slots_size) : NULL;
+    vhost_lock_stats = (struct vhost_lock_stats *)
+                       (vhost_slots + slots_size + queue_stats_size);
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, "mod_bmx_vhost allocated "
+                 "%" APR_SIZE_T_FMT " bytes of shared memory for %d vhost "
+                 "records in %d worker slots", shm_size, vhost_nrecords,
+                 vhost_nslots);
+    return APR_SUCCESS;
+}
+
+static int bmx_vhost_post_config(apr_pool_t *pconf, apr_pool_t *plog,
+                                 apr_pool_t *ptemp, server_rec *s)
+{
+    const char *preflight_key = "bmx_vhost_preflight";
+    void *preflight = NULL;
+    server_rec *vhost;
+    int startup;
+    int index = 0;
+    apr_status_t rv;
+
+    /* set the main server */
+    main_server = s;
+
+    /* create a mutex to protect each shard of the store */
+    vhost_nlocks = vhost_store == &vhost_store_dbm ? dbm_shards : 1;
+    rv = vhost_locks_create(pconf, s);
+    if (rv != APR_SUCCESS) {
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* Check if this is configtest or a preflight phase, clear nothing!
+     * The store is not opened either, as a running server may be using it */
+    apr_pool_userdata_get(&preflight, preflight_key, s->process->pool);
+    if (!preflight) {
+        apr_pool_userdata_set(preflight_key, preflight_key,
+                              apr_pool_cleanup_null, s->process->pool);
+        return OK;
+    }
+
+#if MODULE_MAGIC_NUMBER_MAJOR >= 20090401
+    /* Check if this is the first generation supported in 2.3.3+ */
+    if (ap_mpm_query(AP_MPMQ_GENERATION, &vhost_generation) != APR_SUCCESS)
+	vhost_generation = 0;
+#else
+    vhost_generation = ap_my_generation;
+#endif
+    startup = (vhost_generation == 0);
+
+    /* one shared memory record for the global server and for each vhost */
+    vhost_nrecords = 1;
+    for (vhost = s; vhost; vhost = vhost->next)
+        vhost_nrecords++;
+
+    rv = vhost_shm_create(pconf, ptemp, s);
+    if (rv != APR_SUCCESS) {
+         return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* the rates start from the counters of this generation */
+    vhost_ticker->last_tick = apr_time_now();
+    vhost_ticker->next_tick = vhost_ticker->last_tick
+                            + apr_time_from_sec(VHOST_RATE_TICK);
+    vhost_ticker->next_flush = vhost_ticker->last_tick
+                             + apr_time_from_sec(flush_interval);
+    vhost_totals = apr_palloc(pconf, (apr_size_t)vhost_nrecords
+                                     * VHOST_LIVE_SIZE);
+    vhost_totals_folds = apr_palloc(pconf, 2 * (apr_size_t)vhost_nrecords
+                                           * sizeof(apr_uint32_t));
+    vhost_index = vhost_live_index_make(pconf);
+
+    /* the first point holds no counts, so every later one has one before */
+    if (vhost_series) {
+        vhost_series_times[0] = vhost_ticker->last_tick;
+        vhost_series->taken = 1;
+        vhost_series->next_point = vhost_ticker->last_tick
+                                 + apr_time_from_sec(series_step);
+    }
+
+    /* Create the global server config */
+    global_scfg = bmx_vhost_create_scfg(pconf, GLOBAL_SERVER_NAME, GLOBAL_PORT);
+    vhost_host_index = apr_hash_make(pconf);
+    vhost_host_index_add(pconf, GLOBAL_SERVER_NAME, global_scfg);
+
+    /* create a server config for each vhost */
+    for (vhost = s; vhost; vhost = vhost->next)
+    {
+        /* complete our module config for this server */
+        struct bmx_vhost_scfg *scfg;
+        scfg = ap_get_module_config(vhost->module_config, &bmx_vhost_module);
+        vhost_scfg_init(scfg, vhost->server_hostname, vhost->port);
+        scfg->index = index++;
+        scfg->shard = vhost_scfg_shard(scfg);
+        vhost_host_index_add(pconf, vhost->server_hostname, scfg);
+
+        /* our info bean for this server is built when printed */
+        scfg->server = vhost;
+    }
+
+    /* the global record has no counters of its own, see vhost_nrecords */
+    global_scfg->index = index++;
+    global_scfg->shard = vhost_scfg_shard(global_scfg);
+
+    if (vhost_windows) {
+        vhost_windows_init(s, vhost_ticker->last_tick);
+    }
+
+    if (queue_size) {
+        bmx_objectname_create(&queue_objectname, BMX_VHOST_DOMAIN, pconf);
+        apr_table_set(queue_objectname->props, "Type", BMX_VHOST_QUEUE_TYPE);
+    }
+
+    rv = vhost_store->open(s, pconf, ptemp);
+    if (rv != APR_SUCCESS) {
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* reset the stored records - global server s is used for error logging */
+    rv = vhost_data_reset_all(s, startup);
+    if (rv != APR_SUCCESS) {
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* save this generation's counters when it ends; this runs before the
+     * shared memory itself is destroyed, as cleanups run in reverse order */
+    apr_pool_cleanup_register(pconf, s, vhost_shm_fold, apr_pool_cleanup_null);
+
+    return OK;
+}
+
+/**
+ * Count a request for its path in the top paths of its VHost. A path being
+ * tracked is counted with atomic operations. Otherwise it takes over the
+ * entry of its bucket with the fewest requests, inheriting all of its
+ * counts as its error, unless another worker is taking over an entry of
+ * the same bucket at the time, in which case the request is not counted
+ * at all rather than waiting. Either way this takes constant time.
+ */
+static void vhost_top_update(const struct vhost_sample *sample)
+{
+    struct vhost_top_bucket *bucket = vhost_top_bucket(sample->index,
+                                                       sample->path_hash);
+    struct vhost_top_entry *entry, *least = NULL;
+    int i;
+
+    for (i = 0; i < VHOST_TOP_WAYS; i++) {
+        entry = &bucket->entry[i];
+        if (entry->hash == sample->path_hash) {
+            break;
         }
+    }
 
-        /* close the DBM */
-        apr_dbm_close(dbm);
+    if (i == VHOST_TOP_WAYS) {
+        if (!vhost_busy_claim(&bucket->busy, apr_time_now(),
+                              VHOST_TOP_STALE)) {
+            return;
+        }
 
-        /* unlock the DBM */
-        rv = apr_global_mutex_unlock(dbmlock);
-        if (rv != APR_SUCCESS) {
-            ap_log_rerror(APLOG_MARK, APLOG_CRIT, rv, r, "Unlock failure while "
-                          "logging transaction in mod_bmx_vhost");
-            goto error;
+        /* another worker may have taken an entry for this path meanwhile */
+        for (i = 0; i < VHOST_TOP_WAYS; i++) {
+            entry = &bucket->entry[i];
+            if (entry->hash == sample->path_hash) {
+                break;
+            }
+            if (!least || entry->requests < least->requests) {
+                least = entry;
+            }
         }
 
-        if (forever) {
-            print_vhost_bean(r, print_bean_fn, scfg->forever,
-                             &vhost_data.forever);
-            rv = OK;
+        if (i == VHOST_TOP_WAYS) {
+            entry = least;
+            entry->hash = 0;
+            vhost_barrier();
+            entry->error[TOP_REQUESTS] = entry->requests;
+            entry->error[TOP_BYTES] = entry->bytes;
+            entry->error[TOP_DURATION] = entry->duration;
+            memcpy(entry->path, sample->path, sizeof(entry->path));
+            vhost_barrier();
+            entry->hash = sample->path_hash;
+        }
+
+        apr_atomic_set32(&bucket->busy, 0);
+    }
+
+    vhost_atomic_add64(&entry->requests, sample->weight);
+    vhost_atomic_add64(&entry->bytes, sample->out_low_bytes);
+    vhost_atomic_add64(&entry->duration,
+                       (apr_uint64_t)sample->duration * sample->weight);
+}
+
+/**
+ * Take over the given entry of the table of Hosts, which the caller has
+ * claimed, for the Host of the sample. The counts of the Host it held, if
+ * any, are added to those of the other Hosts so that the table still adds
+ * up to all requests. The entry is released once the Host is published.
+ */
+static void vhost_host_take(struct vhost_host_entry *entry,
+                            const struct vhost_sample *sample,
+                            apr_uint32_t tag)
+{
+    struct vhost_host_entry *other = &vhost_hosts[host_mask + 1];
+
+    if (entry->requests) {
+        vhost_atomic_add64(&other->requests, entry->requests);
+        vhost_atomic_add64(&other->in_bytes, entry->in_bytes);
+        vhost_atomic_add64(&other->out_bytes, entry->out_bytes);
+        vhost_atomic_add64(&other->duration, entry->duration);
+        vhost_atomic_add64(&other->client_errors, entry->client_errors);
+        vhost_atomic_add64(&other->server_errors, entry->server_errors);
+        vhost_atomic_add64(&other->evictions, 1);
+    }
+
+    entry->requests = entry->in_bytes = entry->out_bytes = 0;
+    entry->duration = entry->client_errors = entry->server_errors = 0;
+    entry->start_time = apr_time_now();
+    apr_cpystrn(entry->host, sample->host, sizeof(entry->host));
+    vhost_barrier();
+    apr_atomic_set32(&entry->tag, tag);
+    apr_atomic_set32(&entry->busy, 0);
+}
+
+/**
+ * Claim the given entry of the table of Hosts, whose tag was state, and
+ * take it over for the Host of the sample. Once the entry is marked as
+ * pending for the Host, the entries where the Host may be found are looked
+ * at again, as another worker may have taken one for it meanwhile, or be
+ * taking one. Either way the entry is given back as it was. Of two workers
+ * taking entries for the same Host at once, at least one sees the other,
+ * so the Host is never published twice. An entry left pending by a worker
+ * which died is taken over once its claim is stale.
+ * @returns The entry where the Host is now, or NULL if the entry could not
+ * be claimed or another worker is taking one for the Host.
+ */
+static struct vhost_host_entry *vhost_host_claim(
+    struct vhost_host_entry *entry, apr_uint32_t state,
+    const struct vhost_sample *sample, apr_uint32_t home, apr_uint32_t tag)
+{
+    struct vhost_host_entry *e, *found = NULL;
+    apr_uint32_t old, i;
+
+    if (!vhost_busy_claim(&entry->busy, apr_time_now(), VHOST_HOST_STALE)) {
+        return NULL;
+    }
+
+    /* only a worker which died leaves a pending entry to be claimed */
+    old = apr_atomic_read32(&entry->tag);
+    if (old & VHOST_HOST_PENDING) {
+        old = 0;
+    }
+    else if (old == tag
+             && !strncmp(entry->host, sample->host, VHOST_HOST_LEN)) {
+        apr_atomic_set32(&entry->busy, 0);
+        return entry;
+    }
+    else if (old != state) {
+        apr_atomic_set32(&entry->busy, 0);
+        return NULL;
+    }
+
+    apr_atomic_set32(&entry->tag, tag | VHOST_HOST_PENDING);
+    vhost_barrier();
+
+    for (i = 0; i < VHOST_HOST_PROBE; i++) {
+        e = &vhost_hosts[(home + i) & host_mask];
+        if (e == entry) {
+            continue;
+        }
+        state = apr_atomic_read32(&e->tag);
+        if (state == (tag | VHOST_HOST_PENDING)) {
+            break;
+        }
+        if (state == tag && !strncmp(e->host, sample->host, VHOST_HOST_LEN)) {
+            found = e;
+            break;
+        }
+    }
+
+    if (i < VHOST_HOST_PROBE) {
+        apr_atomic_set32(&entry->tag, old);
+        apr_atomic_set32(&entry->busy, 0);
+        return found;
+    }
+
+    vhost_host_take(entry, sample, tag);
+    return entry;
+}
+
+/**
+ * Count a request for its Host in the table of Hosts. A Host is looked for
+ * in the VHOST_HOST_PROBE entries from its hash on, up to the first entry
+ * never used, which it takes if it is not found before. Once the entries
+ * are all used, it takes over the first one the clock finds unreferenced,
+ * clearing the references it passes by, as in the CLOCK algorithm but
+ * within these entries only. If every entry is being taken over by other
+ * workers, or another worker is taking one for the same Host, the request
+ * is counted for the other Hosts. Only compare-and-swap operations are
+ * used, so a worker never waits for another, and memory stays bounded
+ * however many Hosts are seen. A request counted just as its Host is
+ * evicted may be counted for the Host taking over.
+ */
+static void vhost_host_update(const struct vhost_sample *sample)
+{
+    apr_uint32_t home = (apr_uint32_t)sample->host_hash & host_mask;
+    apr_uint32_t tag = (apr_uint32_t)(sample->host_hash >> 32)
+                     & ~VHOST_HOST_PENDING;
+    struct vhost_host_entry *entry = NULL, *e;
+    apr_uint32_t i, state;
+    int pass;
+
+    if (!tag) {
+        tag = 1;
+    }
+
+    for (i = 0; !entry && i < VHOST_HOST_PROBE; i++) {
+        e = &vhost_hosts[(home + i) & host_mask];
+        state = apr_atomic_read32(&e->tag);
+        if (state == 0) {
+            /* the Host was never seen, as it would have taken this one */
+            entry = vhost_host_claim(e, state, sample, home, tag);
+        }
+        else if (state == tag
+                 && !strncmp(e->host, sample->host, VHOST_HOST_LEN)) {
+            entry = e;
+        }
+    }
+
+    for (pass = 0; !entry && pass < 2; pass++) {
+        for (i = 0; !entry && i < VHOST_HOST_PROBE; i++) {
+            e = &vhost_hosts[(home + i) & host_mask];
+            state = apr_atomic_read32(&e->tag);
+            if (!pass && !(state & VHOST_HOST_PENDING)
+                && apr_atomic_read32(&e->referenced)) {
+                apr_atomic_set32(&e->referenced, 0);
+                continue;
+            }
+            entry = vhost_host_claim(e, state, sample, home, tag);
+        }
+    }
+
+    if (!entry) {
+        entry = &vhost_hosts[host_mask + 1];
+    }
+
+    if (!apr_atomic_read32(&entry->referenced)) {
+        apr_atomic_set32(&entry->referenced, 1);
+    }
+    vhost_atomic_add64(&entry->requests, sample->weight);
+    vhost_atomic_add64(&entry->in_bytes, sample->in_low_bytes);
+    vhost_atomic_add64(&entry->out_bytes, sample->out_low_bytes);
+    vhost_atomic_add64(&entry->duration,
+                       (apr_uint64_t)sample->duration * sample->weight);
+    if (sample->status >= 500) {
+        vhost_atomic_add64(&entry->server_errors, sample->weight);
+    } else if (sample->status >= 400) {
+        vhost_atomic_add64(&entry->client_errors, sample->weight);
+    }
+}
+
+/**
+ * Record a sample into the entry of its VHost in the slot it was taken
+ * for, taking one over if need be. No other thread ever writes to a
+ * worker's own slot, so no lock is needed, except for the trailing shared
+ * slot which is protected by the global mutex of the first shard. The
+ * unique clients registers of the VHost are shared, but only written when
+ * a register rises, which soon becomes rare.
+ */
+static apr_status_t vhost_sample_record(server_rec *s,
+                                        const struct vhost_sample *sample)
+{
+    apr_status_t rv;
+
+    vhost_hll_add(vhost_shared[sample->index].Clients, sample->client_hash);
+    if (vhost_windows) {
+        vhost_windows_add_client(sample->index, sample->client_hash);
+    }
+
+    if (vhost_top) {
+        vhost_top_update(sample);
+    }
+    if (vhost_hosts) {
+        vhost_host_update(sample);
+    }
+
+    if (sample->slot < vhost_nslots - 1) {
+        vhost_slot_write_begin(sample->slot);
+        vhost_slot_update(sample);
+        vhost_slot_write_end(sample->slot);
+        return APR_SUCCESS;
+    }
+
+    rv = vhost_lock(s, 0, "logging transaction in mod_bmx_vhost");
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+
+    vhost_slot_write_begin(sample->slot);
+    vhost_slot_update(sample);
+    vhost_slot_write_end(sample->slot);
+
+    return vhost_unlock(s, 0, "logging transaction in mod_bmx_vhost");
+}
+
+#if APR_HAS_THREADS
+/**
+ * One cell of the queue. Its sequence number tells whether the cell is free
+ * for the producer at that position, or filled for the consumer.
+ */
+struct vhost_queue_cell {
+    volatile apr_uint32_t seq;
+    struct vhost_sample sample;
+};
+
+/**
+ * The bounded queue of samples of this child. Any worker thread adds to it
+ * by claiming the next position with a compare-and-swap, and the drain
+ * thread alone takes from it, so neither side ever takes a lock.
+ */
+static struct {
+    /** The cells, a power of two of them */
+    struct vhost_queue_cell *cells;
+    /** The number of cells less one, to wrap positions */
+    apr_uint32_t mask;
+    /** The next position to be filled by a worker */
+    volatile apr_uint32_t tail;
+    /** The next position to be taken by the drain thread */
+    apr_uint32_t head;
+    /** The thread draining the queue */
+    apr_thread_t *thread;
+    /** Set when the drain thread is to exit */
+    volatile apr_uint32_t stop;
+    /** Set while the drain thread waits for the queue to be filled */
+    volatile apr_uint32_t waiting;
+    /** The lock and condition the drain thread waits on */
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t *cond;
+    /** The samples dropped by this child, counted by the workers */
+    volatile apr_uint32_t drops;
+    /** The samples recorded by the drain thread */
+    apr_uint64_t drained;
+    /** The statistics of this child in shared memory, once known */
+    struct vhost_queue_stats *stats;
+} child_queue;
+
+/**
+ * Add a sample to the queue of this child. Returns zero if the queue was
+ * full and the sample was dropped.
+ */
+static int vhost_queue_push(const struct vhost_sample *sample)
+{
+    struct vhost_queue_cell *cell;
+    apr_uint32_t pos, seq, prev;
+
+    pos = apr_atomic_read32(&child_queue.tail);
+    for (;;) {
+        cell = &child_queue.cells[pos & child_queue.mask];
+        seq = apr_atomic_read32(&cell->seq);
+        if (seq == pos) {
+            prev = apr_atomic_cas32(&child_queue.tail, pos + 1, pos);
+            if (prev == pos) {
+                break;
+            }
+            pos = prev;
+        } else if ((apr_int32_t)(seq - pos) < 0) {
+            /* the drain thread has not taken this cell yet */
+            return 0;
+        } else {
+            pos = apr_atomic_read32(&child_queue.tail);
         }
+    }
 
-        if (since_start) {
-            print_vhost_bean(r, print_bean_fn, scfg->since_start,
-                             &vhost_data.since_start);
-            rv = OK;
-        }
+    cell->sample = *sample;
+    vhost_barrier();
+    apr_atomic_set32(&cell->seq, pos + 1);
 
-        if (since_restart) {
-            print_vhost_bean(r, print_bean_fn, scfg->since_restart,
-                             &vhost_data.since_restart);
-            rv = OK;
-        }
+    /* wake the drain thread, the barrier orders the cell with the flag */
+    vhost_barrier();
+    if (apr_atomic_read32(&child_queue.waiting)) {
+        apr_thread_mutex_lock(child_queue.mutex);
+        apr_thread_cond_signal(child_queue.cond);
+        apr_thread_mutex_unlock(child_queue.mutex);
     }
+    return 1;
+}
 
-    return rv;
+/**
+ * Whether the next cell of the queue of this child has been filled. Only
+ * called by the drain thread.
+ */
+static int vhost_queue_filled(void)
+{
+    apr_uint32_t pos = child_queue.head;
+    struct vhost_queue_cell *cell = &child_queue.cells[pos & child_queue.mask];
 
-close_error:
-    apr_dbm_close(dbm);
+    return (apr_int32_t)(apr_atomic_read32(&cell->seq) - (pos + 1)) >= 0;
+}
 
-unlock_error:
-    (void)apr_global_mutex_unlock(dbmlock);
+/**
+ * Take the next sample from the queue of this child. Returns zero if the
+ * queue is empty. Only called by the drain thread.
+ */
+static int vhost_queue_pop(struct vhost_sample *sample)
+{
+    struct vhost_queue_cell *cell;
+    apr_uint32_t pos = child_queue.head;
 
-error:
-    return HTTP_INTERNAL_SERVER_ERROR;
+    if (!vhost_queue_filled()) {
+        return 0;
+    }
+    cell = &child_queue.cells[pos & child_queue.mask];
+
+    vhost_barrier();
+    *sample = cell->sample;
+    vhost_barrier();
+    apr_atomic_set32(&cell->seq, pos + child_queue.mask + 1);
+    child_queue.head = pos + 1;
+    return 1;
 }
 
 /**
- * Process an BMX Query by checking if the Query applies to our bean(s)
- * and then by calling the appropriate bean generation routines.
+ * Record the samples waiting in the queue of this child, up to the size of
+ * the queue so that a busy child still writes its counters behind.
+ * Returns the number of samples recorded.
  */
-static int bmx_vhost_query_hook(request_rec *r,
-                                const struct bmx_objectname *query,
-                                bmx_bean_print print_bean_fn)
+static apr_uint32_t vhost_queue_drain(server_rec *s)
 {
-    int rv, rv2;
-    server_rec *s;
+    struct vhost_sample sample;
+    apr_uint32_t n = 0;
 
-    /* check the global too */
-    rv = process_vhost_query(r, query, print_bean_fn, global_scfg);
-    if (rv != OK && rv != DECLINED) {
-        /* we hit some error (reported already) */
-        return rv;
+    while (n <= child_queue.mask && vhost_queue_pop(&sample)) {
+        (void)vhost_sample_record(s, &sample);
+        n++;
     }
 
-    for (s = main_server; s; s = s->next) {
-        struct bmx_vhost_scfg *scfg = ap_get_module_config(s->module_config,
-                                                           &bmx_vhost_module);
-        /* Print out the mod_bmx_vhost:Type=forever/since-start/since-restart
-           beans for this vhost */
-        rv2 = process_vhost_query(r, query, print_bean_fn, scfg);
-        if (rv2 == OK) {
-            rv = OK;
-        } else if (rv2 != DECLINED) {
-            /* we hit some error (reported already) */
-            return rv2;
+    /* the statistics of a child which had the same slot are replaced */
+    child_queue.drained += n;
+    if (child_queue.stats) {
+        child_queue.stats->depth = apr_atomic_read32(&child_queue.tail)
+                                 - child_queue.head;
+        child_queue.stats->drops = apr_atomic_read32(&child_queue.drops);
+        child_queue.stats->drained = child_queue.drained;
+    }
+    return n;
+}
+
+/**
+ * The drain thread of this child, which records the queued samples in
+ * batches, and waits whenever it found the queue empty until a worker
+ * fills it. A worker only takes the lock to wake it, while it waits.
+ */
+static void * APR_THREAD_FUNC vhost_queue_thread(apr_thread_t *thd,
+                                                 void *data)
+{
+    server_rec *s = data;
+
+    while (!apr_atomic_read32(&child_queue.stop)) {
+        if (vhost_queue_drain(s)) {
+            continue;
         }
 
-        if (bmx_check_constraints(query,
-                                  bmx_bean_get_objectname(&scfg->vhost_info))) {
-            print_bean_fn(r, &scfg->vhost_info);
-            rv = OK;
+        apr_thread_mutex_lock(child_queue.mutex);
+        apr_atomic_set32(&child_queue.waiting, 1);
+        vhost_barrier();
+        /* either this sees the sample, or its worker sees the flag */
+        while (!vhost_queue_filled()
+               && !apr_atomic_read32(&child_queue.stop)) {
+            apr_thread_cond_wait(child_queue.cond, child_queue.mutex);
         }
+        apr_atomic_set32(&child_queue.waiting, 0);
+        apr_thread_mutex_unlock(child_queue.mutex);
     }
 
-    return rv;
+    /* record whatever was queued before the child stopped */
+    while (vhost_queue_drain(s))
+        ;
+
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
 }
 
-/*
- *  BMX Virtual Host Extension to mod_status
+/**
+ * Stop the drain thread when the child exits. This runs before the pools
+ * of the child's threads are destroyed, and before the counters are
+ * written behind one last time.
  */
-static int bmx_vhost_status_hook(request_rec *r, int flags)
+static apr_status_t vhost_queue_stop(void *data)
 {
-    if (flags & AP_STATUS_SHORT)
-        return OK;
+    apr_status_t rv;
 
-#ifdef TODO_STATUS_REPORT
-    /* status output, will probably introduce a custom print_bean_fn e.g. */
-        ap_rputs("\n\n<table border=\"0\"><tr>"
-                 "<th>SSes</th><th>Timeout</th><th>Method</th>"
-                 "</tr>\n", r);
-        ap_rprintf(r, "<tr><td>%s</td><td>%s</td></tr>\n", name, value);
-        ap_rputs("</table>\n", r);
+    apr_thread_mutex_lock(child_queue.mutex);
+    apr_atomic_set32(&child_queue.stop, 1);
+    apr_thread_cond_signal(child_queue.cond);
+    apr_thread_mutex_unlock(child_queue.mutex);
+    apr_thread_join(&rv, child_queue.thread);
+    child_queue.thread = NULL;
+    return APR_SUCCESS;
+}
 
-    int rv, rv2;
-    server_rec *s;
+/**
+ * Create the queue of this child and start its drain thread.
+ */
+static apr_status_t vhost_queue_start(apr_pool_t *pchild, server_rec *s)
+{
+    apr_threadattr_t *attr;
+    apr_uint32_t size = 1, i;
+    apr_status_t rv;
 
-    ap_rputs("<hr />\n<h1>BMX Virtual Host Tracking Summary</h1>\n", r);
+    while (size < (apr_uint32_t)queue_size) {
+        size <<= 1;
+    }
 
-    /* check the global too */
-    rv = process_vhost_query(r, query, print_bean_fn, global_scfg);
-    if (rv != OK && rv != DECLINED) {
-        /* we hit some error (reported already) */
+    child_queue.cells = apr_palloc(pchild, size * sizeof(*child_queue.cells));
+    for (i = 0; i < size; i++) {
+        child_queue.cells[i].seq = i;
+    }
+    child_queue.mask = size - 1;
+    child_queue.tail = child_queue.head = 0;
+    child_queue.stop = child_queue.waiting = 0;
+    child_queue.drops = 0;
+    child_queue.drained = 0;
+    child_queue.stats = NULL;
+
+    rv = apr_thread_mutex_create(&child_queue.mutex,
+                                 APR_THREAD_MUTEX_DEFAULT, pchild);
+    if (rv == APR_SUCCESS) {
+        rv = apr_thread_cond_create(&child_queue.cond, pchild);
+    }
+    if (rv == APR_SUCCESS) {
+        rv = apr_threadattr_create(&attr, pchild);
+    }
+    if (rv == APR_SUCCESS) {
+        rv = apr_thread_create(&child_queue.thread, attr, vhost_queue_thread,
+                               s, pchild);
+    }
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "Failed to start the "
+                     "mod_bmx_vhost queue thread, requests are recorded "
+                     "from the logging phase");
+        child_queue.cells = NULL;
         return rv;
     }
 
-    for (s = main_server; s; s = s->next) {
-        struct bmx_vhost_scfg *scfg = ap_get_module_config(s->module_config,
-                                                           &bmx_vhost_module);
-        /* Print out the mod_bmx_vhost:Type=forever/since-start/since-restart
-           beans for this vhost */
-        rv2 = process_vhost_query(r, query, print_bean_fn, scfg);
-        if (rv2 == OK) {
-            rv = OK;
-        } else if (rv2 != DECLINED) {
-            /* we hit some error (reported already) */
-            return rv2;
-        }
+    apr_pool_pre_cleanup_register(pchild, s, vhost_queue_stop);
+    return APR_SUCCESS;
+}
 
-        if (bmx_check_constraints(query,
-                                  bmx_bean_get_objectname(&scfg->vhost_info))) {
-            print_bean_fn(r, &scfg->vhost_info);
-            rv = OK;
-        }
+#ifdef WIN32
+/**
+ * The thread updating the rates and writing the counters behind in this
+ * child, as the parent does not run the monitor hook on Windows.
+ */
+static apr_thread_t *child_ticker;
+static apr_uint32_t child_ticker_stop;
 
+static void * APR_THREAD_FUNC vhost_ticker_thread(apr_thread_t *thd,
+                                                  void *data)
+{
+    while (!apr_atomic_read32(&child_ticker_stop)) {
+        apr_sleep(apr_time_from_sec(1));
+        vhost_rates_tick(apr_time_now(), 1);
     }
-#endif
-
-    return OK;
+    apr_thread_exit(thd, APR_SUCCESS);
+    return NULL;
 }
 
-static int bmx_vhost_pre_config(apr_pool_t *pconf, apr_pool_t *plog,
-                                apr_pool_t *ptemp)
+/**
+ * Stop the ticker thread when the child exits.
+ */
+static apr_status_t vhost_ticker_stop(void *data)
 {
-    dbm_fname = ap_server_root_relative(pconf, DBM_FNAME);
-    dbmlock_fname = ap_server_root_relative(pconf, DBMLOCK_FNAME);
+    apr_status_t rv;
 
-    APR_OPTIONAL_HOOK(bmx, query_hook, bmx_vhost_query_hook, NULL, NULL,
-                      APR_HOOK_MIDDLE);
-    APR_OPTIONAL_HOOK(ap, status_hook, bmx_vhost_status_hook, NULL, NULL,
-                      APR_HOOK_MIDDLE);
-    return OK;
+    apr_atomic_set32(&child_ticker_stop, 1);
+    apr_thread_join(&rv, child_ticker);
+    child_ticker = NULL;
+    return APR_SUCCESS;
 }
 
-static int bmx_vhost_post_config(apr_pool_t *pconf, apr_pool_t *plog,
-                                 apr_pool_t *ptemp, server_rec *s)
+/**
+ * Start the ticker thread of this child.
+ */
+static apr_status_t vhost_ticker_start(apr_pool_t *pchild, server_rec *s)
 {
-    const char *preflight_key = "bmx_vhost_preflight";
-    void *preflight = NULL;
-    server_rec *vhost;
-    int startup;
+    apr_threadattr_t *attr;
     apr_status_t rv;
 
-    /* set the main server */
-    main_server = s;
-
-    /* open a DBM to check that it can be created, see WARN below */
-    rv = apr_dbm_open(&dbm, dbm_fname, APR_DBM_RWCREATE,
-                      APR_OS_DEFAULT, ptemp);
+    child_ticker_stop = 0;
+    rv = apr_threadattr_create(&attr, pchild);
+    if (rv == APR_SUCCESS) {
+        rv = apr_thread_create(&child_ticker, attr, vhost_ticker_thread, s,
+                               pchild);
+    }
     if (rv != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, "Failed to open "
-                     "mod_bmx_vhost DBM file '%s'", dbm_fname);
-        return HTTP_INTERNAL_SERVER_ERROR;
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "Failed to start the "
+                     "mod_bmx_vhost ticker thread, counters are only "
+                     "written on restart and stop");
+        return rv;
     }
 
-#if !defined(OS2) && !defined(WIN32) && !defined(BEOS) && !defined(NETWARE)
-    /*
-     * We have to make sure the Apache child processes have access to
-     * the DBM file.  WARN: With apr_dbm_open_ex, apr_dbm_get_usednames_ex
-     * is required to determine the correct filenames.
-     */
-    if (geteuid() == 0 /* is superuser */)
-    {
-        const char *dbmfile1 = NULL, *dbmfile2 = NULL;
-        apr_dbm_get_usednames(ptemp, dbm_fname, &dbmfile1, &dbmfile2);
-	if (dbmfile1)
-            chown(dbmfile1, unixd_config.user_id, -1 /* no gid change */);
-	if (dbmfile2)
-            chown(dbmfile2, unixd_config.user_id, -1 /* no gid change */);
-    }
+    apr_pool_pre_cleanup_register(pchild, s, vhost_ticker_stop);
+    return APR_SUCCESS;
+}
 #endif
 
-    /* create a mutex to protect the DBM */
-    rv = apr_global_mutex_create(&dbmlock, dbmlock_fname, APR_LOCK_DEFAULT,
-                                 s->process->pool);
-    if (rv != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, "Failed to create "
-                     "mod_bmx_vhost global mutex for DBM in file '%s'",
-                     dbmlock_fname);
-        rv = HTTP_INTERNAL_SERVER_ERROR;
-        goto out;
+/**
+ * Queue a sample for the drain thread of this child, counting it as
+ * dropped if the queue is full.
+ */
+static void vhost_queue_sample(request_rec *r,
+                               const struct vhost_sample *sample)
+{
+    /* learn which statistics are ours from the first worker's handle */
+    if (!child_queue.stats && vhost_queue_stats) {
+        ap_sb_handle_t *sbh = (ap_sb_handle_t *)r->connection->sbh;
+        if (sbh && sbh->child_num >= 0
+            && sbh->child_num < vhost_server_limit) {
+            child_queue.stats = &vhost_queue_stats[sbh->child_num];
+        }
     }
 
-#ifdef AP_NEED_SET_MUTEX_PERMS
-    rv = unixd_set_global_mutex_perms(dbmlock);
-    if (rv != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s,
-                     "mod_bmx_vhost could not set permissions on global mutex"
-                     " for DBM in file '%s'; check User and Group directives",
-                     dbmlock_fname);
-        rv = HTTP_INTERNAL_SERVER_ERROR;
-        goto out;
+    if (!vhost_queue_push(sample)) {
+        apr_atomic_inc32(&child_queue.drops);
     }
+}
 #endif
 
-    /* Check if this is configtest or a preflight phase, clear nothing! */
-    apr_pool_userdata_get(&preflight, preflight_key, s->process->pool);
-    if (!preflight) {
-        apr_pool_userdata_set(preflight_key, preflight_key,
-                              apr_pool_cleanup_null, s->process->pool);
-        rv = OK;
-        goto out;
-    }
+/**
+ * Count the bytes read from the network on this connection, after the
+ * core input filter but before any connection filter such as SSL, as
+ * mod_logio does.
+ */
+static apr_status_t vhost_in_filter(ap_filter_t *f, apr_bucket_brigade *bb,
+                                    ap_input_mode_t mode,
+                                    apr_read_type_e block,
+                                    apr_off_t readbytes)
+{
+    struct vhost_conn *vc = f->ctx;
+    apr_off_t length;
+    apr_status_t rv;
 
-#if MODULE_MAGIC_NUMBER_MAJOR >= 20090401
-    /* Check if this is the first generation supported in 2.3.3+ */
-    if (ap_mpm_query(AP_MPMQ_GENERATION, &startup) == APR_SUCCESS)
-	startup = (startup == 0);
-#else
-    startup = (ap_my_generation == 0);
-#endif
+    rv = ap_get_brigade(f->next, bb, mode, block, readbytes);
+    if (rv == APR_SUCCESS
+        && apr_brigade_length(bb, 0, &length) == APR_SUCCESS && length > 0) {
+        vc->bytes_in += length;
+        vc->total_in += length;
+    }
+    return rv;
+}
 
-    /* Create the global server config */
-    global_scfg = bmx_vhost_create_scfg(pconf, GLOBAL_SERVER_NAME, GLOBAL_PORT);
+/**
+ * Count the bytes written to the network on this connection from the
+ * lengths of the buckets, once the core output filter has taken them
+ * without error. A bucket of unknown length is left for the core output
+ * filter to read rather than read here; the content length filter above
+ * has already read those of a response body, so only the rare ones made
+ * by a connection filter go uncounted.
+ */
+static apr_status_t vhost_out_filter(ap_filter_t *f, apr_bucket_brigade *bb)
+{
+    struct vhost_conn *vc = f->ctx;
+    apr_off_t length = 0;
+    apr_bucket *b;
+    apr_status_t rv;
 
-    rv = vhost_data_reset(dbm, s, ptemp, global_scfg, startup);
-    if (rv != APR_SUCCESS) {
-         rv = HTTP_INTERNAL_SERVER_ERROR;
-         goto out;
+    for (b = APR_BRIGADE_FIRST(bb);
+         b != APR_BRIGADE_SENTINEL(bb);
+         b = APR_BUCKET_NEXT(b)) {
+        if (b->length != (apr_size_t)-1) {
+            length += b->length;
+        }
     }
 
-    /* create a server config for each vhost */
-    for (vhost = s; vhost; vhost = vhost->next)
-    {
-        /* create our module config for this server */
-        struct bmx_vhost_scfg *scfg;
-        scfg = bmx_vhost_create_scfg(pconf, vhost->server_hostname, vhost->port);
-        ap_set_module_config(vhost->module_config, &bmx_vhost_module, scfg);
+    rv = ap_pass_brigade(f->next, bb);
+    if (rv == APR_SUCCESS && !f->c->aborted) {
+        vc->bytes_out += length;
+        vc->total_out += length;
+    }
+    return rv;
+}
 
-        /* create our info bean for this server (none for global) */
-        create_vhost_info_bean(pconf, &scfg->vhost_info, vhost);
+/**
+ * Add our network filters to each connection, once the module has its
+ * shared memory.
+ */
+static int bmx_vhost_pre_connection(conn_rec *c, void *csd)
+{
+    struct vhost_conn *vc;
 
-        /* reset the DBM record - global server s is used for error logging */
-        rv = vhost_data_reset(dbm, s, ptemp, scfg, startup);
-        if (rv != APR_SUCCESS) {
-             rv = HTTP_INTERNAL_SERVER_ERROR;
-             goto out;
-        }
+    if (!vhost_slots) {
+        return DECLINED;
     }
 
-out:
-    apr_dbm_close(dbm);
-    return rv;
+    vc = apr_pcalloc(c->pool, sizeof(*vc));
+    ap_set_module_config(c->conn_config, &bmx_vhost_module, vc);
+    ap_add_input_filter_handle(vhost_in_filter_handle, vc, NULL, c);
+    ap_add_output_filter_handle(vhost_out_filter_handle, vc, NULL, c);
+    return OK;
+}
+
+/**
+ * Whether the request is to be recorded, unless its server is disabled, or
+ * it was not picked out of each BMXVHostSampleRate by a hash of when it
+ * arrived and on which connection, which needs no shared state.
+ */
+static int vhost_sampled(request_rec *r, const struct bmx_vhost_scfg *scfg)
+{
+    if (scfg->enable == 0) {
+        return 0;
+    }
+    if (scfg->sample_rate > 1) {
+        apr_uint64_t mix = (apr_uint64_t)r->request_time
+                         ^ ((apr_uint64_t)r->connection->id << 40);
+        return vhost_mix64(mix) % (apr_uint64_t)scfg->sample_rate == 0;
+    }
+    return 1;
 }
 
 static int bmx_vhost_log_transaction(request_rec *r)
 {
     struct bmx_vhost_scfg *scfg = ap_get_module_config(r->server->module_config,
                                                        &bmx_vhost_module);
-    int rv = OK;
-    apr_datum_t value, global_value;
-    struct vhost_data vhost_data, global_data;
+    struct vhost_sample sample;
     request_rec *last = r;
+    struct vhost_conn *vc;
 
+    if (!scfg || !vhost_slots) {
+        return DECLINED;
+    }
+
+    /* the bytes of the connection so far, for the log formats as %{}n */
+    vc = ap_get_module_config(r->connection->conn_config, &bmx_vhost_module);
+    if (vc) {
+        apr_table_setn(r->notes, VHOST_CONN_IN_NOTE,
+                       apr_off_t_toa(r->pool, vc->total_in));
+        apr_table_setn(r->notes, VHOST_CONN_OUT_NOTE,
+                       apr_off_t_toa(r->pool, vc->total_out));
+    }
 
-    memset(&value, 0, sizeof(value));
-    memset(&global_value, 0, sizeof(global_value));
+    /* decide before anything is recorded, forgetting the bytes on the wire
+     * so they are not counted for the next request of the connection */
+    if (!vhost_sampled(r, scfg)) {
+        if (vc) {
+            vc->bytes_in = vc->bytes_out = 0;
+        }
+        return DECLINED;
+    }
 
     /* find the last response (in case of internal redirect?) */
     while (last->next) {
         last = last->next;
     }
 
-    /* FIXME: make any pre-calculations so we reduce the time spent holding
-       the lock. */
-
-    /* lock the DBM */
-    rv = apr_global_mutex_lock(dbmlock);
-    if (rv != APR_SUCCESS) {
-        ap_log_rerror(APLOG_MARK, APLOG_CRIT, rv, r, "Lock failure while "
-                     "logging transaction in mod_bmx_vhost");
-        goto error;
-    }
-
-    /* open the DBM */
-    rv = apr_dbm_open(&dbm, dbm_fname, APR_DBM_READWRITE,
-                      APR_OS_DEFAULT, r->pool);
-    if (rv != APR_SUCCESS) {
-        ap_log_rerror(APLOG_MARK, APLOG_CRIT, rv, r, "DBM failure while "
-                      "logging transaction in mod_bmx_vhost");
-        goto unlock_error;
-    }
+    vhost_sample_fill(&sample, r, last, scfg->index,
+                      scfg->sample_rate > 1 ? scfg->sample_rate : 1);
+    sample.slot = vhost_slot_get(r);
 
-    /* fetch the record for this vhost */
-    rv = apr_dbm_fetch(dbm, scfg->key, &value);
-    if (rv != APR_SUCCESS) {
-        ap_log_rerror(APLOG_MARK, APLOG_CRIT, rv, r, "DBM fetch failure while "
-                      "logging transaction in mod_bmx_vhost (fetching vhost "
-                      "data structures)");
-        goto close_error;
+#if APR_HAS_THREADS
+    /* leave the recording to the drain thread */
+    if (child_queue.cells) {
+        vhost_queue_sample(r, &sample);
+        return OK;
     }
+#endif
 
-    if (value.dptr) {
-        memcpy(&vhost_data, value.dptr, value.dsize);
-        value.dptr = (void *)&vhost_data;
-    } else {
-        value.dsize = sizeof(vhost_data);
-        value.dptr = (void *)&vhost_data;
-        memset(&vhost_data, 0, value.dsize);
+    if (vhost_sample_record(r->server, &sample) != APR_SUCCESS) {
+        return HTTP_INTERNAL_SERVER_ERROR;
     }
+    return OK;
+}
 
-    /* fetch the global record */
-    rv = apr_dbm_fetch(dbm, global_scfg->key, &global_value);
-    if (rv != APR_SUCCESS) {
-        ap_log_rerror(APLOG_MARK, APLOG_CRIT, rv, r, "DBM fetch failure while "
-                      "logging transaction in mod_bmx_vhost (fetching global "
-                      "data structures)");
-        goto close_error;
+/**
+ * Update the moving average rates and write the counters behind from the
+ * parent, which runs the monitor hook every few seconds, so neither
+ * requests nor queries have to. This is also where the counts of retired
+ * generations are added once their children are gone.
+ */
+#if MODULE_MAGIC_NUMBER_MAJOR >= 20090925
+static int bmx_vhost_monitor(apr_pool_t *p, server_rec *s)
+#else
+static int bmx_vhost_monitor(apr_pool_t *p)
+#endif
+{
+    if (vhost_ticker) {
+        vhost_retired_fold(main_server);
+        vhost_rates_tick(apr_time_now(), 1);
     }
+    return DECLINED;
+}
 
-    if (global_value.dptr) {
-        memcpy(&global_data, global_value.dptr, global_value.dsize);
-        global_value.dptr = (void *)&global_data;
-    } else {
-        ap_log_rerror(APLOG_MARK, APLOG_CRIT, 0, r, "DBM fetch failed while "
-                      "retrieving global vhost error in mod_bmx_vhost");
-        goto close_error;
-    }
+static void bmx_vhost_child_init(apr_pool_t *pchild, server_rec *s)
+{
+    int rv = 0;
+    int i;
 
-    /* update the records for each timespan */
-    vhost_data_update(&vhost_data, r, last);
-    vhost_data_update(&global_data, r, last);
+    /* the counters are only written behind by the current generation */
+    child_started = 1;
+#if MODULE_MAGIC_NUMBER_MAJOR >= 20090401
+    ap_mpm_query(AP_MPMQ_GENERATION, &child_generation);
+#else
+    child_generation = ap_my_generation;
+#endif
 
-    /* store the records */
-    rv = apr_dbm_store(dbm, scfg->key, value);
-    if (rv != APR_SUCCESS) {
-        ap_log_rerror(APLOG_MARK, APLOG_CRIT, rv, r, "DBM store failure while "
-                      "logging transaction in mod_bmx_vhost (storing vhost "
-                      "data structures)");
-        goto close_error;
+    for (i = 0; i < vhost_nlocks; i++) {
+        rv = apr_global_mutex_child_init(&vhost_locks[i],
+                                         vhost_lock_fnames[i], pchild);
+        if (rv != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, "Failed to re-open "
+                         "global mutex for DBM in mod_bmx_vhost during "
+                         "child_init, this child will not write the store");
+            /* any error the parent can see failed post_config already */
+            vhost_locks_lost = 1;
+            break;
+        }
     }
 
-    rv = apr_dbm_store(dbm, global_scfg->key, global_value);
-    if (rv != APR_SUCCESS) {
-        ap_log_rerror(APLOG_MARK, APLOG_CRIT, rv, r, "DBM fetch failure while "
-                      "logging transaction in mod_bmx_vhost (storing global "
-                      "data structures)");
-        goto close_error;
+    if (!vhost_slots) {
+        return;
     }
 
-
-    /* close the DBM */
-    apr_dbm_close(dbm);
-
-    /* unlock the DBM */
-    rv = apr_global_mutex_unlock(dbmlock);
-    if (rv != APR_SUCCESS) {
-        ap_log_rerror(APLOG_MARK, APLOG_CRIT, rv, r, "Unlock failure while "
-                      "logging transaction in mod_bmx_vhost");
-        goto error;
+#if APR_HAS_THREADS
+    /* a queue thread that failed to start leaves recording to the workers */
+    if (queue_size) {
+        (void)vhost_queue_start(pchild, s);
     }
+#ifdef WIN32
+    (void)vhost_ticker_start(pchild, s);
+#endif
+#endif
+}
 
-    return rv;
-
-close_error:
-    apr_dbm_close(dbm);
+/* --------------------------------------------------------------------
+ * Module internals
+ * -------------------------------------------------------------------- */
 
-unlock_error:
-    (void)apr_global_mutex_unlock(dbmlock);
+static void *bmx_vhost_create_server_config(apr_pool_t *p, server_rec *s)
+{
+    struct bmx_vhost_scfg *scfg = apr_pcalloc(p, sizeof(*scfg));
 
-error:
-    return HTTP_INTERNAL_SERVER_ERROR;
+    scfg->enable = -1;
+    return scfg;
 }
 
-static void bmx_vhost_child_init(apr_pool_t *pchild, server_rec *s)
+static void *bmx_vhost_merge_server_config(apr_pool_t *p, void *basev,
+                                           void *addv)
 {
-    int rv = 0;
-    rv = apr_global_mutex_child_init(&dbmlock, dbmlock_fname, pchild);
-    if (rv != APR_SUCCESS) {
-        ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s, "Failed to re-open "
-                     "global mutex for DBM in mod_bmx_vhost during child_init");
-        /* FIXME: prevent the server from starting */
-    }
-}
+    struct bmx_vhost_scfg *base = basev;
+    struct bmx_vhost_scfg *add = addv;
+    struct bmx_vhost_scfg *scfg = apr_pcalloc(p, sizeof(*scfg));
 
-/* --------------------------------------------------------------------
- * Module internals
- * -------------------------------------------------------------------- */
+    scfg->enable = add->enable != -1 ? add->enable : base->enable;
+    scfg->sample_rate = add->sample_rate ? add->sample_rate
+                                         : base->sample_rate;
+    return scfg;
+}
 
 static void bmx_vhost_register_hooks(apr_pool_t *p)
 {
+    /* our notes are set before the request is logged */
+    static const char *const log_succ[] = { "mod_log_config.c", NULL };
+
     ap_hook_pre_config(bmx_vhost_pre_config, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_post_config(bmx_vhost_post_config, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_child_init(bmx_vhost_child_init, NULL, NULL, APR_HOOK_MIDDLE);
-    ap_hook_log_transaction(bmx_vhost_log_transaction, NULL, NULL,
+    ap_hook_log_transaction(bmx_vhost_log_transaction, NULL, log_succ,
                             APR_HOOK_MIDDLE);
+    ap_hook_pre_connection(bmx_vhost_pre_connection, NULL, NULL,
+                           APR_HOOK_MIDDLE);
+    ap_hook_monitor(bmx_vhost_monitor, NULL, NULL, APR_HOOK_MIDDLE);
+
+    /* count the bytes on the wire as mod_logio does, below SSL */
+    vhost_in_filter_handle = ap_register_input_filter("BMX_VHOST_IN",
+                                                      vhost_in_filter, NULL,
+                                                      AP_FTYPE_NETWORK - 1);
+    vhost_out_filter_handle = ap_register_output_filter("BMX_VHOST_OUT",
+                                                        vhost_out_filter, NULL,
+                                                        AP_FTYPE_NETWORK - 1);
 }
 
 static const command_rec bmx_vhost_cmds[] =
 {
+    AP_INIT_FLAG("BMXVHostEnable", set_enable, NULL, RSRC_CONF,
+                 "Whether mod_bmx_vhost records the requests of this "
+                 "server [On]"),
+    AP_INIT_TAKE1("BMXVHostSampleRate", set_sample_rate, NULL, RSRC_CONF,
+                  "Record only one request in this many for this server, "
+                  "counting it that many times [1]"),
+    AP_INIT_TAKE1("BMXVHostStorage", set_storage, NULL, RSRC_CONF,
+                  "Backend in which to store persistent data for "
+                  "mod_bmx_vhost, either 'map', 'dbm' or a socache "
+                  "provider as name[:args], 'dbm:' for its own [\"map\"]"),
+    AP_INIT_TAKE1("BMXVHostMapFilename", set_map_fname, NULL, RSRC_CONF,
+                  "Name of the map file in which to store persistent data "
+                  "for mod_bmx_vhost. Relative to the server root by "
+                  "default [\"" MAP_FNAME "\"]"),
     AP_INIT_TAKE1("BMXVHostDBMFilename", set_dbm_fname, NULL, RSRC_CONF,
                   "Name of the DBM file in which to store persistent data "
                   "for mod_bmx_vhost. Relative to the server root by "
                   "default [\"" DBM_FNAME "\"]"),
+    AP_INIT_TAKE1("BMXVHostDBMShards", set_dbm_shards, NULL, RSRC_CONF,
+                  "Number of DBM files, each with its own lock, over which "
+                  "the vhost records are spread [1]"),
     AP_INIT_TAKE1("BMXVHostLockFilename", set_dbmlock_fname, NULL, RSRC_CONF,
                   "Name of the Lock file used to protect access to the DBM "
                   "used in mod_bmx_vhost. Relative to the server root by "
                   "default [\"" DBMLOCK_FNAME "\"]"),
+    AP_INIT_TAKE1("BMXVHostFlushInterval", set_flush_interval, NULL, RSRC_CONF,
+                  "Number of seconds after which the mod_bmx_vhost counters "
+                  "are written to the store, or 0 to only save them on "
+                  "restart [" APR_STRINGIFY(FLUSH_INTERVAL) "]"),
+    AP_INIT_TAKE1("BMXVHostFlushRequests", set_flush_requests, NULL, RSRC_CONF,
+                  "Number of requests after which the mod_bmx_vhost "
+                  "counters are written to the store, or 0 to only write "
+                  "them on the BMXVHostFlushInterval timer ["
+                  APR_STRINGIFY(FLUSH_REQUESTS) "]"),
+    AP_INIT_TAKE1("BMXVHostAsyncQueue", set_queue_size, NULL, RSRC_CONF,
+                  "Number of requests each child can queue for recording "
+                  "by a background thread, or 0 to record them in the "
+                  "logging phase [0]"),
+    AP_INIT_ITERATE("BMXVHostTimespans", set_timespans, NULL, RSRC_CONF,
+                    "Timespans to keep for each vhost, of forever, "
+                    "since-start and since-restart, and calendar windows, of "
+                    "hour and day [forever since-start since-restart]"),
+    AP_INIT_TAKE2("BMXVHostSeries", set_series, NULL, RSRC_CONF,
+                  "Number of seconds between the points of the series kept "
+                  "for each vhost, and the number of points to keep, or 0 "
+                  "for none [10 0]"),
+    AP_INIT_TAKE12("BMXVHostTopPaths", set_top_paths, NULL, RSRC_CONF,
+                   "Number of path prefixes of the most requests, bytes and "
+                   "time to track for each vhost, or 0 for none, and the "
+                   "number of path segments of each prefix, or 0 for the "
+                   "whole path [0 " APR_STRINGIFY(TOP_DEPTH) "]"),
+    AP_INIT_TAKE1("BMXVHostTopReport", set_top_report, NULL, RSRC_CONF,
+                  "Number of the top paths reported in each order ["
+                  APR_STRINGIFY(TOP_REPORT) "]"),
+    AP_INIT_TAKE1("BMXVHostDynamicHosts", set_dynamic_hosts, NULL, RSRC_CONF,
+                  "Number of Host headers of the requests to track apart "
+                  "from the configured vhosts, or 0 for none [0]"),
+    AP_INIT_TAKE1("BMXVHostMemoryLimit", set_memory_limit, NULL, RSRC_CONF,
+                  "Most shared memory to take for the counters, in "
+                  "megabytes [" APR_STRINGIFY(MEMORY_LIMIT) "]"),
     {NULL}
 };
 
@@ -1220,8 +7429,8 @@ module AP_MODULE_DECLARE_DATA bmx_vhost_module =
     STANDARD20_MODULE_STUFF,
     NULL,                            /* per-directory config creator */
     NULL,                            /* dir config merger */
-    NULL,                            /* server config creator */
-    NULL,                            /* server config merger */
+    bmx_vhost_create_server_config,  /* server config creator */
+    bmx_vhost_merge_server_config,   /* server config merger */
     bmx_vhost_cmds,                  /* command table */
     bmx_vhost_register_hooks,      /* set up other request processing hooks */
 };
@@ -0,0 +1,357 @@
+/*
+ * bmx_test.h: Support for the tests of the mod_bmx modules
+ *
+ * See the NOTICE file distributed with this work for information
+ * regarding copyright ownership. This file is licensed to You under
+ * the Apache License, Version 2.0 (the "License"); you may not use
+ * this file except in compliance with the License.  You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Each test includes the source of the module it tests, then this file,
+ * and runs the hooks of the module outside httpd. This file stands in for
+ * the few httpd functions those hooks call, so that a test only links
+ * against APR, and runs the configuration hooks over a server of as many
+ * VHosts as the test asks for, as httpd would at startup and on a graceful
+ * restart. Its functions are inline, so that a test need not use them
+ * all. See test/Makefile.apxs.
+ */
+
+#ifndef BMX_TEST_H
+#define BMX_TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "apr_general.h"
+#include "apr_file_io.h"
+#include "apr_global_mutex.h"
+#include "apr_hooks.h"
+#include "apr_lib.h"
+
+#include "ap_mpm.h"
+#include "scoreboard.h"
+
+#ifdef AP_NEED_SET_MUTEX_PERMS
+#include "unixd.h"
+
+#if MODULE_MAGIC_NUMBER_MAJOR >= 20081201 && !defined(unixd_config)
+#define unixd_config ap_unixd_config
+#define unixd_set_global_mutex_perms ap_unixd_set_global_mutex_perms
+#endif
+#endif
+
+#if APR_HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+/** The scoreboard, which the tests never have */
+AP_DECLARE_DATA scoreboard *ap_scoreboard_image = NULL;
+
+/** The ServerRoot of the test, a directory of its own */
+static const char *test_root;
+/** The number of workers of the only child, the slots of the tests */
+static int test_threads = 1;
+/** The generation of the server, 0 until it is first restarted */
+static int test_generation;
+/** The number of checks which failed, see test_fail() */
+static int test_failures;
+
+/**
+ * The server being tested and the module under test with its hooks.
+ */
+struct test_server {
+    /** The process pool, which outlives the generations */
+    apr_pool_t *pool;
+    process_rec *process;
+    /** The configuration pool of the generation */
+    apr_pool_t *pconf;
+    /** The temporary pool of the configuration hooks */
+    apr_pool_t *ptemp;
+    /** The main server, followed by the VHosts */
+    server_rec *s;
+    module *m;
+    ap_HOOK_pre_config_t *pre_config;
+    ap_HOOK_post_config_t *post_config;
+    /** Set once the server started, after the preflight */
+    int started;
+};
+
+#if AP_MODULE_MAGIC_AT_LEAST(20100606,0)
+AP_DECLARE(void) ap_log_error_(const char *file, int line, int module_index,
+                               int level, apr_status_t status,
+                               const server_rec *s, const char *fmt, ...)
+#else
+AP_DECLARE(void) ap_log_error(const char *file, int line, int level,
+                              apr_status_t status, const server_rec *s,
+                              const char *fmt, ...)
+#endif
+{
+    char buf[512];
+    char err[128];
+    va_list ap;
+
+    if ((level & APLOG_LEVELMASK) > APLOG_WARNING) {
+        return;
+    }
+    va_start(ap, fmt);
+    apr_vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "%s:%d: %s%s%s\n", file, line, buf,
+            status ? ": " : "",
+            status ? apr_strerror(status, err, sizeof(err)) : "");
+}
+
+AP_DECLARE(apr_status_t) ap_mpm_query(int query_code, int *result)
+{
+    switch (query_code) {
+    case AP_MPMQ_HARD_LIMIT_DAEMONS:
+    case AP_MPMQ_MAX_DAEMONS:
+        *result = 1;
+        return APR_SUCCESS;
+    case AP_MPMQ_HARD_LIMIT_THREADS:
+    case AP_MPMQ_MAX_THREADS:
+        *result = test_threads;
+        return APR_SUCCESS;
+    case AP_MPMQ_GENERATION:
+        *result = test_generation;
+        return APR_SUCCESS;
+    }
+    *result = 0;
+    return APR_ENOTIMPL;
+}
+
+AP_DECLARE(char *) ap_server_root_relative(apr_pool_t *p, const char *fname)
+{
+    return apr_pstrcat(p, test_root, "/", fname, NULL);
+}
+
+#ifdef BMX_HAVE_AP_MUTEX
+AP_DECLARE(apr_status_t) ap_mutex_register(apr_pool_t *pconf,
+                                           const char *type,
+                                           const char *default_dir,
+                                           apr_lockmech_e default_mech,
+                                           apr_int32_t options)
+{
+    return APR_SUCCESS;
+}
+
+AP_DECLARE(apr_status_t) ap_global_mutex_create(apr_global_mutex_t **mutex,
+                                                const char **name,
+                                                const char *type,
+                                                const char *instance_id,
+                                                server_rec *server,
+                                                apr_pool_t *pool,
+                                                apr_int32_t options)
+{
+    const char *fname = apr_pstrcat(pool, test_root, "/logs/", type,
+                                    instance_id ? "." : "",
+                                    instance_id ? instance_id : "", ".lock",
+                                    NULL);
+
+    if (name) {
+        *name = fname;
+    }
+    return apr_global_mutex_create(mutex, fname, APR_LOCK_DEFAULT, pool);
+}
+#endif
+
+#ifdef AP_NEED_SET_MUTEX_PERMS
+/** The user the children run as, root if the test runs as root */
+AP_DECLARE_DATA unixd_config_rec unixd_config;
+
+AP_DECLARE(apr_status_t) unixd_set_global_mutex_perms(apr_global_mutex_t
+                                                      *gmutex)
+{
+    return APR_SUCCESS;
+}
+#endif
+
+/**
+ * Report a check which failed, and fail the test.
+ */
+static APR_INLINE void test_fail(const char *fmt, ...)
+{
+    va_list ap;
+
+    fprintf(stderr, "FAILED: ");
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    test_failures++;
+}
+
+/**
+ * The time in nanoseconds, for timing what is too quick for apr_time_now().
+ */
+static APR_INLINE apr_uint64_t test_nanos(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (apr_uint64_t)ts.tv_sec * 1000000000 + (apr_uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Remove the ServerRoot of the test and all it holds.
+ */
+static apr_status_t test_root_remove(void *data)
+{
+    apr_pool_t *p;
+    apr_dir_t *dir;
+    apr_finfo_t finfo;
+    const char *logs;
+
+    apr_pool_create(&p, NULL);
+    logs = apr_pstrcat(p, test_root, "/logs", NULL);
+    if (apr_dir_open(&dir, logs, p) == APR_SUCCESS) {
+        while (apr_dir_read(&finfo, APR_FINFO_NAME, dir) == APR_SUCCESS) {
+            if (strcmp(finfo.name, ".") && strcmp(finfo.name, "..")) {
+                apr_file_remove(apr_pstrcat(p, logs, "/", finfo.name, NULL),
+                                p);
+            }
+        }
+        apr_dir_close(dir);
+    }
+    apr_dir_remove(logs, p);
+    apr_dir_remove(test_root, p);
+    apr_pool_destroy(p);
+    return APR_SUCCESS;
+}
+
+/**
+ * Set up the server for the given module and its configuration hooks,
+ * with a ServerRoot of its own which is removed with the process pool.
+ */
+static APR_INLINE void test_init(struct test_server *ts, module *m,
+                                 ap_HOOK_pre_config_t *pre_config,
+                                 ap_HOOK_post_config_t *post_config)
+{
+    const char *tmp = NULL;
+
+    apr_initialize();
+    atexit(apr_terminate);
+
+    memset(ts, 0, sizeof(*ts));
+    apr_pool_create(&ts->pool, NULL);
+    apr_pool_create(&ts->pconf, ts->pool);
+    apr_hook_global_pool = ts->pool;
+    ts->process = apr_pcalloc(ts->pool, sizeof(*ts->process));
+    ts->process->pool = ts->pool;
+    ts->process->pconf = ts->pconf;
+    ts->process->short_name = "bmx_test";
+    ts->m = m;
+    ts->m->module_index = 0;
+    ts->pre_config = pre_config;
+    ts->post_config = post_config;
+
+    apr_temp_dir_get(&tmp, ts->pool);
+    test_root = apr_psprintf(ts->pool, "%s/bmx_test.%" APR_PID_T_FMT,
+                             tmp ? tmp : ".", getpid());
+    if (apr_dir_make_recursive(apr_pstrcat(ts->pool, test_root, "/logs",
+                                           NULL),
+                               APR_OS_DEFAULT, ts->pool) != APR_SUCCESS) {
+        fprintf(stderr, "Failed to create %s\n", test_root);
+        exit(1);
+    }
+    apr_pool_cleanup_register(ts->pool, NULL, test_root_remove,
+                              apr_pool_cleanup_null);
+}
+
+/**
+ * End the running generation, if any, as httpd does when it restarts or
+ * stops, by clearing the configuration pool.
+ */
+static APR_INLINE void test_stop(struct test_server *ts)
+{
+    apr_pool_clear(ts->pconf);
+    ts->ptemp = NULL;
+    ts->s = NULL;
+}
+
+/**
+ * Read the configuration of a server of the given number of servers, the
+ * main server then its VHosts, each named after its position, and run the
+ * pre_config hook. The configuration of each VHost is merged with that of
+ * the main server.
+ */
+static APR_INLINE int test_config(struct test_server *ts, int nservers)
+{
+    server_rec *vhost, **next = &ts->s;
+    void *base = NULL, *cfg;
+    int i;
+
+    apr_pool_create(&ts->ptemp, ts->pconf);
+    ts->s = NULL;
+    for (i = 0; i < nservers; i++) {
+        vhost = apr_pcalloc(ts->pconf, sizeof(*vhost));
+        vhost->process = ts->process;
+        vhost->server_hostname = apr_psprintf(ts->pconf, "www%d.example.com",
+                                              i);
+        vhost->port = 80;
+        vhost->is_virtual = (i > 0);
+        vhost->module_config = apr_pcalloc(ts->pconf, sizeof(void *));
+        cfg = ts->m->create_server_config
+              ? ts->m->create_server_config(ts->pconf, vhost) : NULL;
+        if (!base) {
+            base = cfg;
+        }
+        else if (ts->m->merge_server_config) {
+            cfg = ts->m->merge_server_config(ts->pconf, base, cfg);
+        }
+        ap_set_module_config(vhost->module_config, ts->m, cfg);
+        *next = vhost;
+        next = &vhost->next;
+    }
+
+    return ts->pre_config(ts->pconf, ts->pconf, ts->ptemp);
+}
+
+/**
+ * Run the post_config hook over the configuration just read.
+ */
+static APR_INLINE int test_post_config(struct test_server *ts)
+{
+    int rv = ts->post_config(ts->pconf, ts->pconf, ts->ptemp, ts->s);
+
+    apr_pool_destroy(ts->ptemp);
+    ts->ptemp = NULL;
+    return rv;
+}
+
+/**
+ * Start a generation of a server of the given number of servers, ending
+ * the running one if any. When the server first starts, httpd reads its
+ * configuration twice, the first time being the preflight.
+ */
+static APR_INLINE int test_start(struct test_server *ts, int nservers)
+{
+    int rv;
+
+    do {
+        test_stop(ts);
+        rv = test_config(ts, nservers);
+        if (rv == OK) {
+            rv = test_post_config(ts);
+        }
+        if (rv != OK) {
+            test_fail("the server of %d servers did not start: %d",
+                      nservers, rv);
+            return rv;
+        }
+    } while (!ts->started++);
+    return OK;
+}
+
+#endif /* BMX_TEST_H */
@@ -0,0 +1,264 @@
+/*
+ * format_bench.c: Printing of mod_bmx bean property values
+ *
+ * See the NOTICE file distributed with this work for information
+ * regarding copyright ownership. This file is licensed to You under
+ * the Apache License, Version 2.0 (the "License"); you may not use
+ * this file except in compliance with the License.  You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Prints sets of bean properties of each kind with bmx_property_value(),
+ * and with the apr_psprintf() of each value it replaced, and reports the
+ * best time of a few runs of each. Every value printed must be the one
+ * the C library prints for an integer, and for a floating point number
+ * read back as the same value in no more digits than the shorter of
+ * DBL_DIG or 17 (FLT_DIG or 9 for a float) that does.
+ *
+ * Usage: format_bench [properties]
+ */
+
+#include "mod_bmx.c"
+#include "bmx_test.h"
+
+#include <math.h>
+
+/** The runs of each set of properties, of which the best counts */
+#define RUNS 5
+
+static int nproperties = 100000;
+
+/**
+ * The kinds of properties, each printed as a set of its own.
+ */
+enum kind {
+    KIND_INTEGERS,
+    KIND_WHOLE,
+    KIND_RATES,
+    KIND_FRACTIONS,
+    KIND_FLOATS,
+    KIND_NONFINITE,
+    KIND_COUNT
+};
+
+static const char * const kind_names[KIND_COUNT] = {
+    "integers", "whole doubles", "rates (x / 3.7)", "fractions in 0-1",
+    "floats", "NaN / Inf"
+};
+
+static apr_uint64_t seed = 1;
+
+static apr_uint64_t next_random(void)
+{
+    seed = seed * APR_UINT64_C(6364136223846793005)
+           + APR_UINT64_C(1442695040888963407);
+    return seed >> 11;
+}
+
+static struct bmx_property *property_make(apr_pool_t *p, enum kind kind,
+                                          int i)
+{
+    apr_uint64_t r = next_random();
+    double d;
+
+    switch (kind) {
+    case KIND_INTEGERS:
+        switch (i % 4) {
+        case 0:
+            return bmx_property_int32_create("k", (apr_int32_t)r, p);
+        case 1:
+            return bmx_property_uint32_create("k", (apr_uint32_t)r, p);
+        case 2:
+            return bmx_property_int64_create("k", (apr_int64_t)(r << 11), p);
+        default:
+            return bmx_property_uint64_create("k", r << 11, p);
+        }
+    case KIND_WHOLE:
+        return bmx_property_double_create("k", (double)(r % 100000000), p);
+    case KIND_RATES:
+        return bmx_property_double_create("k", (double)(r % 100000) / 3.7,
+                                          p);
+    case KIND_FRACTIONS:
+        return bmx_property_double_create("k", (double)r / 9007199254740992.0,
+                                          p);
+    case KIND_FLOATS:
+        return bmx_property_float_create("k", (float)(r % 100000) / 3.7f, p);
+    default:
+        d = i % 3 ? HUGE_VAL : -HUGE_VAL;
+        if (i % 3 == 2) {
+            /* infinity less infinity is NaN */
+            d -= d;
+        }
+        return bmx_property_double_create("k", d, p);
+    }
+}
+
+/**
+ * Print a property as mod_bmx did before bmx_property_value().
+ */
+static char *property_print(apr_pool_t *p, struct bmx_property *prop)
+{
+    switch (prop->value_type) {
+    case BMX_INT32:
+        return apr_psprintf(p, "%d", prop->value.int32);
+    case BMX_UINT32:
+        return apr_psprintf(p, "%du", prop->value.uint32);
+    case BMX_INT64:
+        return apr_psprintf(p, "%" APR_INT64_T_FMT, prop->value.int64);
+    case BMX_UINT64:
+        return apr_psprintf(p, "%" APR_UINT64_T_FMT, prop->value.uint64);
+    case BMX_FLOAT:
+        return apr_psprintf(p, "%f", prop->value.f);
+    case BMX_DOUBLE:
+        return apr_psprintf(p, "%lf", prop->value.d);
+    default:
+        return "";
+    }
+}
+
+/**
+ * Check the value printed for a property against the C library.
+ */
+static void check_value(const struct bmx_property *prop, const char *value,
+                        apr_size_t len)
+{
+    char got[BMX_VALUE_LEN + 1], want[64];
+    double d, back;
+    int digits, max_digits, is_float = 0;
+
+    memcpy(got, value, len);
+    got[len] = '\0';
+
+    switch (prop->value_type) {
+    case BMX_INT32:
+        snprintf(want, sizeof(want), "%d", (int)prop->value.int32);
+        break;
+    case BMX_UINT32:
+        snprintf(want, sizeof(want), "%u", (unsigned int)prop->value.uint32);
+        break;
+    case BMX_INT64:
+        snprintf(want, sizeof(want), "%" APR_INT64_T_FMT, prop->value.int64);
+        break;
+    case BMX_UINT64:
+        snprintf(want, sizeof(want), "%" APR_UINT64_T_FMT,
+                 prop->value.uint64);
+        break;
+    case BMX_FLOAT:
+        is_float = 1;
+        /* fall through */
+    default:
+        d = is_float ? prop->value.f : prop->value.d;
+        if (d != d) {
+            strcpy(want, "NaN");
+            break;
+        }
+        if (d - d != 0) {
+            strcpy(want, d > 0 ? "+Inf" : "-Inf");
+            break;
+        }
+        back = strtod(got, NULL);
+        if (is_float ? (float)back != (float)d : back != d) {
+            test_fail("%s does not read back as %.17g", got, d);
+            return;
+        }
+        if (d == floor(d) && strpbrk(got, ".e")) {
+            test_fail("%s is not printed as an integer", got);
+            return;
+        }
+        digits = is_float ? FLT_DIG : DBL_DIG;
+        max_digits = is_float ? 9 : 17;
+        snprintf(want, sizeof(want), "%.*g", digits, d);
+        back = strtod(want, NULL);
+        if (is_float ? (float)back != (float)d : back != d) {
+            snprintf(want, sizeof(want), "%.*g", max_digits, d);
+        }
+        if (strlen(got) > strlen(want)) {
+            test_fail("%s is longer than %s", got, want);
+        }
+        return;
+    }
+
+    if (strcmp(got, want)) {
+        test_fail("%s was printed as %s", want, got);
+    }
+}
+
+int main(int argc, const char * const argv[])
+{
+    apr_pool_t *pool, *p;
+    struct bmx_property **props;
+    char buf[BMX_VALUE_LEN];
+    const char *value;
+    apr_uint64_t start, elapsed, old_best, new_best;
+    apr_size_t len, total = 0;
+    int kind, run, i;
+
+    if (argc > 1) {
+        nproperties = atoi(argv[1]);
+    }
+    if (nproperties < 1) {
+        fprintf(stderr, "Usage: %s [properties]\n", argv[0]);
+        return 2;
+    }
+
+    apr_initialize();
+    atexit(apr_terminate);
+    apr_pool_create(&pool, NULL);
+    apr_pool_create(&p, pool);
+    props = apr_palloc(pool, nproperties * sizeof(*props));
+
+    printf("%d properties, best of %d runs, in ms\n", nproperties, RUNS);
+    printf("%-20s %9s %9s\n", "", "psprintf", "value");
+    for (kind = 0; kind < KIND_COUNT; kind++) {
+        for (i = 0; i < nproperties; i++) {
+            props[i] = property_make(pool, (enum kind)kind, i);
+        }
+
+        old_best = new_best = 0;
+        for (run = 0; run < RUNS; run++) {
+            start = test_nanos();
+            for (i = 0; i < nproperties; i++) {
+                total += strlen(property_print(p, props[i]));
+            }
+            elapsed = test_nanos() - start;
+            apr_pool_clear(p);
+            if (!old_best || elapsed < old_best) {
+                old_best = elapsed;
+            }
+
+            start = test_nanos();
+            for (i = 0; i < nproperties; i++) {
+                bmx_property_value(p, props[i], buf, &len);
+                total += len;
+            }
+            elapsed = test_nanos() - start;
+            if (!new_best || elapsed < new_best) {
+                new_best = elapsed;
+            }
+        }
+        printf("%-20s %9.1f %9.1f\n", kind_names[kind], old_best / 1e6,
+               new_best / 1e6);
+
+        for (i = 0; i < nproperties && !test_failures; i++) {
+            value = bmx_property_value(p, props[i], buf, &len);
+            check_value(props[i], value, len);
+        }
+    }
+
+    /* so that the printing is not optimized away */
+    if (!total) {
+        test_fail("nothing was printed");
+    }
+
+    apr_pool_destroy(pool);
+    return test_failures ? 1 : 0;
+}
@@ -0,0 +1,224 @@
+/*
+ * vhost_memory.c: Memory taken by mod_bmx_vhost for each vhost
+ *
+ * See the NOTICE file distributed with this work for information
+ * regarding copyright ownership. This file is licensed to You under
+ * the Apache License, Version 2.0 (the "License"); you may not use
+ * this file except in compliance with the License.  You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Starts servers of more and more VHosts, with the default map store, and
+ * measures what each VHost more takes: in the configuration pool, from
+ * the creation of its server config to the end of post_config, in the
+ * shared memory segment, and in the map file once the counters of the
+ * generation are folded into it. The configuration memory is the heap in
+ * use with the module, less the heap in use without it, so that the
+ * server_recs of the test do not count; the configuration of a VHost must
+ * take no more than CONFIG_PER_VHOST bytes.
+ *
+ * Usage: vhost_memory [workers [vhosts...]]
+ */
+
+#include "mod_bmx_vhost.c"
+#include "bmx_test.h"
+
+#include "apr_allocator.h"
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+/**
+ * The most configuration memory a VHost may take: some 400 bytes are
+ * documented, of which the copy of its live counters for the rates takes
+ * VHOST_LIVE_SIZE.
+ */
+#define CONFIG_PER_VHOST 512
+
+static const int default_counts[] = { 1000, 10000 };
+
+/**
+ * A server of some number of servers, and what it took.
+ */
+struct footprint {
+    int nservers;
+    /** The configuration memory of the module, or -1 if unknown */
+    apr_int64_t config;
+    apr_int64_t shm;
+    apr_int64_t map;
+};
+
+/**
+ * The bytes of the heap in use, which hold the pools, or -1 if unknown.
+ */
+static apr_int64_t heap_in_use(void)
+{
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 33)
+    struct mallinfo2 mi = mallinfo2();
+
+    return (apr_int64_t)(mi.uordblks + mi.hblkhd);
+#elif defined(__GLIBC__)
+    struct mallinfo mi = mallinfo();
+
+    return (apr_int64_t)(unsigned int)mi.uordblks
+           + (apr_int64_t)(unsigned int)mi.hblkhd;
+#else
+    return -1;
+#endif
+}
+
+static int bare_pre_config(apr_pool_t *pconf, apr_pool_t *plog,
+                           apr_pool_t *ptemp)
+{
+    return OK;
+}
+
+static int bare_post_config(apr_pool_t *pconf, apr_pool_t *plog,
+                            apr_pool_t *ptemp, server_rec *s)
+{
+    return OK;
+}
+
+/**
+ * Start a server of the given number of servers and give the heap it took
+ * from its configuration to the end of post_config.
+ */
+static apr_int64_t config_heap(struct test_server *ts, int nservers)
+{
+    apr_int64_t before;
+
+    test_stop(ts);
+    before = heap_in_use();
+    if (test_config(ts, nservers) != OK || test_post_config(ts) != OK) {
+        test_fail("the server of %d servers did not start", nservers);
+        return 0;
+    }
+    return heap_in_use() - before;
+}
+
+/**
+ * Measure what the module takes for a server of fp->nservers servers,
+ * started anew.
+ */
+static void measure(struct test_server *ts, module *bare,
+                    struct footprint *fp)
+{
+    apr_finfo_t finfo;
+    apr_int64_t with, without;
+
+    test_generation = 0;
+
+    ts->m = bare;
+    ts->pre_config = bare_pre_config;
+    ts->post_config = bare_post_config;
+    without = config_heap(ts, fp->nservers);
+
+    ts->m = &bmx_vhost_module;
+    ts->pre_config = bmx_vhost_pre_config;
+    ts->post_config = bmx_vhost_post_config;
+    with = config_heap(ts, fp->nservers);
+
+    fp->config = heap_in_use() < 0 ? -1 : with - without;
+    fp->shm = vhost_shm ? (apr_int64_t)apr_shm_size_get(vhost_shm) : 0;
+
+    /* the counters are folded into the map file as the generation ends */
+    test_stop(ts);
+    if (apr_stat(&finfo, ap_server_root_relative(ts->pool, MAP_FNAME),
+                 APR_FINFO_SIZE, ts->pool) == APR_SUCCESS) {
+        fp->map = finfo.size;
+    }
+    else {
+        fp->map = 0;
+    }
+}
+
+static int count_cmp(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+int main(int argc, const char * const argv[])
+{
+    struct test_server ts;
+    struct footprint first, fp;
+    module bare;
+    int *counts, ncounts, i, workers = 256;
+
+    if (argc > 1) {
+        workers = atoi(argv[1]);
+    }
+    ncounts = argc > 2 ? argc - 2
+                       : (int)(sizeof(default_counts)
+                               / sizeof(default_counts[0]));
+    counts = malloc(ncounts * sizeof(*counts));
+    for (i = 0; i < ncounts; i++) {
+        counts[i] = argc > 2 ? atoi(argv[i + 2]) : default_counts[i];
+        if (counts[i] < 1) {
+            workers = 0;
+        }
+    }
+    if (workers < 1) {
+        fprintf(stderr, "Usage: %s [workers [vhosts...]]\n", argv[0]);
+        return 2;
+    }
+    /* the map file only grows */
+    qsort(counts, ncounts, sizeof(*counts), count_cmp);
+
+    test_threads = workers;
+    test_init(&ts, &bmx_vhost_module, bmx_vhost_pre_config,
+              bmx_vhost_post_config);
+    bare = bmx_vhost_module;
+    bare.create_server_config = NULL;
+    bare.merge_server_config = NULL;
+
+    /* freed pool memory goes back to the heap, to be measured again */
+    apr_allocator_max_free_set(apr_pool_allocator_get(ts.pconf), 1);
+
+    /* the preflight, then the main server alone */
+    if (test_start(&ts, 1) != OK) {
+        return 1;
+    }
+    first.nservers = 1;
+    measure(&ts, &bare, &first);
+
+    printf("%d workers: %" APR_INT64_T_FMT " bytes of configuration, %"
+           APR_INT64_T_FMT " of shared memory and %" APR_INT64_T_FMT
+           " of map file for the main server\n", workers, first.config,
+           first.shm, first.map);
+    printf("  vhosts  config B/vhost  shm B/vhost  map B/vhost\n");
+    for (i = 0; i < ncounts && !test_failures; i++) {
+        fp.nservers = counts[i] + 1;
+        measure(&ts, &bare, &fp);
+        if (fp.config < 0) {
+            printf("%8d %15s", counts[i], "-");
+        }
+        else {
+            printf("%8d %15.1f", counts[i],
+                   (double)(fp.config - first.config) / counts[i]);
+        }
+        printf(" %12.1f %12.1f\n",
+               (double)(fp.shm - first.shm) / counts[i],
+               (double)(fp.map - first.map) / counts[i]);
+
+        if (fp.config >= 0 && fp.config - first.config
+                              > (apr_int64_t)CONFIG_PER_VHOST
+                                * counts[i]) {
+            test_fail("%d vhosts took %" APR_INT64_T_FMT " bytes of "
+                      "configuration, more than %d each", counts[i],
+                      fp.config - first.config, CONFIG_PER_VHOST);
+        }
+    }
+
+    apr_pool_destroy(ts.pool);
+    return test_failures ? 1 : 0;
+}
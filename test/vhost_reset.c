@@ -0,0 +1,199 @@
+/*
+ * vhost_reset.c: Startup and restart time of mod_bmx_vhost by vhost count
+ *
+ * See the NOTICE file distributed with this work for information
+ * regarding copyright ownership. This file is licensed to You under
+ * the Apache License, Version 2.0 (the "License"); you may not use
+ * this file except in compliance with the License.  You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Times the post_config hook of servers of more and more VHosts, with the
+ * default map store, at startup and on a graceful restart, as well as the
+ * end of the generation before a restart, which folds its counters into
+ * the store. Every VHost logs one request in each generation, which must
+ * be found in its forever record after the restart. The best of a few
+ * runs is reported for each number of VHosts.
+ *
+ * Usage: vhost_reset [vhosts...]
+ */
+
+#include "mod_bmx_vhost.c"
+#include "bmx_test.h"
+
+/** The number of runs of each number of VHosts, of which the best counts */
+#define RUNS 3
+
+static const int default_counts[] = { 100, 1000, 10000, 20000 };
+
+/**
+ * Log one request for every VHost of the running generation, and count
+ * it in expected.
+ */
+static void hit_all(server_rec *s, apr_uint64_t *expected)
+{
+    struct vhost_sample sample;
+    struct bmx_vhost_scfg *scfg;
+    server_rec *vhost;
+    int i = 0;
+
+    memset(&sample, 0, sizeof(sample));
+    sample.weight = 1;
+    sample.status = 200;
+    sample.method_number = M_GET;
+    for (vhost = s; vhost; vhost = vhost->next) {
+        scfg = ap_get_module_config(vhost->module_config, &bmx_vhost_module);
+        sample.index = scfg->index;
+        sample.client_hash = (apr_uint64_t)i
+                             * APR_UINT64_C(0x9e3779b97f4a7c15);
+        vhost_sample_record(s, &sample);
+        expected[i++]++;
+    }
+}
+
+/**
+ * Check that the forever record of every VHost loaded from the store holds
+ * the requests it logged in the generations before.
+ */
+static void check_forever(server_rec *s, const apr_uint64_t *expected)
+{
+    struct bmx_vhost_scfg *scfg;
+    server_rec *vhost;
+    int i = 0;
+
+    for (vhost = s; vhost; vhost = vhost->next) {
+        scfg = ap_get_module_config(vhost->module_config, &bmx_vhost_module);
+        if (vhost_bases[scfg->index].forever.InRequests != expected[i]) {
+            test_fail("%s has %" APR_UINT64_T_FMT " requests forever "
+                      "rather than %" APR_UINT64_T_FMT, scfg->host,
+                      vhost_bases[scfg->index].forever.InRequests,
+                      expected[i]);
+            return;
+        }
+        i++;
+    }
+}
+
+/**
+ * Let the parent add the counts of the retired generations and let go of
+ * their segments, as it does from its monitor hook.
+ */
+static void monitor(struct test_server *ts)
+{
+#if MODULE_MAGIC_NUMBER_MAJOR >= 20090925
+    bmx_vhost_monitor(ts->pconf, ts->s);
+#else
+    bmx_vhost_monitor(ts->pconf);
+#endif
+}
+
+static double elapsed_ms(apr_uint64_t start)
+{
+    return (double)(test_nanos() - start) / 1e6;
+}
+
+int main(int argc, const char * const argv[])
+{
+    struct test_server ts;
+    const int *counts = default_counts;
+    int ncounts = sizeof(default_counts) / sizeof(default_counts[0]);
+    apr_uint64_t *expected;
+    apr_uint64_t start;
+    double startup, fold, restart, ms;
+    int *args, most = 0, i, run;
+
+    if (argc > 1) {
+        args = malloc((argc - 1) * sizeof(*args));
+        for (i = 1; i < argc; i++) {
+            args[i - 1] = atoi(argv[i]);
+            if (args[i - 1] < 1) {
+                fprintf(stderr, "Usage: %s [vhosts...]\n", argv[0]);
+                return 2;
+            }
+        }
+        counts = args;
+        ncounts = argc - 1;
+    }
+    for (i = 0; i < ncounts; i++) {
+        if (counts[i] > most) {
+            most = counts[i];
+        }
+    }
+
+    test_init(&ts, &bmx_vhost_module, bmx_vhost_pre_config,
+              bmx_vhost_post_config);
+    expected = apr_pcalloc(ts.pool, most * sizeof(*expected));
+
+    /* the preflight, which leaves the store alone */
+    if (test_start(&ts, 1) != OK) {
+        return 1;
+    }
+    hit_all(ts.s, expected);
+
+    printf("  vhosts  startup ms  fold ms  restart ms  restart us/vhost\n");
+    for (i = 0; i < ncounts && !test_failures; i++) {
+        startup = fold = restart = -1;
+        for (run = 0; run < RUNS && !test_failures; run++) {
+            /* httpd starting over */
+            test_stop(&ts);
+            test_generation = 0;
+            if (test_config(&ts, counts[i]) != OK) {
+                test_fail("pre_config failed");
+                break;
+            }
+            start = test_nanos();
+            if (test_post_config(&ts) != OK) {
+                test_fail("post_config failed at startup");
+                break;
+            }
+            ms = elapsed_ms(start);
+            if (startup < 0 || ms < startup) {
+                startup = ms;
+            }
+            monitor(&ts);
+            check_forever(ts.s, expected);
+            hit_all(ts.s, expected);
+
+            /* then restarting gracefully */
+            test_generation++;
+            start = test_nanos();
+            test_stop(&ts);
+            ms = elapsed_ms(start);
+            if (fold < 0 || ms < fold) {
+                fold = ms;
+            }
+            if (test_config(&ts, counts[i]) != OK) {
+                test_fail("pre_config failed");
+                break;
+            }
+            start = test_nanos();
+            if (test_post_config(&ts) != OK) {
+                test_fail("post_config failed at a restart");
+                break;
+            }
+            ms = elapsed_ms(start);
+            if (restart < 0 || ms < restart) {
+                restart = ms;
+            }
+            monitor(&ts);
+            check_forever(ts.s, expected);
+            hit_all(ts.s, expected);
+        }
+
+        printf("%8d %11.2f %8.2f %11.2f %17.2f\n", counts[i], startup, fold,
+               restart, restart * 1000 / counts[i]);
+    }
+
+    test_stop(&ts);
+    apr_pool_destroy(ts.pool);
+    return test_failures ? 1 : 0;
+}
@@ -0,0 +1,328 @@
+/*
+ * vhost_scrape.c: Concurrent scrapes of mod_bmx_vhost under load
+ *
+ * See the NOTICE file distributed with this work for information
+ * regarding copyright ownership. This file is licensed to You under
+ * the Apache License, Version 2.0 (the "License"); you may not use
+ * this file except in compliance with the License.  You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Writer threads record requests into their worker slots as fast as they
+ * can, as the logging phase of busy workers does, first alone and then
+ * while scraper threads read every VHost over and over, as a query for all
+ * of them does. Queries only read the worker slots under their sequence
+ * counters and never take a lock, so the latency of recording a request
+ * must not move while they run. The scrapers check that the counters they
+ * read are consistent and never go back, and every count must add up once
+ * the writers are done.
+ *
+ * Usage: vhost_scrape [vhosts [writers [scrapers [requests]]]]
+ */
+
+#include "mod_bmx_vhost.c"
+#include "bmx_test.h"
+
+/** The requests recorded in each batch whose latency is measured */
+#define BATCH 16
+/** How much the median latency of a batch may grow while scraped */
+#define MEDIAN_GROWTH 1.5
+/** How much the 99th percentile latency of a batch may grow */
+#define TAIL_GROWTH 2.0
+
+static int nvhosts = 1000;
+static int nwriters = 4;
+static int nscrapers = 2;
+/** The requests recorded by each writer, alone then while scraped */
+static int nrequests = 1000000;
+
+/**
+ * A writer, recording requests into its own slot.
+ */
+struct writer {
+    int slot;
+    /** The requests it recorded into each VHost, by index */
+    apr_uint64_t *counts;
+    /** The latency of each batch of requests, in nanoseconds */
+    apr_uint32_t *latencies;
+    int nbatches;
+};
+
+/**
+ * A scraper, reading every VHost until told to stop.
+ */
+struct scraper {
+    /** The InRequests of each VHost as last read, by index */
+    apr_uint64_t *last;
+    apr_uint64_t scrapes;
+    /** The reads which were inconsistent or went back */
+    apr_uint64_t errors;
+};
+
+static volatile apr_uint32_t scrapers_stop;
+/** The scrapes which ended, of which the writers wait for scrapes_wanted */
+static volatile apr_uint32_t scrapes_ended;
+static apr_uint32_t scrapes_wanted;
+
+static void * APR_THREAD_FUNC writer_run(apr_thread_t *thread, void *data)
+{
+    struct writer *w = data;
+    struct vhost_sample sample;
+    apr_uint32_t seed = (apr_uint32_t)w->slot * 7919 + 1;
+    apr_uint64_t start;
+    int i, j;
+
+    memset(&sample, 0, sizeof(sample));
+    sample.slot = w->slot;
+    sample.weight = 1;
+
+    /* the latest batches are kept once the scrapers are waited for */
+    for (i = 0; i < w->nbatches
+                || apr_atomic_read32(&scrapes_ended) < scrapes_wanted; i++) {
+        start = test_nanos();
+        for (j = 0; j < BATCH; j++) {
+            seed = seed * 1103515245 + 12345;
+            /* half the requests go to a few busy VHosts */
+            sample.index = (int)((seed >> 8) % ((seed >> 20) & 1
+                                                ? 8 : nvhosts)
+                                 % nvhosts);
+            sample.status = (seed >> 4) % 7 ? 200 : 100 + (seed >> 9) % 500;
+            sample.method_number = (seed >> 3) % 3 ? M_GET : M_POST;
+            sample.duration = seed % 100000;
+            sample.bytes_sent = seed % 65536;
+            sample.out_low_bytes = sample.bytes_sent + 200;
+            sample.in_low_bytes = 400;
+            sample.client_hash = (apr_uint64_t)(seed >> 12)
+                                 * APR_UINT64_C(0x9e3779b97f4a7c15);
+            vhost_sample_record(main_server, &sample);
+            w->counts[sample.index]++;
+        }
+        w->latencies[i % w->nbatches] = (apr_uint32_t)(test_nanos()
+                                                       - start);
+    }
+    return NULL;
+}
+
+/**
+ * Read the given VHost as a query does before printing its beans.
+ */
+static void scrape(struct scraper *sc, const struct bmx_vhost_scfg *scfg,
+                   const struct vhost_live_index *where)
+{
+    struct vhost_timespan live;
+    struct vhost_data vhost_data;
+
+    vhost_live_snapshot(scfg->index, where, &live);
+    vhost_data_snapshot(scfg, &live, &vhost_data);
+
+    if (live.InRequests != live.OutResponses
+        || vhost_data.since_restart.InRequests < sc->last[scfg->index]) {
+        sc->errors++;
+    }
+    sc->last[scfg->index] = vhost_data.since_restart.InRequests;
+}
+
+static void * APR_THREAD_FUNC scraper_run(apr_thread_t *thread, void *data)
+{
+    struct scraper *sc = data;
+    struct vhost_live_index *where;
+    struct bmx_vhost_scfg *scfg;
+    server_rec *vhost;
+    apr_pool_t *p;
+
+    apr_pool_create(&p, NULL);
+    where = vhost_live_index_make(p);
+
+    while (!apr_atomic_read32(&scrapers_stop)) {
+        vhost_live_index_build(where);
+        for (vhost = main_server; vhost; vhost = vhost->next) {
+            scfg = ap_get_module_config(vhost->module_config,
+                                        &bmx_vhost_module);
+            scrape(sc, scfg, where);
+        }
+        scrape(sc, global_scfg, where);
+        sc->scrapes++;
+        apr_atomic_inc32(&scrapes_ended);
+    }
+
+    apr_pool_destroy(p);
+    return NULL;
+}
+
+static int latency_cmp(const void *a, const void *b)
+{
+    apr_uint32_t x = *(const apr_uint32_t *)a;
+    apr_uint32_t y = *(const apr_uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Run the writers with the given number of scrapers, and give the median
+ * and 99th percentile latency of their batches.
+ */
+static void run(apr_pool_t *p, struct writer *writers, int scrapers,
+                apr_uint32_t *median, apr_uint32_t *tail)
+{
+    apr_thread_t **wt = apr_pcalloc(p, nwriters * sizeof(*wt));
+    apr_thread_t **st = apr_pcalloc(p, (scrapers + 1) * sizeof(*st));
+    struct scraper *sc = apr_pcalloc(p, (scrapers + 1) * sizeof(*sc));
+    apr_uint32_t *all;
+    apr_uint64_t scrapes = 0, errors = 0;
+    apr_status_t rv;
+    int i, n = 0;
+
+    /* the writers go on until each scraper could have read every VHost */
+    apr_atomic_set32(&scrapers_stop, 0);
+    apr_atomic_set32(&scrapes_ended, 0);
+    scrapes_wanted = scrapers;
+    for (i = 0; i < scrapers; i++) {
+        sc[i].last = apr_pcalloc(p, vhost_nrecords * sizeof(apr_uint64_t));
+        apr_thread_create(&st[i], NULL, scraper_run, &sc[i], p);
+    }
+    for (i = 0; i < nwriters; i++) {
+        apr_thread_create(&wt[i], NULL, writer_run, &writers[i], p);
+    }
+    for (i = 0; i < nwriters; i++) {
+        apr_thread_join(&rv, wt[i]);
+    }
+    apr_atomic_set32(&scrapers_stop, 1);
+    for (i = 0; i < scrapers; i++) {
+        apr_thread_join(&rv, st[i]);
+        scrapes += sc[i].scrapes;
+        errors += sc[i].errors;
+    }
+
+    all = apr_palloc(p, nwriters * writers[0].nbatches * sizeof(*all));
+    for (i = 0; i < nwriters; i++) {
+        memcpy(all + n, writers[i].latencies,
+               writers[i].nbatches * sizeof(*all));
+        n += writers[i].nbatches;
+    }
+    qsort(all, n, sizeof(*all), latency_cmp);
+    *median = all[n / 2];
+    *tail = all[n - n / 100 - 1];
+
+    printf("%d writers, %d scrapers: %" APR_UINT64_T_FMT " scrapes of %d "
+           "vhosts, %u ns median, %u ns 99th percentile per %d requests\n",
+           nwriters, scrapers, scrapes, nvhosts, *median, *tail, BATCH);
+    if (errors) {
+        test_fail("%" APR_UINT64_T_FMT " reads were inconsistent or went "
+                  "back", errors);
+    }
+}
+
+/**
+ * Check that the counters of every VHost and of the global record add up
+ * to the requests the writers recorded.
+ */
+static void check_counts(struct writer *writers)
+{
+    struct vhost_timespan live;
+    struct bmx_vhost_scfg *scfg;
+    server_rec *vhost;
+    apr_uint64_t expected, total = 0, durations, statuses, methods;
+    int i;
+
+    for (vhost = main_server; vhost; vhost = vhost->next) {
+        scfg = ap_get_module_config(vhost->module_config, &bmx_vhost_module);
+        expected = 0;
+        for (i = 0; i < nwriters; i++) {
+            expected += writers[i].counts[scfg->index];
+        }
+        total += expected;
+
+        vhost_live_snapshot(scfg->index, NULL, &live);
+        durations = 0;
+        for (i = 0; i < VHOST_DURATION_BUCKETS; i++) {
+            durations += live.Duration[i];
+        }
+        statuses = live.StatusesOther;
+        for (i = 0; i < VHOST_STATUS_CODES; i++) {
+            statuses += live.Statuses[i].count;
+        }
+        methods = 0;
+        for (i = 0; i <= VHOST_METHODS; i++) {
+            methods += live.Methods[i];
+        }
+        if (live.InRequests != expected || durations != expected
+            || statuses != expected || methods != expected) {
+            test_fail("%s counted %" APR_UINT64_T_FMT " requests, %"
+                      APR_UINT64_T_FMT " durations, %" APR_UINT64_T_FMT
+                      " statuses and %" APR_UINT64_T_FMT " methods of %"
+                      APR_UINT64_T_FMT, scfg->host, live.InRequests,
+                      durations, statuses, methods, expected);
+        }
+    }
+
+    vhost_live_snapshot(global_scfg->index, NULL, &live);
+    if (live.InRequests != total) {
+        test_fail("the global record counted %" APR_UINT64_T_FMT
+                  " requests of %" APR_UINT64_T_FMT, live.InRequests, total);
+    }
+}
+
+int main(int argc, const char * const argv[])
+{
+    struct test_server ts;
+    struct writer *writers;
+    apr_uint32_t median, tail, scraped_median, scraped_tail;
+    int i;
+
+    if (argc > 1)
+        nvhosts = atoi(argv[1]);
+    if (argc > 2)
+        nwriters = atoi(argv[2]);
+    if (argc > 3)
+        nscrapers = atoi(argv[3]);
+    if (argc > 4)
+        nrequests = atoi(argv[4]);
+    if (nvhosts < 1 || nwriters < 1 || nscrapers < 0 || nrequests < BATCH) {
+        fprintf(stderr, "Usage: %s [vhosts [writers [scrapers "
+                "[requests]]]]\n", argv[0]);
+        return 2;
+    }
+
+    test_threads = nwriters;
+    test_init(&ts, &bmx_vhost_module, bmx_vhost_pre_config,
+              bmx_vhost_post_config);
+    if (test_start(&ts, nvhosts) != OK) {
+        return 1;
+    }
+
+    writers = apr_pcalloc(ts.pool, nwriters * sizeof(*writers));
+    for (i = 0; i < nwriters; i++) {
+        writers[i].slot = i;
+        writers[i].counts = apr_pcalloc(ts.pool, vhost_nrecords
+                                                 * sizeof(apr_uint64_t));
+        writers[i].nbatches = nrequests / BATCH;
+        writers[i].latencies = apr_palloc(ts.pool, writers[i].nbatches
+                                                   * sizeof(apr_uint32_t));
+    }
+
+    run(ts.pool, writers, 0, &median, &tail);
+    run(ts.pool, writers, nscrapers, &scraped_median, &scraped_tail);
+    check_counts(writers);
+
+    if (scraped_median > median * MEDIAN_GROWTH) {
+        test_fail("the median latency went from %u to %u ns when scraped",
+                  median, scraped_median);
+    }
+    if (scraped_tail > tail * TAIL_GROWTH) {
+        test_fail("the 99th percentile latency went from %u to %u ns when "
+                  "scraped", tail, scraped_tail);
+    }
+
+    test_stop(&ts);
+    apr_pool_destroy(ts.pool);
+    return test_failures ? 1 : 0;
+}